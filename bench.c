@@ -0,0 +1,687 @@
+/* --------------------------------------------------------------------------
+ * bench.c
+ *
+ * Micro-benchmark dei percorsi caldi di map.c. Non fa parte del server:
+ * si compila a parte con
+ *   gcc -O2 -Wall bench.c map.c net.c pool.c -o bench -lpthread
+ *
+ * Uso:
+ *   ./bench gen <larghezza> <altezza> [ripetizioni]
+ *   ./bench par <larghezza> <altezza> [max_thread]
+ *   ./bench eller <larghezza> <altezza> [file]   (con file: scrive un file mappa)
+ *   ./bench wire <larghezza> <altezza> [ripetizioni]
+ *   ./bench dist <larghezza> <altezza> [modifiche]
+ *   ./bench moves <larghezza> <altezza> <giocatori> [mosse] [max_thread]
+ *   ./bench claim <larghezza> <altezza> [mosse]
+ *   ./bench storm <host> <porta> <utente> <connessioni> [thread]
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "map.h"
+#include "net.h"
+#include "pool.h"
+
+/* tempo monotono in secondi */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* picco di memoria residente del processo in KiB */
+static long peakRssKb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+/* --------------------------------------------------------------------------
+ * benchGen
+ *
+ * Genera reps labirinti w x h e stampa celle/secondo e picco di RSS.
+ * -------------------------------------------------------------------------- */
+static int benchGen(int w, int h, int reps) {
+    double total = 0;
+    for (int r = 0; r < reps; r++) {
+        double t0 = now();
+        struct grid *map = generateMapSized(w, h, (uint64_t)r + 1); /* semi fissi: run confrontabili */
+        total += now() - t0;
+        if (!map) {
+            fprintf(stderr, "gen: generazione %dx%d fallita\n", w, h);
+            return 1;
+        }
+        freeMap(map);
+    }
+    double cells = (double)(w | 1) * (h | 1) * reps;
+    printf("gen %dx%d x%d: %.3f s, %.2f Mcelle/s, picco RSS %ld KiB\n",
+           w | 1, h | 1, reps, total, cells / total / 1e6, peakRssKb());
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * benchPar
+ *
+ * Confronta la DFS seriale con la generazione per blocchi su 1, 2, 4, ...
+ * maxThreads thread (stesso seme) e stampa tempi e speedup.
+ * -------------------------------------------------------------------------- */
+static int benchPar(int w, int h, int maxThreads) {
+    double t0 = now();
+    struct grid *map = generateMapSized(w, h, 1);
+    double serial = now() - t0;
+    if (!map) {
+        fprintf(stderr, "par: generazione %dx%d fallita\n", w, h);
+        return 1;
+    }
+    double cells = (double)map->width * map->height;
+    freeMap(map);
+    printf("par %dx%d dfs seriale:     %.3f s, %.2f Mcelle/s\n",
+           w | 1, h | 1, serial, cells / serial / 1e6);
+
+    for (int t = 1; ; t = t * 2 > maxThreads && t < maxThreads ? maxThreads : t * 2) {
+        t0 = now();
+        map = generateMapTiled(w, h, 1, t);
+        double el = now() - t0;
+        if (!map) {
+            fprintf(stderr, "par: generazione a blocchi fallita\n");
+            return 1;
+        }
+        freeMap(map);
+        printf("par %dx%d blocchi %2d thr: %.3f s, %.2f Mcelle/s, speedup %.2fx\n",
+               w | 1, h | 1, t, el, cells / el / 1e6, serial / el);
+        if (t >= maxThreads) break;
+    }
+    printf("picco RSS %ld KiB\n", peakRssKb());
+    return 0;
+}
+
+/* sink di benchEller: conta i corridoi senza tenere le righe */
+static int countSink(void *ctx, int row, const char *cells, int width) {
+    long *open = ctx;
+    (void)row;
+    for (int j = 0; j < width; j++) *open += cells[j] != WALL;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * benchEller
+ *
+ * Genera in streaming un labirinto w x h senza mai materializzarlo:
+ * celle/secondo e picco di RSS mostrano che la memoria resta O(larghezza).
+ * -------------------------------------------------------------------------- */
+static int benchEller(int w, int h, const char *path) {
+    long open = 0;
+    double t0 = now();
+    if (path) {
+        if (generateMapToFile(path, w, h, 1) < 0) {
+            perror("eller: generateMapToFile");
+            return 1;
+        }
+        double el = now() - t0;
+        printf("eller %dx%d -> %s: %.3f s, %.2f Mcelle/s, picco RSS %ld KiB\n",
+               w | 1, h | 1, path, el, (double)(w | 1) * (h | 1) / el / 1e6, peakRssKb());
+        return 0;
+    }
+    if (generateMapStream(w, h, 1, countSink, &open) < 0) {
+        fprintf(stderr, "eller: generazione %dx%d fallita\n", w, h);
+        return 1;
+    }
+    double el = now() - t0;
+    double cells = (double)(w | 1) * (h | 1);
+    printf("eller %dx%d: %.3f s, %.2f Mcelle/s, %ld corridoi, picco RSS %ld KiB\n",
+           w | 1, h | 1, el, cells / el / 1e6, open, peakRssKb());
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * benchWire
+ *
+ * Byte sul filo e velocita' di codifica/decodifica di una mappa intera:
+ * un char per cella (copia riga per riga, come prima) contro 2 bit per
+ * cella (packCells/unpackCells). Meta' delle righe e' coperta dalla
+ * nebbia, come a partita in corso.
+ * -------------------------------------------------------------------------- */
+static int benchWire(int w, int h, int reps) {
+    struct grid *map = generateMapSized(w, h, 1);
+    if (!map) {
+        fprintf(stderr, "wire: generazione %dx%d fallita\n", w, h);
+        return 1;
+    }
+    w = map->width;
+    h = map->height;
+    for (int i = 0; i < h; i += 2) memset(gridRow(map, i), '?', w);
+
+    size_t rowBytes = packedRowBytes(w);
+    size_t charBytes = (size_t)w * h, packBytes = rowBytes * h;
+    char *chars = malloc(charBytes), *back = malloc(charBytes);
+    unsigned char *packed = malloc(packBytes);
+    if (!chars || !back || !packed) {
+        fprintf(stderr, "wire: memoria esaurita\n");
+        return 1;
+    }
+
+    double t0 = now();
+    for (int r = 0; r < reps; r++)
+        for (int i = 0; i < h; i++) memcpy(chars + (size_t)i * w, gridRow(map, i), w);
+    double tChar = now() - t0;
+
+    t0 = now();
+    for (int r = 0; r < reps; r++)
+        for (int i = 0; i < h; i++) packCells(gridRow(map, i), w, packed + i * rowBytes);
+    double tPack = now() - t0;
+
+    t0 = now();
+    for (int r = 0; r < reps; r++)
+        for (int i = 0; i < h; i++) unpackCells(packed + i * rowBytes, w, back + (size_t)i * w);
+    double tUnpack = now() - t0;
+
+    if (memcmp(back, map->cells, charBytes) != 0) {
+        fprintf(stderr, "wire: round-trip 2 bit diverso dall'originale\n");
+        return 1;
+    }
+
+    double cells = (double)charBytes * reps;
+    printf("wire %dx%d char:  %zu byte, copia    %.1f Mcelle/s\n", w, h, charBytes, cells / tChar / 1e6);
+    printf("wire %dx%d 2 bit: %zu byte (%.1fx), pack %.1f Mcelle/s, unpack %.1f Mcelle/s\n",
+           w, h, packBytes, (double)charBytes / packBytes, cells / tPack / 1e6, cells / tUnpack / 1e6);
+    free(chars);
+    free(back);
+    free(packed);
+    freeMap(map);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * benchDist
+ *
+ * Verifica gli aggiornamenti incrementali del campo delle distanze: ops
+ * celle a caso cambiano stato (muro tolto o messo) e dopo ognuna il campo
+ * aggiornato con distFieldOpenCell/distFieldCloseCell deve coincidere con
+ * computeDistField sulla mappa modificata. Stampa anche i due tempi.
+ * -------------------------------------------------------------------------- */
+static int benchDist(int w, int h, int ops) {
+    struct grid *map = generateMapSized(w, h, 1);
+    struct distField *df = map ? computeDistField(map) : NULL;
+    if (!df) {
+        fprintf(stderr, "dist: preparazione %dx%d fallita\n", w, h);
+        return 1;
+    }
+    size_t bytes = (size_t)map->width * map->height * sizeof(uint32_t);
+    struct rng rng;
+    rngSeed(&rng, 1);
+    double tInc = 0, tFull = 0;
+    int opened = 0;
+
+    for (int i = 0; i < ops; i++) {
+        int r = rngBelow(&rng, map->height), c = rngBelow(&rng, map->width);
+        int open = gridGet(map, r, c) == WALL;
+        gridSet(map, r, c, open ? PATH : WALL);
+        double t0 = now();
+        int ret = open ? distFieldOpenCell(df, map, r, c) : distFieldCloseCell(df, map, r, c);
+        tInc += now() - t0;
+
+        t0 = now();
+        struct distField *full = computeDistField(map);
+        tFull += now() - t0;
+        if (ret < 0 || !full) {
+            fprintf(stderr, "dist: memoria esaurita\n");
+            return 1;
+        }
+        if (memcmp(df->dist, full->dist, bytes) != 0) {
+            size_t k = 0;
+            while (df->dist[k] == full->dist[k]) k++;
+            fprintf(stderr, "dist: dopo %d modifiche (%s %d,%d) cella %zu,%zu vale %u invece di %u\n",
+                    i + 1, open ? "aperta" : "chiusa", r, c, k / map->width, k % map->width,
+                    df->dist[k], full->dist[k]);
+            return 1;
+        }
+        freeDistField(full);
+        opened += open;
+    }
+    printf("dist %dx%d: %d modifiche (%d aperture), incrementale %.2f us/mod, ricalcolo %.2f us/mod\n",
+           map->width, map->height, ops, opened, tInc / ops * 1e6, tFull / ops * 1e6);
+    freeDistField(df);
+    freeMap(map);
+    return 0;
+}
+
+/* giocatore simulato di benchMoves: lo stato che il server tiene in struct data */
+struct benchPlayer {
+    struct poolStrand strand;
+    pthread_mutex_t lock;
+    int x, y;
+    struct bitmap *visited;
+    struct fogState fog;
+    struct rng rng;
+    int done;               // mosse eseguite: deve coincidere con seq
+    int outOfOrder;
+    unsigned sink;          // distanze sommate, perche' il lavoro non sparisca
+};
+
+struct benchMoveTask {
+    struct benchPlayer *p;
+    int seq;
+};
+
+static struct grid *gBenchMap;
+static struct distField *gBenchDist;
+static struct cellJournal gBenchJournal;
+
+/* una mossa come in handleCommand, senza log e senza socket */
+static void benchMove(void *arg) {
+    struct benchMoveTask *t = arg;
+    struct benchPlayer *p = t->p;
+    static const char dirs[4] = { 'W', 'A', 'S', 'D' };
+    char frame[ADJ_FRAME_MAX];
+
+    pthread_mutex_lock(&p->lock);
+    if (p->done++ != t->seq) p->outOfOrder = 1;
+    char dir = dirs[rngBelow(&p->rng, 4)];
+    enum moveResult res = applyMove(gBenchMap, p->visited, &p->fog, &gBenchJournal, &p->x, &p->y, dir);
+    if (res != MOVE_EXIT) {
+        p->sink += distAt(gBenchDist, p->x, p->y);
+        p->sink += buildAdjacentFrame(frame, gBenchMap, p->x, p->y);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* un giro di benchMoves con t thread: secondi, o -1 se qualcosa va storto */
+static double movesRound(int w, int h, struct benchPlayer *players, int nPlayers,
+                         struct benchMoveTask *tasks, int moves, int t) {
+    // mappa e giocatori nuovi a ogni giro: stessi oggetti, stesse mosse
+    gBenchMap = generateMapSized(w, h, 1);
+    gBenchDist = gBenchMap ? computeDistField(gBenchMap) : NULL;
+    struct pool *pool = poolCreate(t);
+    if (!gBenchMap || !gBenchDist || !pool || journalInit(&gBenchJournal, gBenchMap) < 0) {
+        fprintf(stderr, "moves: preparazione fallita\n");
+        return -1;
+    }
+    for (int i = 0; i < nPlayers; i++) {
+        struct benchPlayer *p = &players[i];
+        poolStrandInit(&p->strand, pool);
+        pthread_mutex_init(&p->lock, NULL);
+        rngSeed(&p->rng, (uint64_t)i + 1);
+        do {
+            p->x = rngBelow(&p->rng, gBenchMap->height);
+            p->y = rngBelow(&p->rng, gBenchMap->width);
+        } while (gridGet(gBenchMap, p->x, p->y) != PATH);
+        p->visited = allocBitmap(gBenchMap->width, gBenchMap->height);
+        if (!p->visited || fogInit(&p->fog, gBenchMap->width, gBenchMap->height) < 0) {
+            fprintf(stderr, "moves: memoria esaurita (%d giocatori)\n", nPlayers);
+            return -1;
+        }
+        p->done = p->outOfOrder = 0;
+    }
+
+    // arrivano a turno, come dai socket: una mossa per giocatore a giro
+    double t0 = now();
+    for (int m = 0; m < moves; m++) {
+        for (int i = 0; i < nPlayers; i++) {
+            struct benchMoveTask *task = &tasks[(size_t)m * nPlayers + i];
+            task->p = &players[i];
+            task->seq = m;
+            poolStrandSubmit(&players[i].strand, benchMove, task);
+        }
+    }
+    poolDrain(pool);
+    double el = now() - t0;
+
+    int bad = 0;
+    for (int i = 0; i < nPlayers; i++) {
+        bad |= players[i].outOfOrder || players[i].done != moves;
+        freeBitmap(players[i].visited);
+        fogFree(&players[i].fog);
+    }
+    poolDestroy(pool);
+    freeDistField(gBenchDist);
+    freeMap(gBenchMap);
+    journalFree(&gBenchJournal);
+    if (bad) {
+        fprintf(stderr, "moves: mosse di un giocatore fuori ordine o perse\n");
+        return -1;
+    }
+    return el;
+}
+
+/* --------------------------------------------------------------------------
+ * benchMoves
+ *
+ * Mosse al secondo del percorso dei comandi del server (pool con work
+ * stealing, una strand per giocatore, mossa senza lock, adiacenza) con
+ * nPlayers giocatori e 1, 2, 4, ... maxThreads thread nel pool. Controlla
+ * anche che le mosse di ogni giocatore girino nell'ordine di invio.
+ *
+ * Un primo giro a vuoto scalda cache, allocatore e pagine; poi per ogni
+ * numero di thread vale il migliore di MOVES_REPEAT giri, cosi' anche la
+ * base a un thread non paga il primo avvio.
+ * -------------------------------------------------------------------------- */
+#define MOVES_REPEAT 3
+
+static int benchMoves(int w, int h, int nPlayers, int moves, int maxThreads) {
+    struct benchPlayer *players = calloc(nPlayers, sizeof(struct benchPlayer));
+    struct benchMoveTask *tasks = malloc((size_t)nPlayers * moves * sizeof(struct benchMoveTask));
+    if (!players || !tasks) {
+        fprintf(stderr, "moves: memoria esaurita\n");
+        return 1;
+    }
+    if (movesRound(w, h, players, nPlayers, tasks, moves, 1) < 0) return 1;
+    double base = 0;
+
+    for (int t = 1; ; t = t * 2 > maxThreads && t < maxThreads ? maxThreads : t * 2) {
+        double el = 0;
+        for (int r = 0; r < MOVES_REPEAT; r++) {
+            double e = movesRound(w, h, players, nPlayers, tasks, moves, t);
+            if (e < 0) return 1;
+            if (r == 0 || e < el) el = e;
+        }
+        if (t == 1) base = el;
+        printf("moves %dx%d %d giocatori %2d thr: %.3f s, %.2f Mmosse/s, speedup %.2fx\n",
+               w | 1, h | 1, nPlayers, t, el,
+               (double)nPlayers * moves / el / 1e6, base / el);
+        if (t >= maxThreads) break;
+    }
+    printf("picco RSS %ld KiB\n", peakRssKb());
+    free(tasks);
+    free(players);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * benchClaim
+ *
+ * Contesa sulla mappa: 1, 8 e 64 thread che si muovono a caso sulla
+ * stessa mappa, ognuno come un giocatore, prima con un mutex attorno a
+ * applyMove (il vecchio lock della mappa) e poi senza, con la sola
+ * compare-and-swap sugli oggetti. Le mosse totali sono le stesse per
+ * ogni giro. Il tempo va dalla prima partenza all'ultimo arrivo dei
+ * thread, misurati da loro stessi: con piu' thread che core il main puo'
+ * tornare dalla barriera quando i mover hanno gia' finito. Controlla che
+ * ogni oggetto sia stato raccolto al piu' una volta: raccolti = voci del
+ * diario = oggetti spariti dalla mappa.
+ * -------------------------------------------------------------------------- */
+struct claimThread {
+    pthread_t tid;
+    int id;
+    int moves;
+    int locked;
+    long claimed;
+    double start, end;          // tempi del ciclo delle mosse
+};
+
+static pthread_mutex_t gClaimMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t gClaimStart;
+
+static size_t countItems(const struct grid *map) {
+    size_t n = 0;
+    for (int r = 0; r < map->height; r++)
+        for (int c = 0; c < map->width; c++) n += gridGet(map, r, c) == ITEM;
+    return n;
+}
+
+static void *claimMover(void *arg) {
+    struct claimThread *ct = arg;
+    static const char dirs[4] = { 'W', 'A', 'S', 'D' };
+    struct rng rng;
+    struct fogState fog;
+    struct bitmap *visited = allocBitmap(gBenchMap->width, gBenchMap->height);
+    rngSeed(&rng, (uint64_t)ct->id + 1);
+    if (!visited || fogInit(&fog, gBenchMap->width, gBenchMap->height) < 0) {
+        fprintf(stderr, "claim: memoria esaurita\n");
+        exit(1);
+    }
+    int x, y;
+    do {
+        x = rngBelow(&rng, gBenchMap->height);
+        y = rngBelow(&rng, gBenchMap->width);
+    } while (gridGetRelaxed(gBenchMap, x, y) == WALL);
+
+    pthread_barrier_wait(&gClaimStart);
+    ct->start = now();
+    for (int m = 0; m < ct->moves; m++) {
+        char dir = dirs[rngBelow(&rng, 4)];
+        if (ct->locked) pthread_mutex_lock(&gClaimMutex);
+        enum moveResult res = applyMove(gBenchMap, visited, &fog, &gBenchJournal, &x, &y, dir);
+        if (ct->locked) pthread_mutex_unlock(&gClaimMutex);
+        if (res == MOVE_ITEM) ct->claimed++;
+        else if (res == MOVE_EXIT) {
+            // uscito: rientra da un'altra parte, come un nuovo giocatore
+            do {
+                x = rngBelow(&rng, gBenchMap->height);
+                y = rngBelow(&rng, gBenchMap->width);
+            } while (gridGetRelaxed(gBenchMap, x, y) == WALL);
+        }
+    }
+    ct->end = now();
+    freeBitmap(visited);
+    fogFree(&fog);
+    return NULL;
+}
+
+static int benchClaim(int w, int h, int moves) {
+    static const int counts[] = { 1, 8, 64 };
+    struct claimThread th[64];
+
+    for (int k = 0; k < 3; k++) {
+        int n = counts[k];
+        double rate[2];
+        for (int locked = 1; locked >= 0; locked--) {
+            // stessa mappa per i due giri: stessi oggetti da contendersi
+            gBenchMap = generateMapSized(w, h, 1);
+            if (!gBenchMap || journalInit(&gBenchJournal, gBenchMap) < 0) {
+                fprintf(stderr, "claim: preparazione fallita\n");
+                return 1;
+            }
+            size_t before = countItems(gBenchMap);
+            pthread_barrier_init(&gClaimStart, NULL, n + 1);
+            for (int i = 0; i < n; i++) {
+                th[i] = (struct claimThread){ .id = i, .moves = moves / n, .locked = locked };
+                if (pthread_create(&th[i].tid, NULL, claimMover, &th[i]) != 0) {
+                    fprintf(stderr, "claim: pthread_create fallita\n");
+                    return 1;
+                }
+            }
+            pthread_barrier_wait(&gClaimStart);
+            long claimed = 0;
+            double first = 0, last = 0;
+            for (int i = 0; i < n; i++) {
+                pthread_join(th[i].tid, NULL);
+                claimed += th[i].claimed;
+                if (i == 0 || th[i].start < first) first = th[i].start;
+                if (i == 0 || th[i].end > last) last = th[i].end;
+            }
+            double el = last - first;
+            pthread_barrier_destroy(&gClaimStart);
+
+            size_t after = countItems(gBenchMap);
+            if ((size_t)claimed != journalEnd(&gBenchJournal, 0) || before - after != (size_t)claimed) {
+                fprintf(stderr, "claim: %ld raccolti, %zu nel diario, %zu spariti dalla mappa\n",
+                        claimed, journalEnd(&gBenchJournal, 0), before - after);
+                return 1;
+            }
+            rate[locked] = (double)(moves / n) * n / el;
+            printf("claim %dx%d %2d thr %-5s: %.3f s, %.2f Mmosse/s, %ld oggetti su %zu\n",
+                   gBenchMap->width, gBenchMap->height, n, locked ? "mutex" : "cas", el,
+                   rate[locked] / 1e6, claimed, before);
+            freeMap(gBenchMap);
+            journalFree(&gBenchJournal);
+        }
+        printf("claim %2d thr: cas/mutex %.2fx\n", n, rate[0] / rate[1]);
+    }
+    return 0;
+}
+
+struct stormThread {
+    pthread_t tid;
+    int nConn;
+    double *lobby;              /* connect -> MSG_YES, una voce per connessione */
+    int ok, refused, failed;
+    double lastAccept;          /* istante dell'ultimo MSG_ACCEPTED            */
+};
+
+static struct addrinfo *gStormAddr;
+static const char *gStormUser;
+
+/* aspetta un frame di tipo want; 0 ok, 1 se arriva MSG_REFUSED/MSG_NO, -1 errore */
+static int stormExpect(int fd, char want) {
+    char type;
+    char *payload;
+    uint32_t len;
+    for (;;) {
+        if (recvFrame(fd, &type, &payload, &len) < 0) return -1;
+        free(payload);
+        if (type == want) return 0;
+        if (type == MSG_REFUSED || type == MSG_NO) return 1;
+        // MSG_COUNT, MSG_USERS...: non interessano
+    }
+}
+
+/* una connessione alla volta: connect, MSG_ACCEPTED, login, MSG_YES, chiusura */
+static void *stormWorker(void *arg) {
+    struct stormThread *st = arg;
+    for (int i = 0; i < st->nConn; i++) {
+        double t0 = now();
+        int fd = socket(gStormAddr->ai_family, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, gStormAddr->ai_addr, gStormAddr->ai_addrlen) < 0) {
+            if (fd >= 0) close(fd);
+            st->failed++;
+            continue;
+        }
+        int res = stormExpect(fd, MSG_ACCEPTED);
+        if (res == 0) {
+            st->lastAccept = now();
+            if (sendFrame(fd, MSG_LOGIN, gStormUser, strlen(gStormUser)) < 0) res = -1;
+            else res = stormExpect(fd, MSG_YES);
+        }
+        close(fd);
+        if (res == 0) st->lobby[st->ok++] = now() - t0;
+        else if (res == 1) st->refused++;
+        else st->failed++;
+    }
+    return NULL;
+}
+
+static int cmpDouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* --------------------------------------------------------------------------
+ * benchStorm
+ *
+ * Tempesta di connessioni contro un server gia' avviato: nThreads thread
+ * aprono in tutto nConn connessioni, ognuna fa login con un utente gia'
+ * registrato e si chiude appena e' in lobby. Stampa le accept al secondo
+ * (connessioni accettate fino all'ultimo MSG_ACCEPTED) e il tempo medio e
+ * al 99-esimo percentile fino alla lobby. Per confrontare un processo con
+ * N processi su SO_REUSEPORT si lancia il server con -P 1 e poi -P N, con
+ * -r abbastanza alto da non rifiutare connessioni.
+ * -------------------------------------------------------------------------- */
+static int benchStorm(const char *host, const char *port, const char *user, int nConn, int nThreads) {
+    struct addrinfo hints = { 0 };
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &gStormAddr) != 0) {
+        fprintf(stderr, "storm: indirizzo %s:%s non valido\n", host, port);
+        return 1;
+    }
+    gStormUser = user;
+
+    struct stormThread *th = calloc(nThreads, sizeof(struct stormThread));
+    double *lobby = malloc(nConn * sizeof(double));
+    if (!th || !lobby) {
+        fprintf(stderr, "storm: memoria esaurita\n");
+        return 1;
+    }
+    double t0 = now();
+    for (int i = 0, off = 0; i < nThreads; i++) {
+        th[i].nConn = nConn / nThreads + (i < nConn % nThreads);
+        th[i].lobby = lobby + off;
+        off += th[i].nConn;
+        if (pthread_create(&th[i].tid, NULL, stormWorker, &th[i]) != 0) {
+            fprintf(stderr, "storm: impossibile creare i thread\n");
+            return 1;
+        }
+    }
+
+    int ok = 0, refused = 0, failed = 0;
+    double last = t0;
+    for (int i = 0; i < nThreads; i++) {
+        pthread_join(th[i].tid, NULL);
+        // compatta i tempi: ogni thread ha riempito solo le prime ok voci
+        memmove(lobby + ok, th[i].lobby, th[i].ok * sizeof(double));
+        ok += th[i].ok;
+        refused += th[i].refused;
+        failed += th[i].failed;
+        if (th[i].lastAccept > last) last = th[i].lastAccept;
+    }
+    double el = now() - t0;
+    freeaddrinfo(gStormAddr);
+
+    printf("storm %s:%s %d conn %d thr: %.3f s, %d in lobby, %d rifiutate, %d fallite\n",
+           host, port, nConn, nThreads, el, ok, refused, failed);
+    if (ok > 0) {
+        double sum = 0;
+        for (int i = 0; i < ok; i++) sum += lobby[i];
+        qsort(lobby, ok, sizeof(double), cmpDouble);
+        printf("storm: %.0f accept/s, fino alla lobby media %.3f ms, p99 %.3f ms\n",
+               (ok + refused) / (last - t0), sum / ok * 1e3, lobby[(ok - 1) * 99 / 100] * 1e3);
+    }
+    free(lobby);
+    free(th);
+    return failed > 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 4 && strcmp(argv[1], "gen") == 0) {
+        int reps = argc >= 5 ? atoi(argv[4]) : 1;
+        return benchGen(atoi(argv[2]), atoi(argv[3]), reps > 0 ? reps : 1);
+    }
+    if (argc >= 4 && strcmp(argv[1], "par") == 0) {
+        int maxThreads = argc >= 5 ? atoi(argv[4]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        return benchPar(atoi(argv[2]), atoi(argv[3]), maxThreads > 0 ? maxThreads : 1);
+    }
+    if (argc >= 4 && strcmp(argv[1], "eller") == 0)
+        return benchEller(atoi(argv[2]), atoi(argv[3]), argc >= 5 ? argv[4] : NULL);
+    if (argc >= 4 && strcmp(argv[1], "wire") == 0) {
+        int reps = argc >= 5 ? atoi(argv[4]) : 10;
+        return benchWire(atoi(argv[2]), atoi(argv[3]), reps > 0 ? reps : 1);
+    }
+    if (argc >= 4 && strcmp(argv[1], "dist") == 0) {
+        int ops = argc >= 5 ? atoi(argv[4]) : 1000;
+        return benchDist(atoi(argv[2]), atoi(argv[3]), ops > 0 ? ops : 1);
+    }
+    if (argc >= 5 && strcmp(argv[1], "moves") == 0) {
+        int moves = argc >= 6 ? atoi(argv[5]) : 100;
+        int maxThreads = argc >= 7 ? atoi(argv[6]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        int nPlayers = atoi(argv[4]);
+        if (nPlayers < 1) nPlayers = 1;
+        return benchMoves(atoi(argv[2]), atoi(argv[3]), nPlayers,
+                          moves > 0 ? moves : 1, maxThreads > 0 ? maxThreads : 1);
+    }
+    if (argc >= 6 && strcmp(argv[1], "storm") == 0) {
+        int nConn = atoi(argv[5]);
+        int nThreads = argc >= 7 ? atoi(argv[6]) : 16;
+        if (nConn < 1) nConn = 1;
+        if (nThreads < 1) nThreads = 1;
+        return benchStorm(argv[2], argv[3], argv[4], nConn, nThreads < nConn ? nThreads : nConn);
+    }
+    if (argc >= 4 && strcmp(argv[1], "claim") == 0) {
+        int moves = argc >= 5 ? atoi(argv[4]) : 4000000;
+        return benchClaim(atoi(argv[2]), atoi(argv[3]), moves >= 64 ? moves : 64);
+    }
+    fprintf(stderr, "Uso: %s gen <larghezza> <altezza> [ripetizioni]\n"
+                    "     %s par <larghezza> <altezza> [max_thread]\n"
+                    "     %s eller <larghezza> <altezza> [file]\n"
+                    "     %s wire <larghezza> <altezza> [ripetizioni]\n"
+                    "     %s dist <larghezza> <altezza> [modifiche]\n"
+                    "     %s moves <larghezza> <altezza> <giocatori> [mosse] [max_thread]\n"
+                    "     %s storm <host> <porta> <utente> <connessioni> [thread]\n"
+                    "     %s claim <larghezza> <altezza> [mosse]\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
@@ -2,28 +2,43 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <signal.h>
 #include "map.h"
+#include "net.h"
 
 /* --------------------------------------------------------------------------
  * Sincronizzazione
  *
  * socketMutex -> evita che main e thread leggano dal socket contemporaneamente
  * endMutex    -> protegge la variabile end (fine partita per timeout/uscita)
+ * knowMutex   -> protegge knowledge (nebbia lato client); dopo socketMutex
  * exitMutex   -> riservato per estensioni future
  * exitCond    -> condizione associata a exitMutex
  * -------------------------------------------------------------------------- */
 pthread_mutex_t socketMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t endMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t knowMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t exitMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t exitCond = PTHREAD_COND_INITIALIZER;
 int exitGame = 0;
 int end = 0;
 int terminate = 0;
+
+/*
+ * Nebbia lato client (opzione -f): la mappa nota persistente. Ogni risposta
+ * a una mossa ci scrive le celle rivelate, MSG_ITEMS toglie gli oggetti
+ * raccolti da altri; la nebbia ('?') e' cio' che non e' mai arrivato.
+ */
+int clientFog = 0;
+struct grid *knowledge = NULL;
+
+/* riga di legenda sotto la mappa (lo spettatore ne usa una sua) */
+const char *mapLegend = "X=tu  +=item  ?=nebbia  #=muro";
 /* --------------------------------------------------------------------------
  * Struttura argomenti per il thread di ascolto asincrono.
  * Contiene il socket e i puntatori alle variabili di stato della mappa,
@@ -35,9 +50,6 @@ struct thread_args {
     int *height;
     int *x;
     int *y;
-    int *effectiveRows;
-    int *effectiveCols;
-    char ***map;
 };
 
 /* --------------------------------------------------------------------------
@@ -48,8 +60,9 @@ static void printSeparator(char c, int n) {
     putchar('\n');
 }
 
-static void printMapUI(char **map, int cols, int rows, int x, int y, const char *title) {
+static void printMapUI(const struct grid *map, int x, int y, const char *title) {
     if (!map) return;
+    int cols = map->width, rows = map->height;
     int w = cols + 2; /* larghezza bordo: mappa + 2 caratteri '|' */
 
     printf("\n");
@@ -64,12 +77,8 @@ static void printMapUI(char **map, int cols, int rows, int x, int y, const char
 
     for (int i = 0; i < rows; i++) {
         printf("  |");
-        for (int j = 0; j < cols; j++) {
-            //if (i == x && j == y)
-            //    putchar('X');
-            //else
-                putchar(map[i][j]);
-        }
+        /* la riga e' contigua: una sola fwrite invece di cols putchar */
+        fwrite(gridRow(map, i), 1, cols, stdout);
         printf("|\n");
     }
 
@@ -78,7 +87,147 @@ static void printMapUI(char **map, int cols, int rows, int x, int y, const char
     for (int j = 0; j < cols; j++) putchar('-');
     printf("+\n");
 
-    printf("  Legenda: X=tu  +=item  ?=nebbia  #=muro\n");
+    printf("  Legenda: %s\n", mapLegend);
+}
+
+/* stampa la mappa nota con la X del giocatore in (x, y) */
+static void printKnown(int x, int y, const char *title) {
+    pthread_mutex_lock(&knowMutex);
+    if (knowledge) {
+        char under = gridGet(knowledge, x, y);
+        gridSet(knowledge, x, y, 'X');
+        printMapUI(knowledge, x, y, title);
+        gridSet(knowledge, x, y, under);
+    }
+    pthread_mutex_unlock(&knowMutex);
+}
+
+/*
+ * Nebbia lato client: riceve la risposta a una mossa (MSG_ADJACENT o
+ * MSG_PATH) e la scrive nella mappa nota, creandola alla prima. Ritorna
+ * 0 se ok, -1 su errore o frame inatteso.
+ */
+static int receiveReveal(int sockfd, int *width, int *height, int *x, int *y) {
+    char type, *payload;
+    uint32_t len;
+    if (recvFrame(sockfd, &type, &payload, &len) < 0) return -1;
+    int ret = -1;
+    pthread_mutex_lock(&knowMutex);
+    if (!knowledge && len >= 8 && (type == MSG_ADJACENT || type == MSG_PATH)) {
+        *width  = (int)get32(payload);
+        *height = (int)get32(payload + 4);
+        if (*width > 0 && *height > 0) knowledge = allocGrid(*width, *height, '?');
+    }
+    if (knowledge) ret = applyRevealFrame(knowledge, type, payload, len, x, y);
+    pthread_mutex_unlock(&knowMutex);
+    free(payload);
+    return ret;
+}
+
+/* Riceve un frame e ne restituisce il tipo scartando il payload (0 se errore) */
+static char recvType(int sockfd) {
+    char type, *payload;
+    uint32_t len;
+    if (recvFrame(sockfd, &type, &payload, &len) < 0) return 0;
+    free(payload);
+    return type;
+}
+
+/*
+ * Disegna la mappa dello spettatore con i giocatori di un MSG_WATCH
+ * (dopo gli oggetti, da off): cifre 1..9 sulla mappa, elenco sotto.
+ * Ritorna -1 se il frame e' malformato.
+ */
+static int printWatch(const struct grid *world, const char *payload, uint32_t len, uint32_t off, int room) {
+    if (off > len || len - off < 4) return -1;
+    uint32_t n = get32(payload + off);
+    off += 4;
+
+    struct grid *view = allocGrid(world->width, world->height, ' ');
+    if (!view) return -1;
+    for (int i = 0; i < world->height; i++)
+        memcpy(gridRow(view, i), gridRow(world, i), world->width);
+
+    char lines[9][320];
+    uint32_t shown = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (len - off < 17 || len - off - 17 < get32(payload + off + 13)) {
+            freeMap(view);
+            return -1;
+        }
+        uint32_t px = get32(payload + off), py = get32(payload + off + 4);
+        uint32_t items = get32(payload + off + 8), nameLen = get32(payload + off + 13);
+        char status = payload[off + 12];
+        const char *name = payload + off + 17;
+        off += 17 + nameLen;
+        if (shown == 9) continue;   /* oltre nove giocatori non ci sono cifre */
+        if (px < (uint32_t)view->height && py < (uint32_t)view->width && status == 0)
+            gridSet(view, px, py, '1' + shown);
+        snprintf(lines[shown], sizeof(lines[shown]), "  %c = %.*s  oggetti %u  %s", '1' + shown,
+                 nameLen > 256 ? 256 : (int)nameLen, name, items,
+                 status == 0 ? "(in gioco)" : status == 1 ? "(uscito)" : "(fuori)");
+        shown++;
+    }
+
+    char title[64];
+    if (room > 0) snprintf(title, sizeof(title), "STANZA %d (spettatore)", room);
+    else snprintf(title, sizeof(title), "PARTITA (spettatore)");
+    system("clear");
+    printMapUI(view, 0, 0, title);
+    for (uint32_t i = 0; i < shown; i++) printf("%s\n", lines[i]);
+    fflush(stdout);
+    freeMap(view);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * watchMatch
+ *
+ * Modalita' spettatore (voce 4 del menu): chiede al server di osservare la
+ * stanza room (0 = quella in cui si e' entrati). Il server manda la mappa
+ * vera una volta (MSG_WORLD), poi a ogni giro gli oggetti raccolti e le
+ * posizioni dei giocatori (MSG_WATCH); a fine partita MSG_END con il
+ * nome del vincitore. Nessun comando da inviare: solo ricezione.
+ * -------------------------------------------------------------------------- */
+static int watchMatch(int sockfd, uint32_t room) {
+    char id[4];
+    put32(id, room);
+    sendFrame(sockfd, MSG_SPECTATE, id, sizeof(id));
+    if (recvType(sockfd) != MSG_YES) {
+        printf("  [ERRORE] Stanza inesistente o partita gia' finita.\n");
+        return 1;
+    }
+    mapLegend = "1-9=giocatori  +=item  #=muro";
+    printf("  [OK] In attesa della mappa...\n");
+    fflush(stdout);
+
+    struct grid *world = NULL;
+    char type, *payload;
+    uint32_t len;
+    while (recvFrame(sockfd, &type, &payload, &len) == 0) {
+        int bad = 0;
+        if (type == MSG_WORLD) {
+            freeMap(world);
+            world = decodeWorldFrame(payload, len);
+            bad = !world;
+        } else if (type == MSG_WATCH && world) {
+            /* gli oggetti raccolti hanno il formato di MSG_ITEMS */
+            bad = applyItemEvents(world, payload, len) < 0 ||
+                  printWatch(world, payload, len, 4 + 4 * get32(payload), room) < 0;
+        } else if (type == MSG_END) {
+            printf("\n  Partita finita: vincitore '%.*s'\n", (int)len, len ? payload : "nessuno");
+            free(payload);
+            freeMap(world);
+            return 0;
+        }
+        free(payload);
+        if (bad) {
+            printf("  [ERRORE] Frame non valido dal server.\n");
+            break;
+        }
+    }
+    freeMap(world);
+    return 1;
 }
 
 /* Lettura thread-safe di end */
@@ -104,26 +253,36 @@ void sendCommand(int sockfd, const char * command) {
     }
     if(strcmp(command, "list") == 0) {
         system("clear");
-        int nUsr;
-        int dimUsr;
-        char username[256];
-        send(sockfd, "list", 4, 0);
+        char type, *payload;
+        uint32_t len;
+        sendFrame(sockfd, MSG_COMMAND, "list", 4);
 
         printf("\n+----------------------+\n");
         printf(  "|  GIOCATORI ONLINE    |\n");
         printf(  "+----------------------+\n");
 
-        recv(sockfd, &nUsr, sizeof(nUsr), 0);
-            for (int i = 0; i < nUsr; i++) {
-                recv(sockfd, &dimUsr, sizeof(dimUsr), 0);
-                recv(sockfd, username, dimUsr, 0);
-                username[dimUsr] = '\0';
-                printf("  %d. %.*s\n", i + 1, dimUsr, username);
+        /* un aggiornamento della nebbia puo' arrivare prima della lista: si scarta */
+        while (recvFrame(sockfd, &type, &payload, &len) == 0) {
+            if (type != MSG_USERS) {
+                free(payload); /* il delta perso verra' recuperato con un resync */
+                continue;
             }
+            const char *p = payload, *endp = payload + len;
+            uint32_t nUsr = len >= 4 ? get32(p) : 0;
+            p += 4;
+            for (uint32_t i = 0; i < nUsr && endp - p >= 4; i++) {
+                uint32_t dimUsr = get32(p);
+                if (dimUsr > (uint32_t)(endp - p - 4)) break;
+                printf("  %u. %.*s\n", i + 1, (int)dimUsr, p + 4);
+                p += 4 + dimUsr;
+            }
+            free(payload);
+            break;
+        }
         printf("+----------------------+\n");
         return; // evita la send doppia a fine funzione
     }
-    send(sockfd, command, strlen(command), 0);
+    sendFrame(sockfd, MSG_COMMAND, command, strlen(command));
 }
 
 /* Gestore SIGUSR1: inviato dal thread al processo principale per forzarne
@@ -137,13 +296,17 @@ void handler(int signum) {
  *
  * Gira in background durante tutta la partita. Ad ogni iterazione controlla
  * se il server ha inviato qualcosa senza bloccare il main, usando
- * MSG_PEEK | MSG_DONTWAIT per sbirciare il primo byte senza consumarlo.
+ * MSG_PEEK | MSG_DONTWAIT per sbirciare il primo byte (il tipo del frame)
+ * senza consumarlo.
  *
- * Messaggi gestiti:
- *   'M' -> fine partita (timer scaduto); segnala al main tramite end=1
- *   'E' -> fine sessione; segue 'W' (vittoria) o 'L' (sconfitta),
- *          stampa il risultato e termina il processo via SIGUSR1
- *   'B' -> mappa aggiornata con nebbia in arrivo; ricevi e stampa subito
+ * Frame gestiti:
+ *   MSG_EXIT_FOUND -> uscita trovata; segnala al main tramite end=1
+ *   MSG_END        -> fine sessione; segue MSG_WIN o MSG_LOSE,
+ *                     stampa il risultato e termina il processo via SIGUSR1
+ *   MSG_BLURRED    -> mappa intera con nebbia (keyframe): diventa la mappa nota
+ *   MSG_DELTA      -> celle cambiate: applicate alla mappa nota; se il delta
+ *                     e' fuori sequenza si chiede un keyframe (MSG_RESYNC)
+ *   MSG_ITEMS      -> (nebbia lato client) oggetti spariti da celle note
  *
  * Il mutex socketMutex e' necessario perche' il main usa lo stesso socket
  * per inviare comandi e ricevere la mappa aggiornata dopo ogni mossa.
@@ -151,6 +314,8 @@ void handler(int signum) {
 void *silentWaitBlurredMap(void *arg) {
     struct thread_args *args = (struct thread_args *)arg;
     char type;
+    struct grid *known = NULL; /* mappa nota senza la X del giocatore */
+    uint32_t seq = 0;          /* ultimo delta applicato               */
 
     while(1) {
         pthread_mutex_lock(&socketMutex);
@@ -161,9 +326,9 @@ void *silentWaitBlurredMap(void *arg) {
         /* MSG_DONTWAIT impedisce al thread di bloccarsi se non c'e' nulla */
         int n = recv(args->sockfd, &type, sizeof(char), MSG_PEEK | MSG_DONTWAIT);
         pthread_mutex_unlock(&socketMutex);
-        if(n>0 && type == 'M') {
+        if(n>0 && type == MSG_EXIT_FOUND) {
             pthread_mutex_lock(&socketMutex);
-            recv(args->sockfd, &type, sizeof(char), 0); // consuma 'M'
+            recvType(args->sockfd); // consuma il frame
             pthread_mutex_unlock(&socketMutex);
             printf("\n======================================\n");
             printf("  HAI RAGGIUNTO L'USCITA!\n");
@@ -175,19 +340,18 @@ void *silentWaitBlurredMap(void *arg) {
             end = 1;
             pthread_mutex_unlock(&endMutex);
         }
-        if(n > 0 && type == 'E') {
-            /* fine sessione: consuma 'E', leggi W o L e stampa il risultato */
-            char wol[2];
+        if(n > 0 && type == MSG_END) {
+            /* fine sessione: consuma MSG_END, leggi W o L e stampa il risultato */
             pthread_mutex_lock(&socketMutex);
-            recv(args->sockfd, &type, sizeof(char), 0);
-            int n = recv(args->sockfd, wol, 1, 0);
+            recvType(args->sockfd);
+            char wol = recvType(args->sockfd);
             pthread_mutex_unlock(&socketMutex);
             system("clear");
-            if(n > 0 && wol[0] == 'W') {
+            if(wol == MSG_WIN) {
                 printf("\n======================================\n");
                 printf("           VITTORIA!\n");
                 printf("======================================\n\n");
-            } else if(n > 0 && wol[0] == 'L') {
+            } else if(wol == MSG_LOSE) {
                 printf("\n======================================\n");
                 printf("           SCONFITTA\n");
                 printf("  Andrà meglio la prossima volta...\n");
@@ -195,28 +359,66 @@ void *silentWaitBlurredMap(void *arg) {
             }
             fflush(stdout);
             end = 1;
-            send(args->sockfd, "x", 1, 0); // notifica al server che abbiamo ricevuto il risultato
+            sendFrame(args->sockfd, MSG_ACK, NULL, 0); // notifica al server che abbiamo ricevuto il risultato
             sleep(1); 
             kill(getpid(), SIGUSR1); 
             close(args->sockfd);
             break;
         }
-        if (n > 0 && type == 'B') {
-            int localRows, localCols;
+        int updated = 0;
+        if (n > 0 && type == MSG_BLURRED) {
             pthread_mutex_lock(&socketMutex);
-            char **blurredMap = receiveMap(args->sockfd, args->width, args->height, args->x, args->y, &localRows, &localCols);
+            struct grid *blurredMap = receiveMap(args->sockfd, args->width, args->height, args->x, args->y);
             pthread_mutex_unlock(&socketMutex);
-            if (blurredMap && !end) {
-                /* aggiorna le dimensioni condivise col main */
-                *(args->effectiveRows) = localRows;
-                *(args->effectiveCols) = localCols;
-                system("clear");
-                printMapUI(blurredMap, localCols, localRows, *(args->x), *(args->y), "MAPPA AGGIORNATA (blurrata)");
-                printf("\n  Comando [W/A/S/D] | list | exit > ");
-                fflush(stdout);
-                freeMap(blurredMap, localRows); /* usa la copia locale, non il puntatore condiviso */
+            if (blurredMap) {
+                freeMap(known);
+                known = blurredMap; /* copia locale, non il puntatore del main */
+                gridSet(known, *(args->x), *(args->y), PATH);
+                seq = 0;
+                updated = 1;
             }
         }
+        if (n > 0 && type == MSG_DELTA) {
+            char *payload;
+            uint32_t len;
+            pthread_mutex_lock(&socketMutex);
+            if (recvFrame(args->sockfd, &type, &payload, &len) == 0) {
+                if (known && applyFogDelta(known, payload, len, &seq, args->x, args->y) == 0) {
+                    updated = 1;
+                } else {
+                    seq = 0;
+                    sendFrame(args->sockfd, MSG_RESYNC, NULL, 0);
+                }
+                free(payload);
+            }
+            pthread_mutex_unlock(&socketMutex);
+        }
+        if (n > 0 && type == MSG_ITEMS) {
+            char *payload;
+            uint32_t len;
+            pthread_mutex_lock(&socketMutex);
+            if (recvFrame(args->sockfd, &type, &payload, &len) == 0) {
+                pthread_mutex_lock(&knowMutex);
+                if (knowledge && applyItemEvents(knowledge, payload, len) > 0) updated = 2;
+                pthread_mutex_unlock(&knowMutex);
+                free(payload);
+            }
+            pthread_mutex_unlock(&socketMutex);
+        }
+        if (updated == 2 && !end) {
+            system("clear");
+            printKnown(*(args->x), *(args->y), "MAPPA NOTA (oggetti aggiornati)");
+            printf("\n  Comando [W/A/S/D, anche in sequenza es. WWDS] | list | exit > ");
+            fflush(stdout);
+        } else if (updated && !end) {
+            char under = gridGet(known, *(args->x), *(args->y));
+            gridSet(known, *(args->x), *(args->y), 'X');
+            system("clear");
+            printMapUI(known, *(args->x), *(args->y), "MAPPA AGGIORNATA (blurrata)");
+            printf("\n  Comando [W/A/S/D, anche in sequenza es. WWDS] | list | exit > ");
+            fflush(stdout);
+            gridSet(known, *(args->x), *(args->y), under);
+        }
         
         /* pausa breve per non saturare la CPU e cedere il passo al main */
         usleep(200000); 
@@ -227,11 +429,15 @@ void *silentWaitBlurredMap(void *arg) {
 /* --------------------------------------------------------------------------
  * main
  *
- * Connette al server all'indirizzo IP passato come argomento (porta 8080),
+ * Connette al server all'indirizzo IP e alla porta passati come argomenti
+ * (oppure, con "-u <percorso>", al socket Unix del server sulla stessa macchina),
  * invia il nome utente, riceve la mappa iniziale e avvia il thread di
  * ascolto asincrono. Poi entra nel loop principale: legge un comando da
  * stdin, lo invia al server e ridisegna la mappa con la risposta ricevuta.
  *
+ * Con -f la nebbia la disegna il client (vedi knowledge): il server manda
+ * solo le celle rivelate dalle mosse e gli oggetti raccolti.
+ *
  * Il loop termina quando il thread segnala fine partita (end=1).
  * -------------------------------------------------------------------------- */
 int main(int argc, char* argv[]) {
@@ -240,33 +446,46 @@ int main(int argc, char* argv[]) {
     char username[256];
     char password[256];
     if(argc < 3) {
-        printf("Uso: %s <indirizzo_ip> <porta>\n", argv[0]);
+        printf("Uso: %s <indirizzo_ip> <porta> [-f]\n", argv[0]);
+        printf("     %s -u <socket_unix> [-f]\n", argv[0]);
         exit(1);
     }
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    char *ipaddress = argv[1];
-    int port = atoi(argv[2]);
-    if (sockfd < 0) { perror("socket"); return 1; }
-    
-    struct sockaddr_in srv;
-    memset(&srv, 0, sizeof(srv));
-    srv.sin_family = AF_INET;
-    srv.sin_port = htons(port);
-    inet_pton(AF_INET, ipaddress, &srv.sin_addr);
+    if (argc >= 4 && strcmp(argv[3], "-f") == 0) clientFog = 1;
+    int sockfd, rc;
+    if (strcmp(argv[1], "-u") == 0) {
+        /* server sulla stessa macchina: niente stack TCP */
+        struct sockaddr_un srv;
+        memset(&srv, 0, sizeof(srv));
+        srv.sun_family = AF_UNIX;
+        strncpy(srv.sun_path, argv[2], sizeof(srv.sun_path) - 1);
+        sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd < 0) { perror("socket"); return 1; }
+        rc = connect(sockfd, (struct sockaddr*)&srv, sizeof(srv));
+    } else {
+        char *ipaddress = argv[1];
+        int port = atoi(argv[2]);
+        struct sockaddr_in srv;
+        memset(&srv, 0, sizeof(srv));
+        srv.sin_family = AF_INET;
+        srv.sin_port = htons(port);
+        inet_pton(AF_INET, ipaddress, &srv.sin_addr);
+        sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd < 0) { perror("socket"); return 1; }
+        rc = connect(sockfd, (struct sockaddr*)&srv, sizeof(srv));
+    }
     
-    if (connect(sockfd, (struct sockaddr*)&srv, sizeof(srv)) < 0) {
+    if (rc < 0) {
         printf("Errore: impossibile connettersi a %s\n", argv[1]);
         return 1;
     }
-    char c;
-    recv(sockfd, &c, 1, 0);
+    char c = recvType(sockfd);
 
-    if(c == 'R') {
-        printf("Errore: il server ha rifiutato la connessione (partita gia' iniziata)\n");
+    if(c == MSG_REFUSED) {
+        printf("Errore: il server ha rifiutato la connessione (nessuna stanza libera)\n");
         close(sockfd);
         return 1;
     }
-    else if(c == 'A') {
+    else if(c == MSG_ACCEPTED) {
         printf("Connessione accettata dal server!\n");
     }
 
@@ -280,6 +499,7 @@ int main(int argc, char* argv[]) {
         printf("  [1] Registrati\n");
         printf("  [2] Login\n");
         printf("  [3] Giocatori connessi\n");
+        printf("  [4] Osserva una partita\n");
         printf("  Scelta: ");
         fflush(stdout);
     
@@ -288,30 +508,43 @@ int main(int argc, char* argv[]) {
         if (nb > 0) { choiceBuf[nb] = '\0'; choice = atoi(choiceBuf); }
     
         if (choice == 3) {
-            send(sockfd, "C", 1, 0);
-            int count = 0;
-            recv(sockfd, &count, sizeof(count), 0);
-            printf("\n  Giocatori attualmente connessi: %d\n\n", count);
+            char type, *payload;
+            uint32_t len, count = 0;
+            sendFrame(sockfd, MSG_ASK_COUNT, NULL, 0);
+            if (recvFrame(sockfd, &type, &payload, &len) == 0) {
+                if (type == MSG_COUNT && len >= 4) count = get32(payload);
+                free(payload);
+            }
+            printf("\n  Giocatori attualmente connessi: %u\n\n", count);
             choice = -1;   /* ripresenta il menu */
         }
+        if (choice == 4) {
+            char roomBuf[16];
+            printf("  Stanza (invio = quella in cui sei entrato): ");
+            fflush(stdout);
+            int nr = read(STDIN_FILENO, roomBuf, sizeof(roomBuf) - 1);
+            roomBuf[nr > 0 ? nr : 0] = '\0';
+            int rc = watchMatch(sockfd, (uint32_t)atoi(roomBuf));
+            close(sockfd);
+            return rc;
+        }
     } while (choice < 1 || choice > 2);
     int readedbyte = 0;
     char res;
     switch(choice) {
         case 1:
-            send(sockfd, "R", 1, 0);
             printf("  Username: ");
             fflush(stdout);
             readedbyte = read(STDIN_FILENO, username, sizeof(username)-1);
             username[readedbyte] = '\0';
-            send(sockfd, username, readedbyte, 0);
+            sendFrame(sockfd, MSG_REGISTER, username, readedbyte);
             printf("  Password: ");
             fflush(stdout);
             readedbyte = read(STDIN_FILENO, password, sizeof(password)-1);
             password[readedbyte] = '\0';
-            send(sockfd, password, readedbyte, 0);
-            recv(sockfd, &res, 1, 0);
-            if(res == 'Y') {
+            sendFrame(sockfd, MSG_PASSWORD, password, readedbyte);
+            res = recvType(sockfd);
+            if(res == MSG_YES) {
                 printf("  [OK] Registrazione avvenuta con successo!\n");
             } else {
                 printf("  [ERRORE] Username gia' esistente.\n");
@@ -322,9 +555,10 @@ int main(int argc, char* argv[]) {
             fflush(stdout);
             int nread = read(STDIN_FILENO, username, sizeof(username)-1);
             username[nread] = '\0';
-            send(sockfd, username, nread, 0);
-            recv(sockfd, &res, 1, 0);
-            if(res == 'Y') {
+            if (clientFog) sendFrame(sockfd, MSG_CLIENT_FOG, NULL, 0);
+            sendFrame(sockfd, MSG_LOGIN, username, nread);
+            res = recvType(sockfd);
+            if(res == MSG_YES) {
                 printf("  [OK] Login avvenuto con successo!\n");
             } else {
                 printf("  [ERRORE] Login fallito: username errato.\n");
@@ -333,14 +567,14 @@ int main(int argc, char* argv[]) {
             }
             break;
         case 2:
-            send(sockfd, "L", 1, 0);
             printf("  Username: ");
             fflush(stdout);
             readedbyte = read(STDIN_FILENO, username, sizeof(username)-1);
             username[readedbyte] = '\0';
-            send(sockfd, username, readedbyte, 0);
-            recv(sockfd, &res, 1, 0);
-            if(res == 'Y') {
+            if (clientFog) sendFrame(sockfd, MSG_CLIENT_FOG, NULL, 0);
+            sendFrame(sockfd, MSG_LOGIN, username, readedbyte);
+            res = recvType(sockfd);
+            if(res == MSG_YES) {
                 printf("  [OK] Login avvenuto con successo!\n");
             }
             else {
@@ -355,27 +589,27 @@ int main(int argc, char* argv[]) {
     fflush(stdout);
 
     int width, height, x, y;
-    int effectiveCols, effectiveRows;
     
     pthread_mutex_lock(&socketMutex);
-    char **map = receiveMap(sockfd, &width, &height, &x, &y, &effectiveRows, &effectiveCols);
+    struct grid *map = NULL;
+    if (clientFog) receiveReveal(sockfd, &width, &height, &x, &y);
+    else map = receiveMap(sockfd, &width, &height, &x, &y);
     pthread_mutex_unlock(&socketMutex);
 
-    int currentMapRows = effectiveRows; // righe effettive della map allocata corrente
-
     /* avvia il thread che ascolta in background gli aggiornamenti del server */
     pthread_t tid;
-    struct thread_args t_args = {sockfd, &width, &height, &x, &y, &effectiveRows, &effectiveCols, &map};
+    struct thread_args t_args = {sockfd, &width, &height, &x, &y};
     pthread_create(&tid, NULL, silentWaitBlurredMap, &t_args);
     pthread_detach(tid);
     
     system("clear");
-    printMapUI(map, effectiveCols, effectiveRows, x, y, "LABIRINTO");
+    if (clientFog) printKnown(x, y, "LABIRINTO");
+    else printMapUI(map, x, y, "LABIRINTO");
     
     /* ----- LOOP PRINCIPALE ----- */
     while (!checkEnd()) {
         char command[256];
-        printf("\n  Comando [W/A/S/D] | list | exit > ");
+        printf("\n  Comando [W/A/S/D, anche in sequenza es. WWDS] | list | exit > ");
         fflush(stdout);
         
         readedbyte = read(0, command, sizeof(command)-1);
@@ -385,25 +619,35 @@ int main(int argc, char* argv[]) {
         pthread_mutex_lock(&socketMutex);
         sendCommand(sockfd, command);   
         if(strcmp(command, "list") != 0) {     
-            char response[16];
-            int n = recv(sockfd, response, 1, MSG_PEEK);
+            char response;
+            int n;
+            /* i frame di nebbia sono del thread: si lascia che li consumi */
+            while ((n = recv(sockfd, &response, 1, MSG_PEEK)) > 0 &&
+                   (response == MSG_BLURRED || response == MSG_DELTA || response == MSG_ITEMS)) {
+                pthread_mutex_unlock(&socketMutex);
+                usleep(50000);
+                pthread_mutex_lock(&socketMutex);
+            }
             
             if(n > 0) {
-                response[n] = '\0';
-                if(response[0] == 'M' || response[0] == 'E') {
+                if(response == MSG_EXIT_FOUND || response == MSG_END) {
                     pthread_mutex_unlock(&socketMutex);
                     break;
                 }
-                char **new_map = receiveMap(sockfd, &width, &height, &x, &y, &effectiveRows, &effectiveCols);
-                if(new_map != NULL) {
-                    freeMap(map, currentMapRows); // usa le righe della map precedente
-                    map = new_map;
-                    currentMapRows = effectiveRows; // aggiorna con le righe della nuova map
+                if (clientFog) {
+                    receiveReveal(sockfd, &width, &height, &x, &y);
+                } else {
+                    struct grid *new_map = receiveMap(sockfd, &width, &height, &x, &y);
+                    if(new_map != NULL) {
+                        freeMap(map); // la griglia porta con se' le proprie dimensioni
+                        map = new_map;
+                    }
                 }
             }
             pthread_mutex_unlock(&socketMutex);
             system("clear");
-            printMapUI(map, effectiveCols, effectiveRows, x, y, "LABIRINTO");
+            if (clientFog) printKnown(x, y, "LABIRINTO");
+            else printMapUI(map, x, y, "LABIRINTO");
         } else {
             pthread_mutex_unlock(&socketMutex);
         }
@@ -413,6 +657,6 @@ int main(int argc, char* argv[]) {
     while(1) {
         sleep(1);
     }
-    freeMap(map, effectiveRows);
+    freeMap(map);
     return 0;
 }
\ No newline at end of file
@@ -1,137 +1,926 @@
 #include "map.h"
+#include "net.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <string.h>
+#include <pthread.h>
 
 int dx[4] = {-2, 2, 0, 0}; // su, giù, sinistra, destra
 int dy[4] = {0, 0, -2, 2};
 int itemRate = 3; // probabilità 1/itemRate per generare un item
 
+/* --------------------------------------------------------------------------
+ * Generatore xoshiro256** (Blackman/Vigna). Lo stato e' tutto in struct rng:
+ * niente lock globale come rand() e sequenze riproducibili dato il seme.
+ * -------------------------------------------------------------------------- */
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// splitmix64: espande il seme a 64 bit nei 256 bit di stato
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void rngSeed(struct rng *r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) r->s[i] = splitmix64(&seed);
+}
+
+uint64_t rngNext(struct rng *r) {
+    uint64_t *s = r->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+// intero uniforme in [0, n) senza bias (moltiplicazione di Lemire)
+uint32_t rngBelow(struct rng *r, uint32_t n) {
+    uint64_t m = (rngNext(r) >> 32) * n;
+    if ((uint32_t)m < n) {
+        uint32_t threshold = -n % n;
+        while ((uint32_t)m < threshold)
+            m = (rngNext(r) >> 32) * n;
+    }
+    return (uint32_t)(m >> 32);
+}
+
+// seme non riproducibile: dal kernel, o in mancanza da orologio e pid
+uint64_t rngEntropySeed(void) {
+    uint64_t seed;
+    if (getrandom(&seed, sizeof(seed), 0) == sizeof(seed)) return seed;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000007ULL ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 32);
+}
+
 // shuffle Fisher–Yates
-void shuffle(int *arr, int n) {
+static void shuffle(struct rng *rng, int *arr, int n) {
     for (int i = n-1; i > 0; i--) {
-        int j = rand() % (i+1);
+        int j = rngBelow(rng, i+1);
         int tmp = arr[i];
         arr[i] = arr[j];
         arr[j] = tmp;
     }
 }
 
-// DFS: non tocca bordi, genera corridoi interni
-void dfs(char **map, int **visited, int row, int col, int width, int height) {
-    if(row <=0 || row>=height-1 || col<=0 || col>=width-1)
-        return;
-    if(visited[row][col]) return;
-    visited[row][col] = 1;
+/*
+ * Frame dello stack esplicito usato da carve(): indice della cella e
+ * le 4 direzioni gia' mescolate (2 bit ciascuna). 8 byte per frame,
+ * cosi' lo stack resta compatto e scorre bene in cache.
+ */
+struct carveFrame {
+    unsigned int  cell;   // indice riga-major della cella (row*stride + col)
+    unsigned char dirs;   // direzioni mescolate, 2 bit ciascuna
+    unsigned char next;   // prossima direzione da provare (0..4)
+};
 
-    // item o corridoio
-    map[row][col] = (rand() % itemRate == 0) ? ITEM : PATH;
+// visita una cella: item o corridoio, poi prepara il frame con le direzioni mescolate
+static void visitCell(struct grid *map, struct rng *rng, struct carveFrame *f, int row, int col) {
+    gridSet(map, row, col, (rngBelow(rng, itemRate) == 0) ? ITEM : PATH);
 
     int dir[4] = {0,1,2,3};
-    shuffle(dir, 4);
+    shuffle(rng, dir, 4);
+
+    f->cell = (unsigned int)row * (unsigned int)map->stride + (unsigned int)col;
+    f->dirs = (unsigned char)(dir[0] | dir[1] << 2 | dir[2] << 4 | dir[3] << 6);
+    f->next = 0;
+}
+
+/*
+ * DFS iterativa: stesso ordine di visita della vecchia dfs() ricorsiva
+ * (stessa famiglia di labirinti), ma lo stack vive sull'heap e cresce
+ * per raddoppio, quindi la profondita' non e' piu' limitata dallo stack
+ * del thread. Una cella interna e' "visitata" quando non e' piu' WALL:
+ * non serve una matrice visited separata.
+ * Il carving resta dentro il rettangolo [r0,r1] x [c0,c1] (estremi inclusi):
+ * tutta la parte interna della mappa, oppure un solo blocco della
+ * generazione parallela. Blocchi diversi non toccano mai le stesse celle.
+ * Ritorna 0 se ok, -1 se l'allocazione dello stack fallisce.
+ */
+struct carveBounds {
+    int r0, r1;
+    int c0, c1;
+};
 
-    for (int i=0; i<4; i++) {
-        int d = dir[i];
+static int carve(struct grid *map, struct rng *rng, const struct carveBounds *b, int startRow, int startCol) {
+    if(startRow < b->r0 || startRow > b->r1 || startCol < b->c0 || startCol > b->c1)
+        return 0;
+
+    size_t cap = 1024, top = 0;
+    struct carveFrame *stack = malloc(cap * sizeof(struct carveFrame));
+    if(!stack) return -1;
+
+    visitCell(map, rng, &stack[top++], startRow, startCol);
+
+    while(top > 0) {
+        struct carveFrame *f = &stack[top-1];
+        if(f->next == 4) { top--; continue; } // tutte le direzioni provate: backtrack
+
+        int d = (f->dirs >> (2 * f->next++)) & 3;
+        int row = f->cell / map->stride;
+        int col = f->cell % map->stride;
         int nx = row + dx[d];
         int ny = col + dy[d];
 
-        // controlla che la cella di destinazione sia interna e non visitata
-        if (nx>0 && nx<height-1 && ny>0 && ny<width-1 && !visited[nx][ny]) {
-            int mx = row + dx[d]/2;
-            int my = col + dy[d]/2;
-            // muro intermedio sicuro
-            if(mx>=0 && mx<height && my>=0 && my<width)
-                map[mx][my] = PATH;
-            dfs(map, visited, nx, ny, width, height);
+        // controlla che la cella di destinazione sia nei limiti e non visitata
+        if (nx>=b->r0 && nx<=b->r1 && ny>=b->c0 && ny<=b->c1 && gridGet(map, nx, ny) == WALL) {
+            // muro intermedio: sempre interno perche' lo sono entrambe le celle
+            gridSet(map, row + dx[d]/2, col + dy[d]/2, PATH);
+
+            if(top == cap) {
+                struct carveFrame *grown = realloc(stack, 2 * cap * sizeof(struct carveFrame));
+                if(!grown) { free(stack); return -1; }
+                stack = grown;
+                cap *= 2;
+            }
+            visitCell(map, rng, &stack[top++], nx, ny);
         }
     }
+
+    free(stack);
+    return 0;
 }
 
 // crea uscite sui bordi collegate ai corridoi interni
-void addExits(char **map, int width, int height) {
+static void addExits(struct grid *map, struct rng *rng) {
+    int width = map->width, height = map->height;
     // lato sinistro
     while(1) {
-        int i = 1 + rand() % (height-2);
-        if(map[i][1]==PATH || map[i][1]==ITEM) { map[i][0]=PATH; break; }
+        int i = 1 + rngBelow(rng, height-2);
+        char c = gridGet(map, i, 1);
+        if(c==PATH || c==ITEM) { gridSet(map, i, 0, PATH); break; }
     }
     // lato destro
     while(1) {
-        int i = 1 + rand() % (height-2);
-        if(map[i][width-2]==PATH || map[i][width-2]==ITEM) { map[i][width-1]=PATH; break; }
+        int i = 1 + rngBelow(rng, height-2);
+        char c = gridGet(map, i, width-2);
+        if(c==PATH || c==ITEM) { gridSet(map, i, width-1, PATH); break; }
     }
     // lato superiore
     while(1) {
-        int j = 1 + rand() % (width-2);
-        if(map[1][j]==PATH || map[1][j]==ITEM) { map[0][j]=PATH; break; }
+        int j = 1 + rngBelow(rng, width-2);
+        char c = gridGet(map, 1, j);
+        if(c==PATH || c==ITEM) { gridSet(map, 0, j, PATH); break; }
     }
     // lato inferiore
     while(1) {
-        int j = 1 + rand() % (width-2);
-        if(map[height-2][j]==PATH || map[height-2][j]==ITEM) { map[height-1][j]=PATH; break; }
+        int j = 1 + rngBelow(rng, width-2);
+        char c = gridGet(map, height-2, j);
+        if(c==PATH || c==ITEM) { gridSet(map, height-1, j, PATH); break; }
     }
 }
 
-// genera la mappa
-char **generateMap(int *width, int *height) {
-    srand(time(NULL));
+/*
+ * Alloca una griglia width x height riempita con fill. Intestazione e
+ * celle stanno in un unico blocco: una sola malloc, una sola free.
+ */
+struct grid *allocGrid(int width, int height, char fill) {
+    if(width <= 0 || height <= 0) return NULL;
+    size_t cells = (size_t)width * (size_t)height;
+    struct grid *g = malloc(sizeof(struct grid) + cells);
+    if(!g) return NULL;
+    g->width  = width;
+    g->height = height;
+    g->stride = width;
+    g->cells  = (char *)(g + 1);
+    g->mappedLen = 0;
+    memset(g->cells, fill, cells);
+    return g;
+}
+
+// alloca una bitmap azzerata: intestazione e parole nello stesso blocco
+struct bitmap *allocBitmap(int width, int height) {
+    if(width <= 0 || height <= 0) return NULL;
+    int wpr = (width + 63) / 64;
+    size_t words = (size_t)wpr * (size_t)height;
+    struct bitmap *b = calloc(1, sizeof(struct bitmap) + words * sizeof(uint64_t));
+    if(!b) return NULL;
+    b->width       = width;
+    b->height      = height;
+    b->wordsPerRow = wpr;
+    b->words       = (uint64_t *)(b + 1);
+    return b;
+}
 
-    // forza width e height dispari per evitare muri frammentati
-    int w = (MINWIDTHMAP + rand() % (MAXWIDTHMAP - MINWIDTHMAP + 1)) | 1;
-    int h = (MINHEIGHTMAP + rand() % (MAXHEIGHTMAP - MINHEIGHTMAP + 1)) | 1;
-
-    *width = w;
-    *height = h;
-
-    char **map = malloc(h * sizeof(char*));
-    int **visited = malloc(h * sizeof(int*));
-    if(!map || !visited) return NULL;
-
-    for(int i=0;i<h;i++) {
-        map[i] = malloc(w * sizeof(char));
-        visited[i] = malloc(w * sizeof(int));
-        if(!map[i] || !visited[i]) {
-            for(int j=0;j<i;j++) { free(map[j]); free(visited[j]); }
-            free(map); free(visited);
-            return NULL;
+void freeBitmap(struct bitmap *b) {
+    free(b);
+}
+
+// maschera con i bit [lo, hi] accesi (0 <= lo <= hi <= 63)
+static inline uint64_t bitRangeMask(int lo, int hi) {
+    uint64_t upto = (hi == 63) ? ~(uint64_t)0 : (((uint64_t)1 << (hi + 1)) - 1);
+    return upto & (~(uint64_t)0 << lo);
+}
+
+// imposta le colonne [c0, c1] della riga r: parole intere dove possibile
+void bitmapSetRange(struct bitmap *b, int r, int c0, int c1) {
+    if(c0 < 0) c0 = 0;
+    if(c1 >= b->width) c1 = b->width - 1;
+    if(r < 0 || r >= b->height || c0 > c1) return;
+
+    uint64_t *row = bitmapRow(b, r);
+    int w0 = c0 >> 6, w1 = c1 >> 6;
+    if(w0 == w1) {
+        row[w0] |= bitRangeMask(c0 & 63, c1 & 63);
+        return;
+    }
+    row[w0] |= bitRangeMask(c0 & 63, 63);
+    for(int k = w0 + 1; k < w1; k++) row[k] = ~(uint64_t)0;
+    row[w1] |= bitRangeMask(0, c1 & 63);
+}
+
+/* --------------------------------------------------------------------------
+ * Campo delle distanze dalle uscite
+ *
+ * La coda della BFS e' un buffer circolare che cresce per raddoppio: in un
+ * labirinto la frontiera e' piccola rispetto alla mappa, quindi la memoria
+ * extra resta lontana dalle width*height celle del campo. La capacita' e'
+ * sempre una potenza di 2: l'indice si riduce con una maschera.
+ * -------------------------------------------------------------------------- */
+struct cellQueue {
+    uint32_t *buf;
+    size_t    cap, head, len;
+};
+
+static int queuePush(struct cellQueue *q, uint32_t cell) {
+    if(q->len == q->cap) {
+        size_t ncap = q->cap ? 2 * q->cap : 4096;
+        uint32_t *nbuf = malloc(ncap * sizeof(uint32_t));
+        if(!nbuf) return -1;
+        // ricompatta il contenuto all'inizio del nuovo buffer
+        for(size_t i = 0; i < q->len; i++) nbuf[i] = q->buf[(q->head + i) & (q->cap - 1)];
+        free(q->buf);
+        q->buf = nbuf;
+        q->cap = ncap;
+        q->head = 0;
+    }
+    q->buf[(q->head + q->len++) & (q->cap - 1)] = cell;
+    return 0;
+}
+
+static uint32_t queuePop(struct cellQueue *q) {
+    uint32_t cell = q->buf[q->head];
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->len--;
+    return cell;
+}
+
+static inline int isBorder(const struct grid *map, int r, int c) {
+    return r == 0 || c == 0 || r == map->height - 1 || c == map->width - 1;
+}
+
+/*
+ * Espande la BFS dalla coda: ogni vicino libero con distanza maggiore di
+ * quella della cella + 1 viene abbassato e accodato. Con sorgenti tutte a
+ * pari distanza (o accodate in ordine) e' la BFS classica; con "seeds"
+ * ordinati (distanza << 32 | cella) si fonde con la coda come una
+ * Dijkstra a pesi unitari. Ogni cella abbassata viene riaccodata, quindi
+ * il risultato e' corretto anche se un seme viene migliorato prima di
+ * essere estratto.
+ */
+static int relax(struct distField *df, const struct grid *map, struct cellQueue *q,
+                 const uint64_t *seeds, size_t nSeeds) {
+    static const int nr[4] = {-1, 1, 0, 0}, nc[4] = {0, 0, -1, 1};
+    size_t s = 0;
+    while(q->len > 0 || s < nSeeds) {
+        uint32_t cell;
+        if(s < nSeeds && (q->len == 0 || (seeds[s] >> 32) <= df->dist[q->buf[q->head]]))
+            cell = (uint32_t)seeds[s++];
+        else
+            cell = queuePop(q);
+        int r = cell / df->width, c = cell % df->width;
+        uint32_t next = df->dist[cell] + 1;
+        for(int k = 0; k < 4; k++) {
+            int rr = r + nr[k], cc = c + nc[k];
+            if(rr < 0 || cc < 0 || rr >= df->height || cc >= df->width) continue;
+            uint32_t v = (uint32_t)rr * df->width + cc;
+            if(gridGet(map, rr, cc) == WALL || df->dist[v] <= next) continue;
+            df->dist[v] = next;
+            if(queuePush(q, v) < 0) return -1;
         }
-        for(int j=0;j<w;j++) {
-            map[i][j] = WALL;  //la mappa inzialmente è tutta muri
-            visited[i][j] = 0;
+    }
+    return 0;
+}
+
+struct distField *computeDistField(const struct grid *map) {
+    size_t n = (size_t)map->width * map->height;
+    if(n > UINT32_MAX) return NULL;
+    struct distField *df = malloc(sizeof(struct distField) + n * sizeof(uint32_t));
+    if(!df) return NULL;
+    df->width  = map->width;
+    df->height = map->height;
+    df->dist   = (uint32_t *)(df + 1);
+    for(size_t i = 0; i < n; i++) df->dist[i] = DIST_INF;
+
+    // sorgenti: tutte le celle libere del bordo (le uscite), a distanza 0
+    struct cellQueue q = {0};
+    int ok = 1;
+    for(int r = 0; r < map->height && ok; r++) {
+        int step = (r == 0 || r == map->height - 1) ? 1 : map->width - 1;
+        for(int c = 0; c < map->width && ok; c += step) {
+            if(gridGet(map, r, c) == WALL) continue;
+            uint32_t cell = (uint32_t)r * map->width + c;
+            df->dist[cell] = 0;
+            ok = queuePush(&q, cell) == 0;
         }
     }
+    if(ok) ok = relax(df, map, &q, NULL, 0) == 0;
+    free(q.buf);
+    if(!ok) {
+        free(df);
+        return NULL;
+    }
+    return df;
+}
+
+void freeDistField(struct distField *df) {
+    free(df);
+}
+
+int distFieldOpenCell(struct distField *df, const struct grid *map, int r, int c) {
+    static const int nr[4] = {-1, 1, 0, 0}, nc[4] = {0, 0, -1, 1};
+    uint32_t cell = (uint32_t)r * df->width + c;
+    uint32_t best = isBorder(map, r, c) ? 0 : DIST_INF;
+    for(int k = 0; k < 4 && best; k++) {
+        int rr = r + nr[k], cc = c + nc[k];
+        if(rr < 0 || cc < 0 || rr >= df->height || cc >= df->width) continue;
+        uint32_t d = distAt(df, rr, cc);
+        if(d != DIST_INF && d + 1 < best) best = d + 1;
+    }
+    if(best >= df->dist[cell]) return 0;
+    df->dist[cell] = best;
+
+    // le distanze possono solo scendere: basta propagare da questa cella
+    struct cellQueue q = {0};
+    int ret = queuePush(&q, cell) == 0 ? relax(df, map, &q, NULL, 0) : -1;
+    free(q.buf);
+    return ret;
+}
+
+static int cmpSeed(const void *a, const void *b) {
+    uint64_t sa = *(const uint64_t *)a, sb = *(const uint64_t *)b;
+    return (sa > sb) - (sa < sb);
+}
+
+int distFieldCloseCell(struct distField *df, const struct grid *map, int r, int c) {
+    static const int nr[4] = {-1, 1, 0, 0}, nc[4] = {0, 0, -1, 1};
+    uint32_t cell = (uint32_t)r * df->width + c;
+    if(df->dist[cell] == DIST_INF) return 0;
+
+    /*
+     * 1. invalida la cella e tutto cio' che ne discende lungo catene a
+     *    distanza crescente di 1: e' un soprainsieme delle celle il cui
+     *    cammino minimo passava di qui.
+     */
+    struct cellQueue q = {0}, dirty = {0};
+    int ok = queuePush(&q, cell) == 0;
+    while(ok && q.len > 0) {
+        uint32_t u = queuePop(&q);
+        uint32_t du = df->dist[u];
+        if(du == DIST_INF) continue;
+        df->dist[u] = DIST_INF;
+        ok = queuePush(&dirty, u) == 0;
+        int ur = u / df->width, uc = u % df->width;
+        for(int k = 0; k < 4 && ok; k++) {
+            int rr = ur + nr[k], cc = uc + nc[k];
+            if(rr < 0 || cc < 0 || rr >= df->height || cc >= df->width) continue;
+            if(distAt(df, rr, cc) == du + 1)
+                ok = queuePush(&q, (uint32_t)rr * df->width + cc) == 0;
+        }
+    }
+
+    /*
+     * 2. ogni cella invalidata riparte dal miglior vicino ancora valido
+     *    (o da 0 se e' un'uscita); i semi ordinati per distanza vengono
+     *    fusi con la coda della BFS.
+     */
+    size_t nSeeds = 0;
+    uint64_t *seeds = ok ? malloc((dirty.len ? dirty.len : 1) * sizeof(uint64_t)) : NULL;
+    if(!seeds) ok = 0;
+    while(ok && dirty.len > 0) {
+        uint32_t u = queuePop(&dirty);
+        int ur = u / df->width, uc = u % df->width;
+        if(gridGet(map, ur, uc) == WALL) continue;
+        uint32_t best = isBorder(map, ur, uc) ? 0 : DIST_INF;
+        for(int k = 0; k < 4 && best; k++) {
+            int rr = ur + nr[k], cc = uc + nc[k];
+            if(rr < 0 || cc < 0 || rr >= df->height || cc >= df->width) continue;
+            uint32_t d = distAt(df, rr, cc);
+            if(d != DIST_INF && d + 1 < best) best = d + 1;
+        }
+        if(best == DIST_INF) continue;
+        seeds[nSeeds++] = (uint64_t)best << 32 | u;
+        df->dist[u] = best;
+    }
+    if(ok) {
+        qsort(seeds, nSeeds, sizeof(uint64_t), cmpSeed);
+        ok = relax(df, map, &q, seeds, nSeeds) == 0;
+    }
+    free(seeds);
+    free(q.buf);
+    free(dirty.buf);
+    return ok ? 0 : -1;
+}
+
+// genera una mappa di dimensioni date (forzate dispari): stesso seme, stessa mappa
+struct grid *generateMapSized(int width, int height, uint64_t seed) {
+    struct rng rng;
+    rngSeed(&rng, seed);
+
+    // forza width e height dispari per evitare muri frammentati
+    struct grid *map = allocGrid(width | 1, height | 1, WALL); //la mappa inzialmente è tutta muri
+    if(!map) return NULL;
 
     // PARTENZA DAL CENTRO (pari/dispari coerente)
-    int startX = h/2 | 1;
-    int startY = w/2 | 1;
+    int startX = map->height/2 | 1;
+    int startY = map->width/2 | 1;
+
+    struct carveBounds all = { 1, map->height - 2, 1, map->width - 2 };
+    if(carve(map, &rng, &all, startX, startY) < 0) {
+        freeMap(map);
+        return NULL;
+    }
+    addExits(map, &rng);
+
+    return map;
+}
+
+/* --------------------------------------------------------------------------
+ * Generazione parallela per blocchi
+ *
+ * Le celle (coordinate dispari) sono divise in blocchi TILE_CELLS x
+ * TILE_CELLS. Ogni blocco viene scavato da carve() con un generatore
+ * proprio, derivato dal seme e dall'indice del blocco: il risultato non
+ * dipende ne' dal numero di thread ne' dall'ordine in cui i thread
+ * prendono i blocchi. Poi un passo seriale sceglie un albero di copertura
+ * casuale sul grafo dei blocchi (Kruskal) e apre un varco nel muro tra
+ * ogni coppia di blocchi adiacenti nell'albero: albero di alberi, quindi
+ * il labirinto resta perfetto e connesso.
+ * -------------------------------------------------------------------------- */
+#define TILE_CELLS 256
 
-    dfs(map, visited, startX, startY, w, h);
-    addExits(map, w, h);
+struct tileJob {
+    struct grid *map;
+    uint64_t     seed;
+    int          cellRows, cellCols;   // celle totali per lato
+    int          tileRows, tileCols;   // blocchi per lato
+    int          nextTile;             // prossimo blocco da prendere (atomico)
+    int          failed;               // 1 se un'allocazione e' fallita
+};
 
-    // libera visited
-    for(int i=0;i<h;i++) free(visited[i]);
-    free(visited);
+// limiti (in coordinate di mappa) del blocco tr,tc
+static struct carveBounds tileBounds(const struct tileJob *job, int tr, int tc) {
+    int cr1 = (tr + 1) * TILE_CELLS < job->cellRows ? (tr + 1) * TILE_CELLS : job->cellRows;
+    int cc1 = (tc + 1) * TILE_CELLS < job->cellCols ? (tc + 1) * TILE_CELLS : job->cellCols;
+    struct carveBounds b = { 2 * tr * TILE_CELLS + 1, 2 * (cr1 - 1) + 1,
+                             2 * tc * TILE_CELLS + 1, 2 * (cc1 - 1) + 1 };
+    return b;
+}
+
+static uint64_t tileSeed(uint64_t seed, int tile) {
+    return seed ^ (0x9e3779b97f4a7c15ULL * (uint64_t)(tile + 1));
+}
 
+// [thread] prende blocchi finche' ce ne sono e li scava
+static void *carveTiles(void *arg) {
+    struct tileJob *job = arg;
+    int nTiles = job->tileRows * job->tileCols;
+    int t;
+    while((t = __atomic_fetch_add(&job->nextTile, 1, __ATOMIC_RELAXED)) < nTiles) {
+        struct carveBounds b = tileBounds(job, t / job->tileCols, t % job->tileCols);
+        struct rng rng;
+        rngSeed(&rng, tileSeed(job->seed, t));
+        int startRow = b.r0 + 2 * (int)rngBelow(&rng, (b.r1 - b.r0) / 2 + 1);
+        int startCol = b.c0 + 2 * (int)rngBelow(&rng, (b.c1 - b.c0) / 2 + 1);
+        if(carve(job->map, &rng, &b, startRow, startCol) < 0)
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int findTile(int *parent, int t) {
+    while(parent[t] != t) {
+        parent[t] = parent[parent[t]];
+        t = parent[t];
+    }
+    return t;
+}
+
+/*
+ * Cuce i blocchi: archi tra blocchi adiacenti mescolati, union-find per
+ * tenere solo quelli che uniscono componenti diverse. Per ogni arco
+ * tenuto apre il muro su una riga (o colonna) di celle a caso del bordo.
+ */
+static int stitchTiles(struct tileJob *job, struct rng *rng) {
+    int nTiles = job->tileRows * job->tileCols;
+    int nEdges = job->tileRows * (job->tileCols - 1) + (job->tileRows - 1) * job->tileCols;
+    int *parent = malloc(nTiles * sizeof(int));
+    int *edges  = malloc((nEdges > 0 ? nEdges : 1) * sizeof(int));
+    if(!parent || !edges) { free(parent); free(edges); return -1; }
+
+    for(int t = 0; t < nTiles; t++) parent[t] = t;
+    // arco e: 2*tile (+0 verso destra, +1 verso il basso)
+    int n = 0;
+    for(int t = 0; t < nTiles; t++) {
+        if(t % job->tileCols < job->tileCols - 1) edges[n++] = 2 * t;
+        if(t / job->tileCols < job->tileRows - 1) edges[n++] = 2 * t + 1;
+    }
+    shuffle(rng, edges, n);
+
+    for(int i = 0; i < n; i++) {
+        int t = edges[i] / 2, down = edges[i] % 2;
+        int u = down ? t + job->tileCols : t + 1;
+        int a = findTile(parent, t), b = findTile(parent, u);
+        if(a == b) continue;
+        parent[a] = b;
+
+        struct carveBounds bt = tileBounds(job, t / job->tileCols, t % job->tileCols);
+        if(down) {
+            int col = bt.c0 + 2 * (int)rngBelow(rng, (bt.c1 - bt.c0) / 2 + 1);
+            gridSet(job->map, bt.r1 + 1, col, PATH);
+        } else {
+            int row = bt.r0 + 2 * (int)rngBelow(rng, (bt.r1 - bt.r0) / 2 + 1);
+            gridSet(job->map, row, bt.c1 + 1, PATH);
+        }
+    }
+    free(parent);
+    free(edges);
+    return 0;
+}
+
+// genera una mappa di dimensioni date scavando i blocchi su nThreads thread (0 = tutti i core)
+struct grid *generateMapTiled(int width, int height, uint64_t seed, int nThreads) {
+    struct grid *map = allocGrid(width | 1, height | 1, WALL);
+    if(!map) return NULL;
+
+    struct tileJob job = { map, seed, (map->height - 1) / 2, (map->width - 1) / 2, 0, 0, 0, 0 };
+    job.tileRows = (job.cellRows + TILE_CELLS - 1) / TILE_CELLS;
+    job.tileCols = (job.cellCols + TILE_CELLS - 1) / TILE_CELLS;
+    int nTiles = job.tileRows * job.tileCols;
+
+    if(nThreads <= 0) nThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(nThreads > nTiles) nThreads = nTiles;
+    if(nThreads < 1) nThreads = 1;
+
+    // il thread chiamante lavora anche lui: ne servono nThreads-1 in piu'
+    pthread_t tids[nThreads];
+    int started = 0;
+    for(int i = 1; i < nThreads; i++) {
+        if(pthread_create(&tids[started], NULL, carveTiles, &job) == 0) started++;
+    }
+    carveTiles(&job);
+    for(int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    struct rng rng;
+    rngSeed(&rng, seed);
+    if(job.failed || stitchTiles(&job, &rng) < 0) {
+        freeMap(map);
+        return NULL;
+    }
+    addExits(map, &rng);
     return map;
 }
 
-// libera la mappa
-void freeMap(char **map, int height) {
-    if(!map) return;
-    for(int i=0;i<height;i++) free(map[i]);
+/* --------------------------------------------------------------------------
+ * Generazione in streaming (algoritmo di Eller)
+ *
+ * Produce la mappa una riga alla volta e la passa a sink(): lo stato di
+ * lavoro e' O(larghezza) (etichette di insieme delle celle della riga
+ * corrente piu' due righe di output), quindi la mappa intera non deve mai
+ * stare in memoria. Ogni riga di celle unisce a caso celle adiacenti di
+ * insiemi diversi, poi ogni insieme scende di almeno una cella nella riga
+ * successiva; l'ultima riga unisce tutto cio' che e' ancora separato.
+ * Le uscite sono scelte prima di iniziare (tutte le celle dispari sono
+ * corridoio in un labirinto perfetto), cosi' non serve rileggere i bordi.
+ * -------------------------------------------------------------------------- */
+static int findLabel(int *parent, int l) {
+    while(parent[l] != l) {
+        parent[l] = parent[parent[l]];
+        l = parent[l];
+    }
+    return l;
+}
+
+int generateMapStream(int width, int height, uint64_t seed, mapRowSink sink, void *ctx) {
+    int w = width | 1, h = height | 1;
+    int cellCols = (w - 1) / 2, cellRows = (h - 1) / 2;
+    if(cellCols < 1 || cellRows < 1) return -1;
+
+    struct rng rng;
+    rngSeed(&rng, seed);
+
+    char *cells = malloc(w);                       // riga di celle (dispari)
+    char *walls = malloc(w);                       // riga di muri sotto (pari)
+    int  *label = malloc(cellCols * sizeof(int));  // insieme di ogni cella
+    int  *parent = malloc(cellCols * sizeof(int)); // union-find sulle etichette
+    int  *count = malloc(cellCols * sizeof(int));  // celle rimaste per insieme
+    unsigned char *flags = malloc(cellCols);       // bit0: giu', bit1: insieme gia' sceso/usato
+    int ret = -1;
+    if(!cells || !walls || !label || !parent || !count || !flags) goto out;
+
+    // uscite: colonna in alto e in basso, riga a sinistra e a destra
+    int topCol    = 1 + 2 * rngBelow(&rng, cellCols);
+    int bottomCol = 1 + 2 * rngBelow(&rng, cellCols);
+    int leftRow   = 1 + 2 * rngBelow(&rng, cellRows);
+    int rightRow  = 1 + 2 * rngBelow(&rng, cellRows);
+
+    memset(walls, WALL, w);
+    walls[topCol] = PATH;
+    if(sink(ctx, 0, walls, w) < 0) goto out;
+
+    for(int i = 0; i < cellCols; i++) label[i] = i;
+
+    for(int cr = 0; cr < cellRows; cr++) {
+        int row = 2 * cr + 1;
+        int last = (cr == cellRows - 1);
+
+        memset(cells, WALL, w);
+        for(int i = 0; i < cellCols; i++)
+            cells[2 * i + 1] = (rngBelow(&rng, itemRate) == 0) ? ITEM : PATH;
+        if(row == leftRow)  cells[0] = PATH;
+        if(row == rightRow) cells[w - 1] = PATH;
+
+        // unione orizzontale (sempre, sull'ultima riga, tra insiemi diversi)
+        for(int l = 0; l < cellCols; l++) parent[l] = l;
+        for(int i = 0; i + 1 < cellCols; i++) {
+            int a = findLabel(parent, label[i]), b = findLabel(parent, label[i + 1]);
+            if(a != b && (last || rngBelow(&rng, 2))) {
+                parent[b] = a;
+                cells[2 * i + 2] = PATH;
+            }
+        }
+        for(int i = 0; i < cellCols; i++) label[i] = findLabel(parent, label[i]);
+        if(sink(ctx, row, cells, w) < 0) goto out;
+
+        memset(walls, WALL, w);
+        if(last) {
+            walls[bottomCol] = PATH;
+            if(sink(ctx, row + 1, walls, w) < 0) goto out;
+            break;
+        }
+
+        // discesa: ogni insieme scende almeno una volta (forzata sull'ultima cella)
+        memset(count, 0, cellCols * sizeof(int));
+        memset(flags, 0, cellCols);
+        for(int i = 0; i < cellCols; i++) count[label[i]]++;
+        for(int i = 0; i < cellCols; i++) {
+            int l = label[i];
+            int down = rngBelow(&rng, 2);
+            if(--count[l] == 0 && !(flags[l] & 2)) down = 1;
+            if(down) {
+                flags[l] |= 2;
+                flags[i] |= 1;
+                walls[2 * i + 1] = PATH;
+            }
+        }
+        if(sink(ctx, row + 1, walls, w) < 0) goto out;
+
+        // prossima riga: chi scende tiene l'etichetta, gli altri ne prendono una libera
+        memset(count, 0, cellCols * sizeof(int)); // riusato come "etichetta in uso"
+        for(int i = 0; i < cellCols; i++)
+            if(flags[i] & 1) count[label[i]] = 1;
+        int nextFree = 0;
+        for(int i = 0; i < cellCols; i++) {
+            if(flags[i] & 1) continue;
+            while(count[nextFree]) nextFree++;
+            count[nextFree] = 1;
+            label[i] = nextFree;
+        }
+    }
+    ret = 0;
+
+out:
+    free(cells); free(walls); free(label); free(parent); free(count); free(flags);
+    return ret;
+}
+
+// sink che copia ogni riga nella griglia passata come ctx
+static int gridSink(void *ctx, int row, const char *cells, int width) {
+    memcpy(gridRow((struct grid *)ctx, row), cells, width);
+    return 0;
+}
+
+// sink che scrive ogni riga sul file descriptor puntato da ctx
+int mapFdSink(void *ctx, int row, const char *cells, int width) {
+    int fd = *(int *)ctx;
+    int sent = 0;
+    (void)row;
+    while(sent < width) {
+        ssize_t n = write(fd, cells + sent, width - sent);
+        if(n <= 0) return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// Eller in una griglia in memoria, per usarla come le altre mappe
+struct grid *generateMapEller(int width, int height, uint64_t seed) {
+    struct grid *map = allocGrid(width | 1, height | 1, WALL);
+    if(!map) return NULL;
+    if(generateMapStream(width, height, seed, gridSink, map) < 0) {
+        freeMap(map);
+        return NULL;
+    }
+    return map;
+}
+
+// dispatch sull'algoritmo scelto
+struct grid *generateMapWith(enum mapAlgorithm alg, int width, int height, uint64_t seed, int nThreads) {
+    switch(alg) {
+        case MAP_TILED: return generateMapTiled(width, height, seed, nThreads);
+        case MAP_ELLER: return generateMapEller(width, height, seed);
+        case MAP_DFS:
+        default:        return generateMapSized(width, height, seed);
+    }
+}
+
+// indici a 32 bit e mappa intera impaccata entro un frame
+int mapSizeFits(int width, int height) {
+    width |= 1;
+    height |= 1;
+    if ((uint64_t)width * height > UINT32_MAX) return 0;
+    // l'intestazione piu' lunga tra MSG_BLURRED (17) e MSG_WORLD (WORLD_HEADER)
+    return 17 + (uint64_t)packedRowBytes(width) * height <= FRAME_MAX_PAYLOAD;
+}
+
+// genera la mappa con dimensioni casuali nei limiti dati (estremi inclusi)
+struct grid *generateMap(enum mapAlgorithm alg, int minWidth, int maxWidth, int minHeight, int maxHeight, uint64_t seed) {
+    struct rng rng;
+    rngSeed(&rng, seed);
+
+    int w = minWidth + rngBelow(&rng, maxWidth - minWidth + 1);
+    int h = minHeight + rngBelow(&rng, maxHeight - minHeight + 1);
+
+    // il carving usa un seme derivato, cosi' le dimensioni non spostano la sequenza
+    return generateMapWith(alg, w, h, rngNext(&rng), 0);
+}
+
+// libera la mappa (o qualsiasi griglia creata da allocGrid o loadMap)
+void freeMap(struct grid *map) {
+    if(map && map->mappedLen) munmap(map->cells, map->mappedLen);
     free(map);
 }
 
+/* --------------------------------------------------------------------------
+ * File mappa
+ * -------------------------------------------------------------------------- */
+static int writeAll(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// intestazione con dimensioni e seme; uscite e oggetti li riempie il chiamante
+static void initHeader(struct mazeFileHeader *hdr, int width, int height, uint64_t seed) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, MAZE_FILE_MAGIC, 4);
+    hdr->version       = MAZE_FILE_VERSION;
+    hdr->width         = width;
+    hdr->height        = height;
+    hdr->seed          = seed;
+    hdr->payloadOffset = MAZE_FILE_HEADER;
+}
+
+// aggiorna uscite e contatore oggetti guardando una riga appena prodotta
+static void scanRow(struct mazeFileHeader *hdr, int row, const char *cells) {
+    int w = hdr->width, h = hdr->height;
+    for(int j = 0; j < w; j++) if(cells[j] == ITEM) hdr->itemCount++;
+    if(row > 0 && row < h - 1) {
+        if(cells[0] != WALL)     { hdr->exits[0][0] = row; hdr->exits[0][1] = 0; }
+        if(cells[w - 1] != WALL) { hdr->exits[1][0] = row; hdr->exits[1][1] = w - 1; }
+    } else {
+        int side = (row == 0) ? 2 : 3;
+        for(int j = 1; j < w - 1; j++)
+            if(cells[j] != WALL) { hdr->exits[side][0] = row; hdr->exits[side][1] = j; }
+    }
+}
+
+// scrive intestazione (riempita a MAZE_FILE_HEADER byte) all'inizio del file
+static int writeHeader(int fd, const struct mazeFileHeader *hdr) {
+    char page[MAZE_FILE_HEADER] = {0};
+    memcpy(page, hdr, sizeof(*hdr));
+    if(lseek(fd, 0, SEEK_SET) < 0) return -1;
+    return writeAll(fd, page, sizeof(page));
+}
+
+int saveMap(const char *path, const struct grid *map, uint64_t seed) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return -1;
+
+    struct mazeFileHeader hdr;
+    initHeader(&hdr, map->width, map->height, seed);
+    for(int i = 0; i < map->height; i++) scanRow(&hdr, i, gridRow(map, i));
+
+    int ok = writeHeader(fd, &hdr) == 0;
+    if(ok && map->stride == map->width)
+        ok = writeAll(fd, map->cells, (size_t)map->width * map->height) == 0;
+    else
+        for(int i = 0; ok && i < map->height; i++)
+            ok = writeAll(fd, gridRow(map, i), map->width) == 0;
+    if(close(fd) < 0) ok = 0;
+    if(!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+struct fileSinkCtx {
+    int fd;
+    struct mazeFileHeader hdr;
+};
+
+static int fileSink(void *ctx, int row, const char *cells, int width) {
+    struct fileSinkCtx *f = ctx;
+    scanRow(&f->hdr, row, cells);
+    return writeAll(f->fd, cells, width);
+}
+
+int generateMapToFile(const char *path, int width, int height, uint64_t seed) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    struct fileSinkCtx f;
+    f.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(f.fd < 0) return -1;
+
+    // l'intestazione definitiva (uscite, oggetti) si conosce solo alla fine
+    initHeader(&f.hdr, width | 1, height | 1, seed);
+    int ok = writeHeader(f.fd, &f.hdr) == 0
+          && generateMapStream(width, height, seed, fileSink, &f) == 0
+          && writeHeader(f.fd, &f.hdr) == 0;
+    if(close(f.fd) < 0) ok = 0;
+    if(!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+struct grid *loadMap(const char *path, struct mazeFileHeader *out) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct mazeFileHeader hdr;
+    struct stat st;
+    if(read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || fstat(fd, &st) < 0
+       || memcmp(hdr.magic, MAZE_FILE_MAGIC, 4) != 0 || hdr.version != MAZE_FILE_VERSION
+       || hdr.width < 3 || hdr.height < 3 || hdr.payloadOffset != MAZE_FILE_HEADER
+       || (uint64_t)st.st_size < hdr.payloadOffset + (uint64_t)hdr.width * hdr.height) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t len = (size_t)hdr.width * hdr.height;
+    struct grid *map = malloc(sizeof(struct grid));
+    void *cells = map ? mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, hdr.payloadOffset) : MAP_FAILED;
+    close(fd); // la mappatura resta valida anche dopo la close
+    if(cells == MAP_FAILED) {
+        free(map);
+        return NULL;
+    }
+
+    map->width     = hdr.width;
+    map->height    = hdr.height;
+    map->stride    = hdr.width;
+    map->cells     = cells;
+    map->mappedLen = len;
+    if(out) *out = hdr;
+    return map;
+}
+
 // stampa la mappa
-void printMap(char **map, int width, int height, int x, int y) {
+void printMap(const struct grid *map, int x, int y) {
     if(!map) return;
-    for(int i=0;i<height;i++) {
-        for(int j=0;j<width;j++)
+    for(int i=0;i<map->height;i++) {
+        const char *row = gridRow(map, i);
+        for(int j=0;j<map->width;j++)
             if(i==x && j==y)
                 putchar('X'); // posizione attuale
             else
-            putchar(map[i][j]);
+            putchar(row[j]);
         putchar('\n');
     }
 }
@@ -171,49 +960,128 @@ void printMapAdjacent(char **map, int width, int height, int x, int y) {
 }
 */
 
-void sendBlurredMap(int sockfd, char **map, int width, int height, int x, int y, int **visited) {
-    if (!map || !visited) return;
-
-    // 1. Invio intestazione e tipo 'B'
-    char type = 'B';
-    send(sockfd, &type, sizeof(char), 0);
-    send(sockfd, &width, sizeof(int), 0);
-    send(sockfd, &height, sizeof(int), 0);
-    send(sockfd, &x, sizeof(int), 0);
-    send(sockfd, &y, sizeof(int), 0);
-
-    // --- PARTE RIMOSSA: Non inviamo più la matrice visited ---
-
-    // 2. Invio dati MAPPA riga per riga (applicando la nebbia '?')
-    for (int i = 0; i < height; i++) {
-        char buffer[width];
-        for (int j = 0; j < width; j++) {
-            // Logica della nebbia: usiamo 'visited' solo internamente al server
-            if (visited[i][j] == 1 || (abs(i - x) <= 1 && abs(j - y) <= 1)) {
-                buffer[j] = (i == x && j == y) ? 'X' : map[i][j];
-            } else {
-                buffer[j] = '?'; 
-            }
+/*
+ * Rende la riga i della mappa con la nebbia: '?' dove la bitmap e' a 0.
+ * Lavora 64 celle alla volta: parola vuota -> memset di '?', parola
+ * piena -> copia dalla mappa, altrimenti si guarda bit per bit.
+ */
+static void renderFogRow(const struct grid *map, const struct bitmap *visited, int i, char *out) {
+    const uint64_t *seen = bitmapRow(visited, i);
+
+    for (int k = 0; k < visited->wordsPerRow; k++) {
+        int base = k * 64;
+        int n = map->width - base < 64 ? map->width - base : 64;
+        uint64_t word = seen[k];
+        uint64_t full = (n == 64) ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1);
+
+        if (word == 0) {
+            memset(out + base, '?', n);
+        } else if ((word & full) == full) {
+            gridCopyRelaxed(out + base, map, i, base, n);
+        } else {
+            for (int j = 0; j < n; j++)
+                out[base + j] = ((word >> j) & 1) ? gridGetRelaxed(map, i, base + j) : '?';
         }
+    }
+}
+
+// codice a 2 bit di ogni carattere di cella; la 'X' viaggia come PATH
+static const unsigned char cellCode[256] = {
+    [WALL] = 0, [PATH] = 1, [ITEM] = 2, ['?'] = 3, ['X'] = 1,
+};
+
+void packCells(const char *cells, int n, unsigned char *out) {
+    const unsigned char *c = (const unsigned char *)cells;
+    int full = n & ~3;
+    for (int i = 0; i < full; i += 4)
+        *out++ = cellCode[c[i]] | cellCode[c[i + 1]] << 2 |
+                 cellCode[c[i + 2]] << 4 | cellCode[c[i + 3]] << 6;
+    if (full < n) {
+        unsigned char b = 0;
+        for (int i = full; i < n; i++) b |= cellCode[c[i]] << 2 * (i - full);
+        *out = b;
+    }
+}
+
+// byte impaccato -> 4 caratteri, costruita una volta sola
+static char unpackTable[256][4];
+static pthread_once_t unpackOnce = PTHREAD_ONCE_INIT;
+
+static void initUnpackTable(void) {
+    static const char sym[4] = { WALL, PATH, ITEM, '?' };
+    for (int b = 0; b < 256; b++)
+        for (int k = 0; k < 4; k++)
+            unpackTable[b][k] = sym[(b >> 2 * k) & 3];
+}
+
+void unpackCells(const unsigned char *in, int n, char *out) {
+    pthread_once(&unpackOnce, initUnpackTable);
+    int full = n & ~3;
+    for (int i = 0; i < full; i += 4)
+        memcpy(out + i, unpackTable[*in++], 4);
+    if (full < n) memcpy(out + full, unpackTable[*in], n - full);
+}
+
+/*
+ * Mappa intera con nebbia in un unico frame MSG_BLURRED:
+ * payload = larghezza, altezza, x, y (u32 big-endian), codifica (1 byte),
+ * poi le righe impaccate a 2 bit (MAP_ENC_PACK2, packedRowBytes per riga).
+ * Ogni riga viene resa con la nebbia in un buffer e impaccata nel frame.
+ */
+static char *buildBlurredFrame(const struct grid *map, int x, int y, const struct bitmap *visited) {
+    int width = map->width, height = map->height;
+
+    size_t rowBytes = packedRowBytes(width);
+    size_t size = 17 + rowBytes * height;
+    if (size > FRAME_MAX_PAYLOAD) return NULL;
+    char *row = malloc(width);
+    char *frame = row ? frameAlloc(MSG_BLURRED, (uint32_t)size) : NULL;
+    if (!frame) {
+        free(row);
+        return NULL;
+    }
+
+    char *p = frame + FRAME_HEADER;
+    put32(p,      width);
+    put32(p + 4,  height);
+    put32(p + 8,  x);
+    put32(p + 12, y);
+    p[16] = MAP_ENC_PACK2;
+    p += 17;
+
+    for (int i = 0; i < height; i++, p += rowBytes) {
+        // Logica della nebbia: usiamo 'visited' solo internamente al server
+        renderFogRow(map, visited, i, row);
 
-        // Invio riga di caratteri
-        size_t row_size_char = (size_t)width * sizeof(char);
-        ssize_t sent = send(sockfd, buffer, row_size_char, 0);
-        if (sent < 0 || (size_t)sent != row_size_char) {
-            perror("Error sending map row");
-            return;
+        // le celle attorno al giocatore sono sempre visibili
+        if (abs(i - x) <= 1) {
+            int c0 = y - 1 < 0 ? 0 : y - 1;
+            int c1 = y + 1 >= width ? width - 1 : y + 1;
+            gridCopyRelaxed(row + c0, map, i, c0, c1 - c0 + 1);
         }
+        packCells(row, width, (unsigned char *)p);
     }
+    free(row);
+    return frame;
 }
-void sendAdjacentMap(int sockfd, char **map, int width, int height, int x, int y) {
-    // 1. Invio intestazione standard
-    send(sockfd, "A", 1, 0);
-    send(sockfd, &width, sizeof(int), 0);
-    send(sockfd, &height, sizeof(int), 0);
-    send(sockfd, &x, sizeof(int), 0);
-    send(sockfd, &y, sizeof(int), 0);
 
-    // 2. Calcolo corretto dei limiti (clamping sui bordi)
+int sendBlurredMap(int sockfd, const struct grid *map, int x, int y, const struct bitmap *visited) {
+    if (!map || !visited) return -1;
+    if (sendFrameBuf(sockfd, buildBlurredFrame(map, x, y, visited)) < 0) {
+        perror("Error sending map");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Sotto-mappa 3x3 (tagliata ai bordi) in un frame MSG_ADJACENT:
+ * payload = larghezza, altezza, x, y, righe, colonne + righe*colonne celle.
+ */
+int buildAdjacentFrame(char *frame, const struct grid *map, int x, int y) {
+    int width = map->width, height = map->height;
+
+    // Calcolo corretto dei limiti (clamping sui bordi)
     int r_start = (x - 1 < 0) ? 0 : x - 1;
     int r_end   = (x + 1 >= height) ? height - 1 : x + 1;
     int c_start = (y - 1 < 0) ? 0 : y - 1;
@@ -222,83 +1090,377 @@ void sendAdjacentMap(int sockfd, char **map, int width, int height, int x, int y
     int nrows = r_end - r_start + 1;
     int ncols = c_end - c_start + 1;
 
-    // 3. Invio dimensioni della sotto-matrice
-    send(sockfd, &nrows, sizeof(int), 0);
-    send(sockfd, &ncols, sizeof(int), 0);
+    char *p = frame + FRAME_HEADER;
+    frame[0] = MSG_ADJACENT;
+    put32(frame + 1, 24 + nrows * ncols);
+    put32(p,      width);
+    put32(p + 4,  height);
+    put32(p + 8,  x);
+    put32(p + 12, y);
+    put32(p + 16, nrows);
+    put32(p + 20, ncols);
+    p += 24;
 
-    // 4. Invio dati riga per riga
-    for(int i = r_start; i <= r_end; i++) {
-        char buffer[ncols];
-        for(int j = c_start; j <= c_end; j++) {
-            // Se è la posizione del giocatore metti X, altrimenti il dato della mappa
-            buffer[j - c_start] = (i == x && j == y) ? 'X' : map[i][j];
-        }
-        
-        // Invio sicuro della riga
-        int sent = 0;
-        while(sent < ncols) {
-            int n = send(sockfd, buffer + sent, ncols - sent, 0);
-            if(n <= 0) return;
-            sent += n;
-        }
+    for (int i = r_start; i <= r_end; i++, p += ncols) {
+        // la sotto-riga e' contigua: una copia e poi la X del giocatore
+        gridCopyRelaxed(p, map, i, c_start, ncols);
+        if (i == x) p[y - c_start] = 'X';
     }
+    return p - frame;
 }
-char **receiveMap(int sockfd, int *width, int *height, int *x, int *y, int *effectiveRows, int *effectiveCols) {
-    char type;
-    int w, h, px, py, eRows, eCols;
 
-    if(recv(sockfd, &type,  sizeof(char), 0) <= 0) return NULL;
-    if(recv(sockfd, &w,     sizeof(int),  0) <= 0) return NULL;
-    if(recv(sockfd, &h,     sizeof(int),  0) <= 0) return NULL;
-    if(recv(sockfd, &px,    sizeof(int),  0) <= 0) return NULL;
-    if(recv(sockfd, &py,    sizeof(int),  0) <= 0) return NULL;
+int sendAdjacentMap(int sockfd, const struct grid *map, int x, int y) {
+    char frame[ADJ_FRAME_MAX];
+    return sendAll(sockfd, frame, buildAdjacentFrame(frame, map, x, y));
+}
+
+/*
+ * Riceve un frame MSG_BLURRED, MSG_ADJACENT o MSG_PATH e ne ricava la griglia.
+ * Ritorna NULL su errore di rete, tipo inatteso o payload incoerente.
+ */
+struct grid *receiveMap(int sockfd, int *width, int *height, int *x, int *y) {
+    char type, *payload;
+    uint32_t len, hdr;
+    int eRows, eCols, enc = MAP_ENC_CHAR;
 
-    if (type == 'B') {
-        eRows = h;
-        eCols = w;
-    } else if (type == 'A') {
-        if(recv(sockfd, &eRows, sizeof(int), 0) <= 0) return NULL;
-        if(recv(sockfd, &eCols, sizeof(int), 0) <= 0) return NULL;
+    if (recvFrame(sockfd, &type, &payload, &len) < 0) return NULL;
+
+    if (type == MSG_BLURRED && len >= 17) {
+        hdr = 17;
+        eCols = (int)get32(payload);
+        eRows = (int)get32(payload + 4);
+        enc = payload[16];
+    } else if ((type == MSG_ADJACENT && len >= 24) || (type == MSG_PATH && len >= PATH_HEADER)) {
+        hdr = type == MSG_PATH ? PATH_HEADER : 24;
+        eRows = (int)get32(payload + 16);
+        eCols = (int)get32(payload + 20);
     } else {
-        return NULL; // tipo sconosciuto
+        free(payload);
+        return NULL; // tipo sconosciuto o frame troppo corto
+    }
+
+    // valori sanity-check prima di allocare: il payload deve coincidere
+    size_t rowBytes = enc == MAP_ENC_PACK2 ? packedRowBytes(eCols) : (size_t)eCols;
+    if (eRows <= 0 || eCols <= 0 || (enc != MAP_ENC_CHAR && enc != MAP_ENC_PACK2) ||
+        (uint64_t)eRows * rowBytes != len - hdr) {
+        free(payload);
+        return NULL;
+    }
+
+    struct grid *new_map = allocGrid(eCols, eRows, '?');
+    if (new_map && enc == MAP_ENC_PACK2) {
+        for (int i = 0; i < eRows; i++)
+            unpackCells((unsigned char *)payload + hdr + i * rowBytes, eCols, gridRow(new_map, i));
+        // la 'X' non ha un codice: si rimette nella posizione ricevuta
+        int px = (int)get32(payload + 8), py = (int)get32(payload + 12);
+        if (px >= 0 && px < eRows && py >= 0 && py < eCols) gridSet(new_map, px, py, 'X');
+    } else if (new_map) {
+        // le righe sono contigue (stride == width): una sola copia
+        memcpy(new_map->cells, payload + hdr, len - hdr);
+    }
+    if (new_map) {
+        *width  = (int)get32(payload);
+        *height = (int)get32(payload + 4);
+        *x      = (int)get32(payload + 8);
+        *y      = (int)get32(payload + 12);
     }
+    free(payload);
+    return new_map;
+}
+int journalInit(struct cellJournal *j, const struct grid *map) {
+    size_t n = 0;
+    for (int r = 0; r < map->height; r++) {
+        const char *row = gridRow(map, r);
+        for (int c = 0; c < map->width; c++) n += row[c] == ITEM;
+    }
+    j->cells = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (!j->cells) return -1;
+    memset(j->cells, 0xff, (n ? n : 1) * sizeof(uint32_t));    // tutto JOURNAL_EMPTY
+    j->len = 0;
+    j->cap = n;
+    return 0;
+}
+
+int journalAppend(struct cellJournal *j, uint32_t cell) {
+    size_t i = __atomic_fetch_add(&j->len, 1, __ATOMIC_RELAXED);
+    if (i >= j->cap) return -1;
+    // release: chi vede la cella pubblicata vede anche la mappa gia' aggiornata
+    __atomic_store_n(&j->cells[i], cell, __ATOMIC_RELEASE);
+    return 0;
+}
 
-    // valori sanity-check prima di allocare
-    if (eRows <= 0 || eCols <= 0 || eRows > 10000 || eCols > 10000) return NULL;
+size_t journalEnd(const struct cellJournal *j, size_t from) {
+    size_t n = __atomic_load_n(&j->len, __ATOMIC_RELAXED);
+    if (n > j->cap) n = j->cap;
+    while (from < n && __atomic_load_n(&j->cells[from], __ATOMIC_ACQUIRE) != JOURNAL_EMPTY)
+        from++;
+    return from;
+}
 
-    char **new_map = malloc(eRows * sizeof(char *));
-    if (!new_map) return NULL;
+void journalFree(struct cellJournal *j) {
+    free(j->cells);
+    j->cells = NULL;
+    j->len = j->cap = 0;
+}
+
+int fogInit(struct fogState *fs, int width, int height) {
+    memset(fs, 0, sizeof(*fs));
+    fs->sent = allocBitmap(width, height);
+    if (!fs->sent) return -1;
+    fs->dirtyLo  = 1;
+    fs->dirtyHi  = 0;
+    fs->keyframe = 1;
+    return 0;
+}
+
+void fogFree(struct fogState *fs) {
+    freeBitmap(fs->sent);
+    fs->sent = NULL;
+}
+
+void fogTouch(struct fogState *fs, int x) {
+    if (fs->dirtyLo > fs->dirtyHi) {
+        fs->dirtyLo = x - 1;
+        fs->dirtyHi = x + 1;
+        return;
+    }
+    if (x - 1 < fs->dirtyLo) fs->dirtyLo = x - 1;
+    if (x + 1 > fs->dirtyHi) fs->dirtyHi = x + 1;
+}
+
+/*
+ * Delta: seq, x, y, nRuns (u32), poi nRuns volte
+ *   riga, colonna, lunghezza (u32) + lunghezza celle.
+ * Prima gli oggetti spariti in celle gia' note, poi le celle nuove di
+ * visited trovate solo nelle righe sporche, a run di bit consecutivi.
+ */
+static char *putRun(char *p, const struct grid *map, int r, int c, int n) {
+    put32(p, r);
+    put32(p + 4, c);
+    put32(p + 8, n);
+    gridCopyRelaxed(p + 12, map, r, c, n);
+    return p + 12 + n;
+}
 
-    for (int i = 0; i < eRows; i++) {
-        new_map[i] = malloc(eCols * sizeof(char));
-        if (!new_map[i]) {
-            // cleanup righe già allocate
-            for (int j = 0; j < i; j++) free(new_map[j]);
-            free(new_map);
-            return NULL;
+char *fogBuildUpdate(struct fogState *fs, const struct grid *map, int x, int y,
+                     const struct bitmap *visited, const struct cellJournal *items) {
+    int lo = fs->dirtyLo < 0 ? 0 : fs->dirtyLo;
+    int hi = fs->dirtyHi >= map->height ? map->height - 1 : fs->dirtyHi;
+    size_t runs = 0, cells = 0;
+    size_t end = journalEnd(items, fs->journalPos);     // lo stesso per conteggio e scrittura
+    char *frame;
+
+    // 1. conteggio, senza toccare lo stato
+    if (!fs->keyframe) {
+        for (size_t i = fs->journalPos; i < end; i++) {
+            uint32_t cell = items->cells[i];
+            runs += bitmapTest(fs->sent, cell / map->width, cell % map->width);
         }
-        int recvd = 0;
-        while (recvd < eCols) {
-            int n = recv(sockfd, new_map[i] + recvd, eCols - recvd, 0);
-            if (n <= 0) {
-                // cleanup completo
-                for (int j = 0; j <= i; j++) free(new_map[j]);
-                free(new_map);
-                return NULL;
+        cells = runs;
+        for (int r = lo; r <= hi; r++) {
+            const uint64_t *v = bitmapRow(visited, r), *s = bitmapRow(fs->sent, r);
+            for (int k = 0; k < visited->wordsPerRow; k++) {
+                uint64_t diff = v[k] & ~s[k];
+                runs  += __builtin_popcountll(diff & ~(diff << 1)); // inizi di run
+                cells += __builtin_popcountll(diff);
             }
-            recvd += n;
         }
     }
 
-    // scrivi i valori nei puntatori solo se tutto è andato a buon fine
-    *width        = w;
-    *height       = h;
-    *x            = px;
-    *y            = py;
-    *effectiveRows = eRows;
-    *effectiveCols = eCols;
+    size_t size = 16 + runs * 12 + cells;
+    if (fs->keyframe || size >= 17 + packedRowBytes(map->width) * map->height) {
+        frame = buildBlurredFrame(map, x, y, visited);
+        if (!frame) return NULL;
+        memcpy(fs->sent->words, visited->words,
+               (size_t)visited->wordsPerRow * visited->height * sizeof(uint64_t));
+        fs->keyframe = 0;
+        fs->seq      = 0;
+        goto done;
+    }
+    if (runs == 0 && x == fs->lastX && y == fs->lastY) {
+        frame = NULL; // niente di nuovo: si consumano solo diario e righe sporche
+        goto done;
+    }
 
-    return new_map;
+    // 2. scrittura del delta e aggiornamento di sent
+    frame = frameAlloc(MSG_DELTA, (uint32_t)size);
+    if (!frame) return NULL;
+    char *p = frame + FRAME_HEADER;
+    put32(p,      ++fs->seq);
+    put32(p + 4,  x);
+    put32(p + 8,  y);
+    put32(p + 12, (uint32_t)runs);
+    p += 16;
+
+    for (size_t i = fs->journalPos; i < end; i++) {
+        uint32_t cell = items->cells[i];
+        int r = cell / map->width, c = cell % map->width;
+        if (bitmapTest(fs->sent, r, c)) p = putRun(p, map, r, c, 1);
+    }
+    for (int r = lo; r <= hi; r++) {
+        const uint64_t *v = bitmapRow(visited, r);
+        uint64_t *s = bitmapRow(fs->sent, r);
+        for (int k = 0; k < visited->wordsPerRow; k++) {
+            uint64_t diff = v[k] & ~s[k];
+            s[k] |= diff;
+            while (diff) {
+                int b0 = __builtin_ctzll(diff);
+                uint64_t rest = ~(diff >> b0);
+                int n = rest ? __builtin_ctzll(rest) : 64 - b0;
+                p = putRun(p, map, r, k * 64 + b0, n);
+                diff &= (n + b0 == 64) ? 0 : ~(uint64_t)0 << (b0 + n);
+            }
+        }
+    }
+
+done:
+    fs->journalPos = end;
+    fs->dirtyLo = 1;
+    fs->dirtyHi = 0;
+    fs->lastX = x;
+    fs->lastY = y;
+    return frame;
+}
+
+int applyFogDelta(struct grid *known, const char *payload, uint32_t len, uint32_t *seq, int *x, int *y) {
+    if (len < 16 || get32(payload) != *seq + 1) return -1;
+    uint32_t nRuns = get32(payload + 12);
+    const char *p = payload + 16, *end = payload + len;
+
+    for (uint32_t i = 0; i < nRuns; i++) {
+        if (end - p < 12) return -1;
+        uint32_t r = get32(p), c = get32(p + 4), n = get32(p + 8);
+        p += 12;
+        if (r >= (uint32_t)known->height || c > (uint32_t)known->width ||
+            n > (uint32_t)known->width - c || n > (uint32_t)(end - p))
+            return -1;
+        memcpy(gridRow(known, r) + c, p, n);
+        p += n;
+    }
+
+    *seq = get32(payload);
+    *x   = (int)get32(payload + 4);
+    *y   = (int)get32(payload + 8);
+    return 0;
+}
+
+char *buildItemEvents(struct fogState *fs, const struct bitmap *visited,
+                      const struct cellJournal *items, int width) {
+    // prima si contano, cosi' il frame si alloca una volta sola
+    size_t end = journalEnd(items, fs->journalPos);
+    uint32_t n = 0;
+    for (size_t i = fs->journalPos; i < end; i++)
+        n += bitmapTest(visited, items->cells[i] / width, items->cells[i] % width);
+    if (n == 0) {
+        fs->journalPos = end;
+        return NULL;
+    }
+
+    char *frame = frameAlloc(MSG_ITEMS, 4 + 4 * n);
+    if (!frame) return NULL;
+    char *p = frame + FRAME_HEADER;
+    put32(p, n);
+    p += 4;
+    for (size_t i = fs->journalPos; i < end; i++) {
+        uint32_t cell = items->cells[i];
+        // un oggetto in una cella mai vista non si annuncia: il client lo scoprira' passando
+        if (!bitmapTest(visited, cell / width, cell % width)) continue;
+        put32(p, cell);
+        p += 4;
+    }
+    fs->journalPos = end;
+    return frame;
+}
+
+int applyRevealFrame(struct grid *known, char type, const char *payload, uint32_t len, int *x, int *y) {
+    uint32_t hdr = type == MSG_PATH ? PATH_HEADER : 24;
+    if ((type != MSG_ADJACENT && type != MSG_PATH) || len < hdr) return -1;
+    if (get32(payload) != (uint32_t)known->width || get32(payload + 4) != (uint32_t)known->height)
+        return -1;
+
+    uint32_t px = get32(payload + 8), py = get32(payload + 12);
+    uint32_t rows = get32(payload + 16), cols = get32(payload + 20);
+    uint32_t top, left;
+    if (type == MSG_PATH) {
+        top  = get32(payload + 24);
+        left = get32(payload + 28);
+    } else {
+        // la 3x3 e' tagliata sui bordi: parte una riga/colonna prima del giocatore
+        top  = px > 0 ? px - 1 : 0;
+        left = py > 0 ? py - 1 : 0;
+    }
+    if (px >= (uint32_t)known->height || py >= (uint32_t)known->width ||
+        top > (uint32_t)known->height || rows > (uint32_t)known->height - top ||
+        left > (uint32_t)known->width || cols > (uint32_t)known->width - left ||
+        (uint64_t)rows * cols != len - hdr)
+        return -1;
+
+    const char *p = payload + hdr;
+    for (uint32_t i = 0; i < rows; i++, p += cols) {
+        char *row = gridRow(known, top + i) + left;
+        // '?' non cancella cio' che il client sa gia'; la X non e' una cella
+        for (uint32_t j = 0; j < cols; j++)
+            if (p[j] != '?') row[j] = p[j] == 'X' ? PATH : p[j];
+    }
+    *x = (int)px;
+    *y = (int)py;
+    return 0;
+}
+
+int applyItemEvents(struct grid *known, const char *payload, uint32_t len) {
+    if (len < 4 || (len - 4) / 4 < get32(payload)) return -1;
+    uint32_t n = get32(payload), cells = (uint32_t)known->width * known->height;
+    int changed = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t cell = get32(payload + 4 + 4 * i);
+        if (cell >= cells) return -1;
+        char *c = gridRow(known, cell / known->width) + cell % known->width;
+        if (*c == ITEM) {
+            *c = PATH;
+            changed++;
+        }
+    }
+    return changed;
+}
+
+struct sharedFrame *buildWorldFrame(const struct grid *map) {
+    size_t rowBytes = packedRowBytes(map->width);
+    size_t size = WORLD_HEADER + rowBytes * map->height;
+    if (size > FRAME_MAX_PAYLOAD) return NULL;
+    char *row = malloc(map->width);
+    struct sharedFrame *f = row ? sharedAlloc(MSG_WORLD, (uint32_t)size) : NULL;
+    if (!f) {
+        free(row);
+        return NULL;
+    }
+
+    char *p = f->data + FRAME_HEADER;
+    put32(p,     map->width);
+    put32(p + 4, map->height);
+    p[8] = MAP_ENC_PACK2;
+    p += WORLD_HEADER;
+    // niente nebbia: le righe della mappa si impaccano cosi' come sono
+    for (int i = 0; i < map->height; i++, p += rowBytes) {
+        gridCopyRelaxed(row, map, i, 0, map->width);
+        packCells(row, map->width, (unsigned char *)p);
+    }
+    free(row);
+    return f;
+}
+
+struct grid *decodeWorldFrame(const char *payload, uint32_t len) {
+    if (len < WORLD_HEADER || payload[8] != MAP_ENC_PACK2) return NULL;
+    int width = (int)get32(payload), height = (int)get32(payload + 4);
+    size_t rowBytes = packedRowBytes(width);
+    if (width <= 0 || height <= 0 || (uint64_t)height * rowBytes != len - WORLD_HEADER)
+        return NULL;
+
+    struct grid *map = allocGrid(width, height, '?');
+    if (!map) return NULL;
+    const unsigned char *p = (const unsigned char *)payload + WORLD_HEADER;
+    for (int i = 0; i < height; i++, p += rowBytes)
+        unpackCells(p, width, gridRow(map, i));
+    return map;
 }
 /*
 void sendMap(int sockfd, char **map, int width, int height, int x, int y) {
@@ -319,19 +1481,98 @@ void sendMap(int sockfd, char **map, int width, int height, int x, int y) {
     }
 } */
 
-void adjVisit(int width, int height, int x, int y, int **visited) {
+void adjVisit(struct bitmap *visited, int x, int y) {
     if (!visited) return;
 
-    // Segna la posizione attuale come visitata
-    visited[x][y] = 1;
+    // Segna come visitate la posizione attuale e le 8 celle adiacenti:
+    // tre intervalli di colonne, uno per riga (i bordi li taglia bitmapSetRange)
+    for (int i = x - 1; i <= x + 1; i++)
+        bitmapSetRange(visited, i, y - 1, y + 1);
+}
 
-    // Ciclo per le 8 celle adiacenti + quella centrale
-    for (int i = x - 1; i <= x + 1; i++) {
-        for (int j = y - 1; j <= y + 1; j++) {
-            // Controllo dei bordi della mappa
-            if (i >= 0 && i < height && j >= 0 && j < width) {
-                visited[i][j] = 1;
-            }
+// Tabella di dispatch dei byte di comando: indice in moveStep, 0 se non e' una mossa
+static const unsigned char moveCode[256] = { ['W'] = 1, ['A'] = 2, ['S'] = 3, ['D'] = 4 };
+static const signed char moveStep[5][2] = { {0, 0}, {-1, 0}, {0, -1}, {1, 0}, {0, 1} };
+
+enum moveResult applyMove(struct grid *map, struct bitmap *visited, struct fogState *fog,
+                          struct cellJournal *items, int *x, int *y, char dir) {
+    const signed char *step = moveStep[moveCode[(unsigned char)dir]];
+    int nx = *x + step[0], ny = *y + step[1];
+    // oltre il bordo c'e' solo l'uscita
+    if (nx < 0 || nx >= map->height || ny < 0 || ny >= map->width) return MOVE_EXIT;
+    char *cell = gridRow(map, nx) + ny;
+    // un muro resta un muro: basta una lettura, senza ordinamenti
+    char seen = __atomic_load_n(cell, __ATOMIC_RELAXED);
+    if (seen == WALL) return MOVE_BLOCKED;
+
+    *x = nx;
+    *y = ny;
+    adjVisit(visited, nx, ny);
+    fogTouch(fog, nx);
+    // l'oggetto e' di chi riesce a scambiare ITEM con PATH per primo
+    if (seen != ITEM ||
+        !__atomic_compare_exchange_n(cell, &seen, PATH, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return MOVE_DONE;
+    journalAppend(items, (uint32_t)nx * map->width + ny);
+    return MOVE_ITEM;
+}
+
+enum moveResult applyMoves(struct grid *map, struct bitmap *visited, struct fogState *fog,
+                           struct cellJournal *items, int *x, int *y,
+                           const char *moves, int n, struct moveBatch *out) {
+    enum moveResult res = MOVE_DONE;
+    int top = *x, bottom = *x, left = *y, right = *y;
+    out->applied = out->items = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (!moveCode[(unsigned char)moves[i]]) {
+            res = MOVE_BLOCKED;
+            break;
+        }
+        enum moveResult r = applyMove(map, visited, fog, items, x, y, moves[i]);
+        if (r == MOVE_EXIT || r == MOVE_BLOCKED) {
+            res = r;
+            break;
         }
+        out->applied++;
+        out->items += r == MOVE_ITEM;
+        if (*x < top) top = *x;
+        if (*x > bottom) bottom = *x;
+        if (*y < left) left = *y;
+        if (*y > right) right = *y;
+    }
+
+    // le celle adiacenti al percorso sono state rivelate anche loro
+    out->top    = top > 0 ? top - 1 : 0;
+    out->left   = left > 0 ? left - 1 : 0;
+    out->bottom = bottom < map->height - 1 ? bottom + 1 : map->height - 1;
+    out->right  = right < map->width - 1 ? right + 1 : map->width - 1;
+    return res;
+}
+
+char *buildPathFrame(const struct grid *map, const struct bitmap *visited, int x, int y,
+                     const struct moveBatch *b, uint32_t status) {
+    int nrows = b->bottom - b->top + 1, ncols = b->right - b->left + 1;
+    char *frame = frameAlloc(MSG_PATH, PATH_HEADER + (uint32_t)nrows * ncols);
+    if (!frame) return NULL;
+
+    char *p = frame + FRAME_HEADER;
+    put32(p,      map->width);
+    put32(p + 4,  map->height);
+    put32(p + 8,  x);
+    put32(p + 12, y);
+    put32(p + 16, nrows);
+    put32(p + 20, ncols);
+    put32(p + 24, b->top);
+    put32(p + 28, b->left);
+    put32(p + 32, b->applied);
+    put32(p + 36, status);
+    p += PATH_HEADER;
+
+    for (int i = b->top; i <= b->bottom; i++, p += ncols) {
+        for (int j = 0; j < ncols; j++)
+            p[j] = bitmapTest(visited, i, b->left + j) ? gridGetRelaxed(map, i, b->left + j) : '?';
+        if (i == x && y >= b->left && y <= b->right) p[y - b->left] = 'X';
     }
+    return frame;
 }
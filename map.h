@@ -1,6 +1,10 @@
 #ifndef MAP_H
 #define MAP_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// limiti di default delle dimensioni, sovrascrivibili all'avvio del server
 #define MAXWIDTHMAP 3
 #define MINWIDTHMAP 3
 #define MAXHEIGHTMAP 3
@@ -9,17 +13,355 @@
 #define PATH ' '
 #define ITEM '+'
 
-// Genera una mappa di dimensioni casuali (x = larghezza, y = altezza)
-char **generateMap(int *width, int *height);
-char ** receiveMap(int sockfd, int *width, int *height, int *x, int *y, int *effectiveRows, int *effectiveCols);
-// Libera la memoria della mappa
-void freeMap(char **map, int width);
+/*
+ * Stato del generatore pseudo-casuale (xoshiro256**). Non e' condiviso:
+ * ogni mappa, stanza o giocatore usa la propria istanza, quindi niente
+ * lock nascosti e sequenze riproducibili a partire dal seme.
+ */
+struct rng {
+    uint64_t s[4];
+};
+
+void     rngSeed(struct rng *r, uint64_t seed);
+uint64_t rngNext(struct rng *r);
+// Intero uniforme in [0, n)
+uint32_t rngBelow(struct rng *r, uint32_t n);
+// Seme casuale dal sistema, per quando non serve riproducibilita'
+uint64_t rngEntropySeed(void);
+
+/*
+ * Griglia riga-major in un'unica allocazione (intestazione + celle).
+ * La cella (r, c) sta in cells[r * stride + c]; stride >= width, quindi
+ * per scorrere una riga si usa sempre gridRow().
+ */
+struct grid {
+    int    width;
+    int    height;
+    int    stride;
+    char  *cells;
+    size_t mappedLen;   // > 0 se cells e' una mappatura mmap di un file mappa
+};
+
+static inline char *gridRow(const struct grid *g, int r) {
+    return g->cells + (size_t)r * g->stride;
+}
+static inline char gridGet(const struct grid *g, int r, int c) {
+    return g->cells[(size_t)r * g->stride + c];
+}
+static inline void gridSet(struct grid *g, int r, int c, char v) {
+    g->cells[(size_t)r * g->stride + c] = v;
+}
+
+/*
+ * Letture della mappa di una partita in corso. applyMove cambia ITEM in
+ * PATH con una compare-and-swap mentre altri thread leggono: chi legge
+ * usa load atomici rilassati, mai gridGet o memcpy, cosi' non ci sono
+ * accessi misti (atomici e non) sullo stesso byte. Un load rilassato di
+ * un byte costa quanto una lettura normale; non ordina nulla, e il
+ * diario degli oggetti resta il modo di sapere cosa e' cambiato.
+ */
+static inline char gridGetRelaxed(const struct grid *g, int r, int c) {
+    return __atomic_load_n(&g->cells[(size_t)r * g->stride + c], __ATOMIC_RELAXED);
+}
+// n celle della riga r dalla colonna c in out
+static inline void gridCopyRelaxed(char *out, const struct grid *g, int r, int c, int n) {
+    const char *src = gridRow(g, r) + c;
+    for (int i = 0; i < n; i++) out[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+/*
+ * Bitmap delle celle visitate: 1 bit per cella invece di un int.
+ * Ogni riga parte da una parola a 64 bit nuova, cosi' le operazioni
+ * su intervalli di colonne lavorano una parola alla volta.
+ */
+struct bitmap {
+    int       width;
+    int       height;
+    int       wordsPerRow;
+    uint64_t *words;
+};
+
+static inline uint64_t *bitmapRow(const struct bitmap *b, int r) {
+    return b->words + (size_t)r * b->wordsPerRow;
+}
+static inline int bitmapTest(const struct bitmap *b, int r, int c) {
+    return (bitmapRow(b, r)[c >> 6] >> (c & 63)) & 1;
+}
+static inline void bitmapSet(struct bitmap *b, int r, int c) {
+    bitmapRow(b, r)[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+// Alloca una bitmap width x height azzerata (una sola allocazione)
+struct bitmap *allocBitmap(int width, int height);
+void freeBitmap(struct bitmap *b);
+// Imposta a 1 le colonne [c0, c1] della riga r
+void bitmapSetRange(struct bitmap *b, int r, int c0, int c1);
+
+/*
+ * Distanza (in passi) di ogni cella dall'uscita piu' vicina, calcolata con
+ * una BFS multi-sorgente dalle celle libere del bordo. Le celle muro o
+ * irraggiungibili valgono DIST_INF. Lettura O(1) con distAt().
+ */
+#define DIST_INF UINT32_MAX
+
+struct distField {
+    int       width;
+    int       height;
+    uint32_t *dist;     // width*height, riga-major
+};
+
+static inline uint32_t distAt(const struct distField *df, int r, int c) {
+    return df->dist[(size_t)r * df->width + c];
+}
+
+// Calcola il campo per la mappa (NULL se manca memoria)
+struct distField *computeDistField(const struct grid *map);
+void freeDistField(struct distField *df);
+// Aggiornamenti incrementali: da chiamare dopo aver modificato la cella nella mappa.
+// Cella r,c diventata libera (muro tolto)
+int distFieldOpenCell(struct distField *df, const struct grid *map, int r, int c);
+// Cella r,c diventata muro
+int distFieldCloseCell(struct distField *df, const struct grid *map, int r, int c);
+
+// Alloca una griglia width x height con tutte le celle a fill
+struct grid *allocGrid(int width, int height, char fill);
+
+// Algoritmi di generazione disponibili
+enum mapAlgorithm {
+    MAP_DFS,    // DFS iterativa su tutta la mappa, un thread
+    MAP_TILED,  // DFS per blocchi su piu' thread, poi cucitura dei blocchi
+    MAP_ELLER,  // Eller riga per riga, memoria O(larghezza)
+};
+
+// Riceve una riga della mappa generata in streaming; -1 interrompe la generazione
+typedef int (*mapRowSink)(void *ctx, int row, const char *cells, int width);
+
+// 1 se una mappa width x height (arrotondate a dispari) rispetta i limiti del protocollo:
+// indici di cella a 32 bit (carve, distanze, diario, MSG_ITEMS, MSG_WATCH) e mappa
+// intera impaccata (MSG_BLURRED, MSG_WORLD) entro FRAME_MAX_PAYLOAD
+int mapSizeFits(int width, int height);
+// Genera una mappa di dimensioni casuali nei limiti dati: stesso seme, stessa mappa
+struct grid *generateMap(enum mapAlgorithm alg, int minWidth, int maxWidth, int minHeight, int maxHeight, uint64_t seed);
+// Genera una mappa di dimensioni date (arrotondate a dispari) con l'algoritmo scelto;
+// nThreads vale solo per MAP_TILED (0 = tutti i core)
+struct grid *generateMapWith(enum mapAlgorithm alg, int width, int height, uint64_t seed, int nThreads);
+// DFS seriale
+struct grid *generateMapSized(int width, int height, uint64_t seed);
+// DFS per blocchi in parallelo: stesso seme, stessa mappa qualunque sia nThreads
+struct grid *generateMapTiled(int width, int height, uint64_t seed, int nThreads);
+// Eller: passa a sink le righe 0..height-1 in ordine, senza tenere la mappa in memoria.
+// Ritorna 0 se ok, -1 se fallisce o se il sink interrompe
+int generateMapStream(int width, int height, uint64_t seed, mapRowSink sink, void *ctx);
+// Eller raccolto in una griglia
+struct grid *generateMapEller(int width, int height, uint64_t seed);
+// Sink pronto all'uso: scrive le righe sul file descriptor *(int *)ctx
+int mapFdSink(void *ctx, int row, const char *cells, int width);
+// Riceve un frame mappa (intera MSG_BLURRED, adiacente MSG_ADJACENT o MSG_PATH, vedi net.h):
+// la griglia ha le dimensioni effettive ricevute
+struct grid *receiveMap(int sockfd, int *width, int *height, int *x, int *y);
+// Libera la memoria della mappa (munmap se caricata da file)
+void freeMap(struct grid *map);
+
+/*
+ * File mappa binario: intestazione di MAZE_FILE_HEADER byte seguita dalle
+ * celle riga per riga (width*height char, stride == width). L'intestazione
+ * occupa una pagina intera, cosi' le celle partono allineate e si possono
+ * mappare direttamente con mmap. Interi nell'ordine di byte della macchina:
+ * il campo magic fa da controllo.
+ */
+#define MAZE_FILE_MAGIC   "LMZ1"
+#define MAZE_FILE_VERSION 1
+#define MAZE_FILE_HEADER  4096
+
+struct mazeFileHeader {
+    char     magic[4];      // MAZE_FILE_MAGIC
+    uint32_t version;       // MAZE_FILE_VERSION
+    uint32_t width;
+    uint32_t height;
+    uint64_t seed;          // seme con cui e' stata generata (0 se ignoto)
+    uint32_t exits[4][2];   // riga,colonna delle uscite: sinistra, destra, alto, basso
+    uint64_t itemCount;     // oggetti presenti alla generazione
+    uint64_t payloadOffset; // offset delle celle nel file (MAZE_FILE_HEADER)
+};
+
+// Salva la mappa su file (scrittura su file temporaneo + rename). 0 ok, -1 errore
+int saveMap(const char *path, const struct grid *map, uint64_t seed);
+// Genera con Eller direttamente su file, senza tenere la mappa in memoria
+int generateMapToFile(const char *path, int width, int height, uint64_t seed);
+/*
+ * Carica un file mappa con mmap privata: le pagine restano condivise tra
+ * tutti i processi che mappano lo stesso file finche' nessuno le scrive
+ * (copy-on-write, es. raccolta di un oggetto). hdr puo' essere NULL.
+ */
+struct grid *loadMap(const char *path, struct mazeFileHeader *hdr);
 
 // Stampa la mappa su stdout (per debug)
 
-void sendBlurredMap(int sockfd, char **map, int width, int height, int x, int y, int** visited);
-void sendAdjacentMap(int sockfd, char **map, int width, int height, int x, int y);
-void adjVisit(int width, int height, int x, int y, int **visited);
+/*
+ * Codifica compatta delle mappe intere: 2 bit per cella (WALL 0, PATH 1,
+ * ITEM 2, nebbia '?' 3), 4 celle per byte a partire dai bit bassi. Ogni
+ * riga parte da un byte nuovo. La 'X' del giocatore non ha un codice:
+ * viaggia come PATH e receiveMap la rimette in (x, y).
+ */
+#define MAP_ENC_CHAR  0     // un char per cella
+#define MAP_ENC_PACK2 1     // 2 bit per cella
+
+static inline size_t packedRowBytes(int width) {
+    return ((size_t)width + 3) / 4;
+}
+
+// Impacca n celle in packedRowBytes(n) byte
+void packCells(const char *cells, int n, unsigned char *out);
+// Spacchetta n celle da packedRowBytes(n) byte
+void unpackCells(const unsigned char *in, int n, char *out);
+
+// Spediscono la mappa come un unico frame (vedi net.h). 0 ok, -1 errore
+int sendBlurredMap(int sockfd, const struct grid *map, int x, int y, const struct bitmap *visited);
+int sendAdjacentMap(int sockfd, const struct grid *map, int x, int y);
+// Scrive in frame (almeno ADJ_FRAME_MAX byte) il frame MSG_ADJACENT; ritorna i byte scritti
+#define ADJ_FRAME_MAX (5 + 24 + 9)   // FRAME_HEADER + intestazione + 3x3 celle
+int buildAdjacentFrame(char *frame, const struct grid *map, int x, int y);
+
+/*
+ * Nebbia incrementale. Il server ricorda per ogni giocatore quali celle il
+ * client conosce gia' (sent) e quali righe sono state toccate da adjVisit
+ * dopo l'ultimo invio: ogni push spedisce solo la differenza (MSG_DELTA)
+ * invece della mappa intera. Gli oggetti raccolti finiscono in un diario
+ * condiviso (cellJournal) che ogni giocatore legge dal proprio cursore.
+ * Il primo invio, e ogni invio dopo una richiesta MSG_RESYNC, e' un
+ * keyframe MSG_BLURRED; i delta successivi sono numerati da 1.
+ *
+ * Il diario e' senza lock: ha un posto per ogni oggetto presente quando
+ * viene creato (ognuno si raccoglie una volta sola, vedi applyMove), chi
+ * raccoglie prenota un posto con un incremento atomico e poi ci pubblica
+ * la cella. Chi legge si ferma al primo posto prenotato ma non ancora
+ * pubblicato (journalEnd) e lo riguarda al giro dopo.
+ */
+#define JOURNAL_EMPTY UINT32_MAX
+
+struct cellJournal {
+    uint32_t *cells;    // indici riga*width+colonna in ordine di raccolta, JOURNAL_EMPTY se non pubblicati
+    size_t    len;      // posti prenotati (atomico)
+    size_t    cap;      // oggetti della mappa alla creazione
+};
+
+// Diario con un posto per ogni ITEM di map. 0 ok, -1 se manca memoria
+int journalInit(struct cellJournal *j, const struct grid *map);
+// Pubblica una cella nel diario (anche da piu' thread insieme). 0 ok, -1 se pieno
+int journalAppend(struct cellJournal *j, uint32_t cell);
+// Prima voce da from in poi non ancora pubblicata: [from, journalEnd) si legge senza lock
+size_t journalEnd(const struct cellJournal *j, size_t from);
+void journalFree(struct cellJournal *j);
+
+struct fogState {
+    struct bitmap *sent;    // celle gia' spedite al client
+    int      dirtyLo;       // righe toccate dopo l'ultimo invio (dirtyLo > dirtyHi: nessuna)
+    int      dirtyHi;
+    size_t   journalPos;    // prima voce del diario non ancora guardata
+    uint32_t seq;           // numero dell'ultimo delta (0 subito dopo un keyframe)
+    int      lastX;         // posizione spedita con l'ultimo invio
+    int      lastY;
+    int      keyframe;      // 1: il prossimo invio deve essere completo
+};
+
+int fogInit(struct fogState *fs, int width, int height);
+void fogFree(struct fogState *fs);
+// Da chiamare dopo adjVisit(visited, x, y): segna sporche le righe x-1..x+1
+void fogTouch(struct fogState *fs, int x);
+/*
+ * Costruisce il prossimo frame di nebbia (keyframe o delta, il piu' corto)
+ * da spedire con sendFrameBuf. Ritorna NULL se il client e' gia'
+ * aggiornato o se manca memoria (nel qual caso lo stato non cambia).
+ * Mappa, visited e diario non devono cambiare durante la chiamata.
+ */
+char *fogBuildUpdate(struct fogState *fs, const struct grid *map, int x, int y,
+                     const struct bitmap *visited, const struct cellJournal *items);
+/*
+ * Client: applica il payload di un MSG_DELTA alla mappa nota. Il delta deve
+ * essere il successivo di *seq; in tal caso aggiorna *seq, *x e *y.
+ * Ritorna 0 se ok, -1 se fuori sequenza o malformato (serve un MSG_RESYNC).
+ */
+int applyFogDelta(struct grid *known, const char *payload, uint32_t len, uint32_t *seq, int *x, int *y);
+
+/*
+ * Nebbia lato client (il client manda MSG_CLIENT_FOG prima del login). I
+ * muri non cambiano mai: il client tiene una mappa nota persistente, ci
+ * scrive le celle che riceve con le risposte alle mosse e disegna la
+ * nebbia da se'. Il server non rende piu' la nebbia: a ogni push manda
+ * solo gli oggetti raccolti (da chiunque) in celle che il giocatore ha
+ * gia' visto, come MSG_ITEMS: u32 n, poi n indici riga*width+colonna.
+ */
+// Server: eventi MSG_ITEMS dopo fs->journalPos (che avanza); NULL se non c'e' nulla da dire
+char *buildItemEvents(struct fogState *fs, const struct bitmap *visited,
+                      const struct cellJournal *items, int width);
+// Client: scrive in known le celle di un MSG_ADJACENT o MSG_PATH e aggiorna *x, *y. 0 ok, -1 frame non valido
+int applyRevealFrame(struct grid *known, char type, const char *payload, uint32_t len, int *x, int *y);
+// Client: applica un MSG_ITEMS. Ritorna quante celle sono cambiate, -1 se malformato
+int applyItemEvents(struct grid *known, const char *payload, uint32_t len);
+void adjVisit(struct bitmap *visited, int x, int y);
+
+/*
+ * Spettatori. MSG_WORLD e' la mappa vera, senza nebbia: larghezza,
+ * altezza (u32), codifica (1 byte), poi le righe impaccate a 2 bit. Il
+ * server lo costruisce una volta e lo manda a tutti gli spettatori della
+ * stanza; dopo arrivano i MSG_WATCH, che cominciano con gli oggetti
+ * raccolti nello stesso formato di MSG_ITEMS (applyItemEvents) e
+ * proseguono con i giocatori (vedi server.c).
+ */
+#define WORLD_HEADER 9
+struct sharedFrame;
+// Server: MSG_WORLD come frame condiviso (net.h); NULL se manca memoria
+struct sharedFrame *buildWorldFrame(const struct grid *map);
+// Client: mappa da un MSG_WORLD; NULL se malformato
+struct grid *decodeWorldFrame(const char *payload, uint32_t len);
+
+/*
+ * Mossa di un giocatore: dir e' 'W', 'A', 'S' o 'D' (qualsiasi altro valore
+ * lo lascia dov'e'). Aggiorna *x, *y, visited, nebbia e diario degli
+ * oggetti; se la mossa esce dal bordo non tocca nulla e ritorna MOVE_EXIT.
+ *
+ * Nessun lock sulla mappa: i muri non cambiano mai e si leggono e basta,
+ * l'unica scrittura condivisa e' ITEM -> PATH, fatta con una
+ * compare-and-swap sulla cella, quindi tra due giocatori sulla stessa
+ * cella un solo oggetto viene raccolto da uno solo (MOVE_ITEM), l'altro
+ * ci passa e basta. Chi legge la mappa intanto (gridGetRelaxed,
+ * gridCopyRelaxed) vede per quella cella ITEM o PATH, e il diario lo
+ * aggiorna poi. visited e fog sono del
+ * giocatore e restano sotto il suo lock.
+ */
+enum moveResult { MOVE_BLOCKED, MOVE_DONE, MOVE_ITEM, MOVE_EXIT };
+enum moveResult applyMove(struct grid *map, struct bitmap *visited, struct fogState *fog,
+                          struct cellJournal *items, int *x, int *y, char dir);
+
+/*
+ * Sequenza di mosse (es. "WWWDDS") applicata in un solo passaggio: si
+ * ferma al primo muro, all'uscita o al primo byte che non e' una mossa.
+ * Ritorna MOVE_DONE se le ha eseguite tutte, MOVE_BLOCKED se si e'
+ * fermata prima, MOVE_EXIT se il giocatore e' uscito. Senza lock sulla
+ * mappa, come applyMove.
+ */
+struct moveBatch {
+    int applied;            // mosse eseguite
+    int items;              // oggetti raccolti
+    int top, left;          // area toccata dal percorso con le celle adiacenti,
+    int bottom, right;      // estremi inclusi e tagliati sul bordo della mappa
+};
+enum moveResult applyMoves(struct grid *map, struct bitmap *visited, struct fogState *fog,
+                           struct cellJournal *items, int *x, int *y,
+                           const char *moves, int n, struct moveBatch *out);
+/*
+ * Frame MSG_PATH dopo applyMoves: come MSG_ADJACENT (larghezza, altezza,
+ * x, y, righe, colonne) piu' riga e colonna d'origine dell'area, mosse
+ * eseguite ed esito (PATH_*), poi le celle dell'area; quelle mai
+ * visitate viaggiano come '?'. Da spedire con sendFrameBuf; NULL se
+ * manca memoria.
+ */
+#define PATH_DONE    0      // tutte le mosse eseguite
+#define PATH_STOPPED 1      // fermato da un muro o da un byte non valido
+#define PATH_EXIT    2      // uscita trovata
+#define PATH_HEADER  40
+char *buildPathFrame(const struct grid *map, const struct bitmap *visited, int x, int y,
+                     const struct moveBatch *b, uint32_t status);
 
-void printMap(char **map, int width, int height, int x, int y);
+void printMap(const struct grid *map, int x, int y);
 #endif
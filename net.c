@@ -0,0 +1,264 @@
+#include "net.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+int sendAll(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+char *frameAlloc(char type, uint32_t len) {
+    char *frame = malloc(FRAME_HEADER + (size_t)len);
+    if (!frame) return NULL;
+    frame[0] = type;
+    put32(frame + 1, len);
+    return frame;
+}
+
+int sendFrameBuf(int fd, char *frame) {
+    if (!frame) return -1;
+    int ret = sendAll(fd, frame, FRAME_HEADER + (size_t)get32(frame + 1));
+    free(frame);
+    return ret;
+}
+
+int sendFrame(int fd, char type, const void *payload, uint32_t len) {
+    char hdr[FRAME_HEADER];
+    hdr[0] = type;
+    put32(hdr + 1, len);
+
+    struct iovec iov[2] = {
+        { hdr, FRAME_HEADER },
+        { (void *)payload, len },
+    };
+    int cnt = len ? 2 : 1;
+    size_t left = FRAME_HEADER + (size_t)len;
+
+    /* una writev; se e' parziale si riparte dal primo byte non spedito */
+    while (left > 0) {
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        left -= n;
+        while (cnt > 0 && (size_t)n >= iov[0].iov_len) {
+            n -= iov[0].iov_len;
+            iov[0] = iov[1];
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov[0].iov_base = (char *)iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* riceve esattamente len byte (MSG_WAITALL puo' comunque tornare prima) */
+static int recvAll(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, MSG_WAITALL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int recvFrame(int fd, char *type, char **payload, uint32_t *len) {
+    char hdr[FRAME_HEADER];
+    if (recvAll(fd, hdr, FRAME_HEADER) < 0) return -1;
+    uint32_t n = get32(hdr + 1);
+    if (n > FRAME_MAX_PAYLOAD) return -1;
+
+    char *buf = malloc((size_t)n + 1);
+    if (!buf) return -1;
+    if (recvAll(fd, buf, n) < 0) {
+        free(buf);
+        return -1;
+    }
+    buf[n] = '\0';
+
+    *type = hdr[0];
+    *payload = buf;
+    *len = n;
+    return 0;
+}
+
+/* garantisce spazio per almeno n byte dopo len, compattando se conviene */
+static int netBufReserve(struct netBuf *b, size_t n) {
+    if (b->off > 0 && b->off == b->len) b->off = b->len = 0;
+    if (b->cap - b->len >= n) return 0;
+    if (b->off > 0) {
+        memmove(b->data, b->data + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
+        if (b->cap - b->len >= n) return 0;
+    }
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap - b->len < n) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data) return -1;
+    b->data = data;
+    b->cap  = cap;
+    return 0;
+}
+
+int netBufAppend(struct netBuf *b, const void *p, size_t n) {
+    if (netBufReserve(b, n) < 0) return -1;
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return 0;
+}
+
+int netBufFrame(struct netBuf *b, char type, const void *payload, uint32_t len) {
+    if (netBufReserve(b, FRAME_HEADER + (size_t)len) < 0) return -1;
+    char *p = b->data + b->len;
+    p[0] = type;
+    put32(p + 1, len);
+    if (len) memcpy(p + FRAME_HEADER, payload, len);
+    b->len += FRAME_HEADER + (size_t)len;
+    return 0;
+}
+
+int netBufFlush(int fd, struct netBuf *b) {
+    while (b->off < b->len) {
+        ssize_t n = send(fd, b->data + b->off, b->len - b->off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        b->off += n;
+    }
+    b->off = b->len = 0;
+    return 1;
+}
+
+int netBufFill(int fd, struct netBuf *b, size_t max, int *eof) {
+    *eof = 0;
+    while (b->len - b->off < max) {
+        size_t room = max - (b->len - b->off);
+        if (room > 4096) room = 4096;
+        if (netBufReserve(b, room) < 0) return -1;
+        ssize_t n = recv(fd, b->data + b->len, room, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n < 0) return -1;
+        if (n == 0) {
+            *eof = 1;
+            return 0;
+        }
+        b->len += n;
+    }
+    return 0;  // pieno: il resto aspetta nel socket
+}
+
+int netBufNextFrame(struct netBuf *b, char *type, const char **payload, uint32_t *len, uint32_t max) {
+    size_t avail = b->len - b->off;
+    if (avail < FRAME_HEADER) return 0;
+    const char *p = b->data + b->off;
+    uint32_t n = get32(p + 1);
+    if (n > max) return -1;
+    if (avail < FRAME_HEADER + (size_t)n) return 0;
+    *type    = p[0];
+    *payload = p + FRAME_HEADER;
+    *len     = n;
+    b->off  += FRAME_HEADER + (size_t)n;
+    return 1;
+}
+
+void netBufFree(struct netBuf *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+struct sharedFrame *sharedAlloc(char type, uint32_t len) {
+    struct sharedFrame *f = malloc(sizeof(struct sharedFrame) + FRAME_HEADER + (size_t)len);
+    if (!f) return NULL;
+    f->refs = 1;
+    f->len  = FRAME_HEADER + (size_t)len;
+    f->data[0] = type;
+    put32(f->data + 1, len);
+    return f;
+}
+
+void sharedRetain(struct sharedFrame *f) {
+    __atomic_fetch_add(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+void sharedRelease(struct sharedFrame *f) {
+    if (f && __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) free(f);
+}
+
+int sharedQueuePush(struct sharedQueue *q, struct sharedFrame *f) {
+    if (q->count == SHARED_QUEUE) return -1;
+    sharedRetain(f);
+    q->frames[(q->head + q->count) % SHARED_QUEUE] = f;
+    q->count++;
+    return 0;
+}
+
+void sharedQueueForce(struct sharedQueue *q, struct sharedFrame *f) {
+    if (sharedQueuePush(q, f) == 0) return;
+    // piena: l'ultimo non e' il primo (SHARED_QUEUE > 1), quindi non e' partito nessun suo byte
+    unsigned last = (q->head + q->count - 1) % SHARED_QUEUE;
+    sharedRelease(q->frames[last]);
+    sharedRetain(f);
+    q->frames[last] = f;
+}
+
+int sharedQueueFlush(int fd, struct sharedQueue *q) {
+    while (q->count > 0) {
+        struct iovec iov[SHARED_QUEUE];
+        for (unsigned i = 0; i < q->count; i++) {
+            struct sharedFrame *f = q->frames[(q->head + i) % SHARED_QUEUE];
+            iov[i].iov_base = f->data;
+            iov[i].iov_len  = f->len;
+        }
+        iov[0].iov_base = (char *)iov[0].iov_base + q->off;
+        iov[0].iov_len -= q->off;
+
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = q->count;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+
+        // i frame spediti per intero escono dalla coda, del primo rimasto si ricorda l'offset
+        size_t sent = q->off + (size_t)n;
+        while (q->count > 0 && sent >= q->frames[q->head]->len) {
+            sent -= q->frames[q->head]->len;
+            sharedRelease(q->frames[q->head]);
+            q->head = (q->head + 1) % SHARED_QUEUE;
+            q->count--;
+        }
+        q->off = sent;
+    }
+    q->head = 0;
+    q->off  = 0;
+    return 1;
+}
+
+void sharedQueueFree(struct sharedQueue *q) {
+    while (q->count > 0) {
+        sharedRelease(q->frames[q->head]);
+        q->head = (q->head + 1) % SHARED_QUEUE;
+        q->count--;
+    }
+    q->head = 0;
+    q->off  = 0;
+}
@@ -0,0 +1,149 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Protocollo a frame: ogni messaggio, in entrambe le direzioni, e'
+ *   [tipo: 1 byte][lunghezza payload: 4 byte big-endian][payload]
+ * Il mittente costruisce l'intero frame e lo spedisce con una sola
+ * send()/writev() (ripetuta solo se il kernel ne accetta una parte);
+ * il destinatario legge sempre frame interi.
+ */
+#define FRAME_HEADER      5
+#define FRAME_MAX_PAYLOAD (256u << 20)
+
+/* server -> client */
+#define MSG_ACCEPTED   'A'  /* connessione accettata                       */
+#define MSG_REFUSED    'R'  /* connessione rifiutata (partita iniziata)    */
+#define MSG_YES        'Y'  /* registrazione/login riusciti                */
+#define MSG_NO         'N'  /* registrazione/login falliti                 */
+#define MSG_COUNT      'C'  /* numero di client connessi (u32)             */
+#define MSG_BLURRED    'B'  /* mappa intera con nebbia (keyframe, 2 bit)   */
+#define MSG_DELTA      'D'  /* celle cambiate dall'ultimo invio (map.h)    */
+#define MSG_ADJACENT   'J'  /* sotto-mappa 3x3 attorno al giocatore        */
+#define MSG_PATH       'P'  /* area rivelata da una sequenza di mosse      */
+#define MSG_ITEMS      'I'  /* oggetti raccolti in celle note (nebbia lato client) */
+#define MSG_EXIT_FOUND 'M'  /* il giocatore ha trovato l'uscita            */
+#define MSG_END        'E'  /* fine partita, segue MSG_WIN o MSG_LOSE      */
+                            /* (allo spettatore: payload = vincitore)      */
+#define MSG_WIN        'W'
+#define MSG_LOSE       'L'
+#define MSG_USERS      'U'  /* lista utenti: u32 n, poi n x (u32 len, nome) */
+#define MSG_WORLD      'V'  /* spettatore: mappa intera senza nebbia (map.h) */
+#define MSG_WATCH      'Q'  /* spettatore: oggetti raccolti e giocatori (map.h) */
+
+/* client -> server */
+#define MSG_ASK_COUNT  'C'  /* chiede il numero di client connessi         */
+#define MSG_REGISTER   'R'  /* payload: username                           */
+#define MSG_PASSWORD   'P'  /* payload: password (dopo MSG_REGISTER)       */
+#define MSG_LOGIN      'L'  /* payload: username                           */
+#define MSG_CLIENT_FOG 'F'  /* prima del login: la nebbia la disegna il client */
+#define MSG_SPECTATE   'O'  /* al posto del login: osserva una partita     */
+                            /* (payload vuoto o u32 numero della stanza)   */
+#define MSG_COMMAND    'K'  /* payload: comando testuale (W/A/S/D/list/exit) */
+                            /* o sequenza di mosse (es. "WWWDDS")          */
+#define MSG_RESYNC     'S'  /* delta fuori sequenza: serve un keyframe     */
+#define MSG_ACK        'x'  /* risultato finale ricevuto                   */
+
+/* mosse oltre questa soglia in un solo MSG_COMMAND vengono ignorate */
+#define MAX_PATH_MOVES 64
+
+static inline void put32(char *p, uint32_t v) {
+    p[0] = (char)(v >> 24); p[1] = (char)(v >> 16); p[2] = (char)(v >> 8); p[3] = (char)v;
+}
+static inline uint32_t get32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
+
+// Spedisce len byte, ripetendo la send se il kernel ne accetta solo una parte
+int sendAll(int fd, const void *buf, size_t len);
+// Alloca un frame con intestazione gia' scritta; il payload va in buf + FRAME_HEADER
+char *frameAlloc(char type, uint32_t len);
+// Spedisce un frame costruito con frameAlloc e lo libera
+int sendFrameBuf(int fd, char *frame);
+// Spedisce un frame (intestazione + payload) con una sola writev
+int sendFrame(int fd, char type, const void *payload, uint32_t len);
+/*
+ * Riceve un frame intero. *payload e' allocato (terminato da '\0' per
+ * comodita' con i payload testuali) e va liberato con free().
+ * Ritorna 0 se ok, -1 su errore, disconnessione o frame troppo grande.
+ */
+int recvFrame(int fd, char *type, char **payload, uint32_t *len);
+
+/*
+ * Buffer per socket non bloccanti: i byte validi sono [off, len) di data.
+ * In ingresso accumula byte finche' non formano frame interi, in uscita
+ * tiene cio' che il kernel non ha ancora accettato.
+ */
+struct netBuf {
+    char  *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+};
+
+// Accoda n byte. 0 ok, -1 se manca memoria
+int netBufAppend(struct netBuf *b, const void *p, size_t n);
+// Accoda un frame intero (intestazione + payload)
+int netBufFrame(struct netBuf *b, char type, const void *payload, uint32_t len);
+// Spedisce quanto possibile: 1 se il buffer si e' svuotato, 0 se resta qualcosa, -1 errore
+int netBufFlush(int fd, struct netBuf *b);
+// Legge dal socket finche' ci sono dati e il buffer ha meno di max byte da consumare.
+// 0 ok (*eof = 1 se il peer ha chiuso), -1 errore
+int netBufFill(int fd, struct netBuf *b, size_t max, int *eof);
+/*
+ * Estrae il prossimo frame completo dal buffer. *payload punta dentro il
+ * buffer (non terminato da '\0') ed e' valido fino alla prossima Fill.
+ * Ritorna 1 se c'e' un frame, 0 se non e' ancora arrivato per intero,
+ * -1 se il frame dichiara piu' di max byte.
+ */
+int netBufNextFrame(struct netBuf *b, char *type, const char **payload, uint32_t *len, uint32_t max);
+static inline size_t netBufPending(const struct netBuf *b) {
+    return b->len - b->off;
+}
+void netBufFree(struct netBuf *b);
+
+/*
+ * Frame condiviso: costruito una volta e spedito a piu' connessioni senza
+ * copiarlo. data e' il frame intero (intestazione + payload); refs e'
+ * atomico e l'ultimo sharedRelease lo libera.
+ */
+struct sharedFrame {
+    int    refs;
+    size_t len;
+    char   data[];
+};
+
+// Frame con intestazione gia' scritta e refs = 1; il payload va in data + FRAME_HEADER
+struct sharedFrame *sharedAlloc(char type, uint32_t len);
+void sharedRetain(struct sharedFrame *f);
+void sharedRelease(struct sharedFrame *f);
+
+/*
+ * Coda d'uscita di frame condivisi: si spediscono con una writev che punta
+ * dentro i frame stessi. Tiene al piu' SHARED_QUEUE frame: se e' piena il
+ * frame nuovo viene rifiutato, cosi' un destinatario lento ne salta
+ * qualcuno invece di far crescere la memoria o fermare chi spedisce.
+ */
+#define SHARED_QUEUE 4
+
+struct sharedQueue {
+    struct sharedFrame *frames[SHARED_QUEUE];
+    unsigned head;              /* primo frame da spedire                 */
+    unsigned count;
+    size_t   off;               /* byte del primo frame gia' spediti      */
+};
+
+// Accoda f (prendendone un riferimento). 0 ok, -1 se la coda e' piena
+int sharedQueuePush(struct sharedQueue *q, struct sharedFrame *f);
+// Come sharedQueuePush, ma a coda piena f prende il posto dell'ultimo frame (mai di quello in spedizione)
+void sharedQueueForce(struct sharedQueue *q, struct sharedFrame *f);
+// Come netBufFlush: 1 se la coda si e' svuotata, 0 se resta qualcosa, -1 errore
+int sharedQueueFlush(int fd, struct sharedQueue *q);
+// Rilascia i frame ancora in coda
+void sharedQueueFree(struct sharedQueue *q);
+
+#endif
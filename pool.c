@@ -0,0 +1,270 @@
+#include "pool.h"
+#include <stdlib.h>
+
+/* worker corrente: lo usa poolSubmit per scegliere la coda propria */
+static __thread struct pool *poolCur;
+static __thread int poolSelf = -1;
+
+static int dequeInit(struct poolDeque *dq) {
+    dq->cap   = 64;
+    dq->head  = dq->tail = 0;
+    dq->tasks = malloc(dq->cap * sizeof(struct poolTask));
+    if (!dq->tasks) return -1;
+    pthread_mutex_init(&dq->lock, NULL);
+    return 0;
+}
+
+static int dequePush(struct poolDeque *dq, struct poolTask t) {
+    pthread_mutex_lock(&dq->lock);
+    unsigned n = dq->tail - dq->head;
+    if (n == dq->cap) {
+        // anello pieno: raddoppia e rimette gli elementi in ordine da 0
+        struct poolTask *tasks = malloc(2 * dq->cap * sizeof(struct poolTask));
+        if (!tasks) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        for (unsigned i = 0; i < n; i++) tasks[i] = dq->tasks[(dq->head + i) & (dq->cap - 1)];
+        free(dq->tasks);
+        dq->tasks = tasks;
+        dq->cap  *= 2;
+        dq->head  = 0;
+        dq->tail  = n;
+    }
+    dq->tasks[dq->tail & (dq->cap - 1)] = t;
+    dq->tail++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+/* il proprietario pesca l'ultimo inserito */
+static int dequePop(struct poolDeque *dq, struct poolTask *t) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head) {
+        dq->tail--;
+        *t = dq->tasks[dq->tail & (dq->cap - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+/* gli altri rubano il piu' vecchio */
+static int dequeSteal(struct poolDeque *dq, struct poolTask *t) {
+    int found = 0;
+    if (pthread_mutex_trylock(&dq->lock) != 0) return 0;  // occupata: si prova la prossima
+    if (dq->tail != dq->head) {
+        *t = dq->tasks[dq->head & (dq->cap - 1)];
+        dq->head++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int findTask(struct pool *p, int self, struct poolTask *t) {
+    if (dequePop(&p->deques[self], t)) return 1;
+    for (int i = 1; i < p->nThreads; i++)
+        if (dequeSteal(&p->deques[(self + i) % p->nThreads], t)) return 1;
+    return 0;
+}
+
+static void *poolWorker(void *arg) {
+    struct pool *p = arg;
+    int self = __atomic_fetch_add(&p->nextSelf, 1, __ATOMIC_RELAXED);
+    poolCur  = p;
+    poolSelf = self;
+
+    for (;;) {
+        struct poolTask t;
+        if (findTask(p, self, &t)) {
+            __atomic_fetch_sub(&p->queued, 1, __ATOMIC_SEQ_CST);
+            __atomic_fetch_add(&p->quiet[self], 1, __ATOMIC_SEQ_CST);
+            t.fn(t.arg);
+            __atomic_fetch_add(&p->quiet[self], 1, __ATOMIC_SEQ_CST);
+            if (__atomic_sub_fetch(&p->inflight, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&p->lock);
+                pthread_cond_broadcast(&p->idle);
+                pthread_mutex_unlock(&p->lock);
+            }
+            continue;
+        }
+
+        // niente da fare ne' da rubare: si dorme finche' poolSubmit non sveglia
+        pthread_mutex_lock(&p->lock);
+        __atomic_fetch_add(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (!p->stop && __atomic_load_n(&p->queued, __ATOMIC_SEQ_CST) <= 0)
+            pthread_cond_wait(&p->wake, &p->lock);
+        __atomic_fetch_sub(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+        int stop = p->stop && __atomic_load_n(&p->queued, __ATOMIC_SEQ_CST) <= 0;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) break;
+    }
+    return NULL;
+}
+
+static void poolFree(struct pool *p, int nDeques) {
+    if (p->deques)
+        for (int i = 0; i < nDeques; i++) free(p->deques[i].tasks);
+    free(p->deques);
+    free(p->threads);
+    free(p->quiet);
+    free(p);
+}
+
+/* sveglia i worker e aspetta che escano (dopo aver vuotato le code) */
+static void poolStop(struct pool *p, int nStarted) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < nStarted; i++) pthread_join(p->threads[i], NULL);
+}
+
+struct pool *poolCreate(int nThreads) {
+    if (nThreads < 1) nThreads = 1;
+    struct pool *p = calloc(1, sizeof(struct pool));
+    if (!p) return NULL;
+    p->nThreads = nThreads;
+    p->threads  = calloc(nThreads, sizeof(pthread_t));
+    p->deques   = calloc(nThreads, sizeof(struct poolDeque));
+    p->quiet    = calloc(nThreads, sizeof(unsigned long));
+    if (!p->threads || !p->deques || !p->quiet) {
+        poolFree(p, nThreads);
+        return NULL;
+    }
+    for (int i = 0; i < nThreads; i++) {
+        if (dequeInit(&p->deques[i]) < 0) {
+            poolFree(p, nThreads);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->idle, NULL);
+
+    for (int i = 0; i < nThreads; i++) {
+        if (pthread_create(&p->threads[i], NULL, poolWorker, p) != 0) {
+            poolStop(p, i);
+            poolFree(p, nThreads);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+int poolSubmit(struct pool *p, void (*fn)(void *), void *arg) {
+    struct poolTask t = { fn, arg };
+    int self = poolCur == p ? poolSelf : -1;
+    if (self < 0)
+        self = __atomic_fetch_add(&p->nextDeque, 1, __ATOMIC_RELAXED) % p->nThreads;
+
+    __atomic_fetch_add(&p->inflight, 1, __ATOMIC_SEQ_CST);
+    if (dequePush(&p->deques[self], t) < 0) {
+        __atomic_fetch_sub(&p->inflight, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    // queued prima di sleepers, il worker fa l'opposto: nessuno dorme con lavoro in coda
+    __atomic_fetch_add(&p->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_signal(&p->wake);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return 0;
+}
+
+void poolDrain(struct pool *p) {
+    pthread_mutex_lock(&p->lock);
+    while (__atomic_load_n(&p->inflight, __ATOMIC_SEQ_CST) > 0)
+        pthread_cond_wait(&p->idle, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void poolDestroy(struct pool *p) {
+    poolDrain(p);
+    poolStop(p, p->nThreads);
+    poolFree(p, p->nThreads);
+}
+
+void poolQuietSnap(struct pool *p, unsigned long *snap) {
+    for (int i = 0; i < p->nThreads; i++)
+        snap[i] = __atomic_load_n(&p->quiet[i], __ATOMIC_SEQ_CST);
+}
+
+// un contatore dispari e ancora uguale: quel worker e' dentro lo stesso task
+int poolQuietPassed(struct pool *p, const unsigned long *snap) {
+    for (int i = 0; i < p->nThreads; i++)
+        if ((snap[i] & 1) && __atomic_load_n(&p->quiet[i], __ATOMIC_SEQ_CST) == snap[i])
+            return 0;
+    return 1;
+}
+
+void poolStrandInit(struct poolStrand *s, struct pool *p) {
+    s->pool = p;
+    pthread_mutex_init(&s->lock, NULL);
+    s->head = s->tail = NULL;
+    s->scheduled = 0;
+}
+
+/* task del pool che serve una strand: esegue i suoi task uno alla volta */
+static void strandRun(void *arg) {
+    struct poolStrand *s = arg;
+    int done = 0;
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        struct poolStrandTask *t = s->head;
+        if (!t) {
+            s->scheduled = 0;
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+        if (done == POOL_STRAND_BATCH) {
+            // lascia il worker agli altri; se non si puo' riaccodare si continua qui
+            pthread_mutex_unlock(&s->lock);
+            if (poolSubmit(s->pool, strandRun, s) == 0) return;
+            done = 0;
+            continue;
+        }
+        s->head = t->next;
+        if (!s->head) s->tail = NULL;
+        pthread_mutex_unlock(&s->lock);
+
+        t->fn(t->arg);
+        free(t);
+        done++;
+    }
+}
+
+int poolStrandSubmit(struct poolStrand *s, void (*fn)(void *), void *arg) {
+    struct poolStrandTask *t = malloc(sizeof(struct poolStrandTask));
+    if (!t) return -1;
+    t->fn   = fn;
+    t->arg  = arg;
+    t->next = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->tail) s->tail->next = t;
+    else s->head = t;
+    s->tail = t;
+    int schedule = !s->scheduled;
+    s->scheduled = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    if (schedule && poolSubmit(s->pool, strandRun, s) < 0) {
+        // il task resta accodato: partira' con il prossimo submit riuscito
+        pthread_mutex_lock(&s->lock);
+        s->scheduled = 0;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return 0;
+}
+
+int poolStrandIdle(struct poolStrand *s) {
+    pthread_mutex_lock(&s->lock);
+    // strandRun azzera scheduled sotto lock e poi non tocca piu' la strand
+    int idle = !s->scheduled && !s->head;
+    pthread_mutex_unlock(&s->lock);
+    return idle;
+}
@@ -0,0 +1,86 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+/*
+ * Pool di thread con work stealing. Ogni worker ha una propria coda
+ * (deque): quello che un worker sottomette finisce in cima alla sua coda
+ * e lo riprende per primo (LIFO, dati ancora in cache); un worker senza
+ * lavoro ruba dal fondo delle code altrui (FIFO, i task piu' vecchi).
+ * I task sottomessi da thread esterni al pool vanno alle code a turno.
+ *
+ * Nessun ordine tra task diversi: per eseguire in ordine i task di uno
+ * stesso oggetto (es. i comandi di un giocatore) si usa una poolStrand.
+ */
+struct poolTask {
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+struct poolDeque {
+    pthread_mutex_t lock;
+    struct poolTask *tasks;     /* anello di cap elementi                 */
+    unsigned head;              /* prossimo da rubare                     */
+    unsigned tail;              /* prossimo libero (il proprietario pesca tail-1) */
+    unsigned cap;               /* potenza di 2                           */
+};
+
+struct pool {
+    int nThreads;
+    pthread_t *threads;
+    struct poolDeque *deques;   /* una per worker                         */
+    unsigned nextDeque;         /* turno per i submit esterni (atomico)   */
+    int nextSelf;               /* indice del prossimo worker avviato     */
+    int queued;                 /* task nelle code (atomico)              */
+    int inflight;               /* sottomessi e non ancora finiti (atomico) */
+    int sleepers;               /* worker fermi su wake (atomico)         */
+    unsigned long *quiet;       /* per worker, dispari durante un task (atomico) */
+    int stop;
+    pthread_mutex_t lock;       /* per wake e idle                        */
+    pthread_cond_t  wake;       /* c'e' lavoro                            */
+    pthread_cond_t  idle;       /* inflight e' tornato a 0                */
+};
+
+// Avvia nThreads worker. NULL se mancano memoria o thread
+struct pool *poolCreate(int nThreads);
+// Sottomette fn(arg). 0 ok, -1 se manca memoria
+int poolSubmit(struct pool *p, void (*fn)(void *), void *arg);
+// Aspetta che non ci siano task in coda o in esecuzione
+void poolDrain(struct pool *p);
+// Finisce i task pendenti, ferma i worker e libera il pool
+void poolDestroy(struct pool *p);
+// Copia in snap (nThreads elementi) i contatori quiet dei worker
+void poolQuietSnap(struct pool *p, unsigned long *snap);
+// 1 se ogni task in corso al momento di snap e' finito
+int poolQuietPassed(struct pool *p, const unsigned long *snap);
+
+/*
+ * Coda seriale sopra il pool: i task di una strand girano uno alla volta e
+ * nell'ordine di sottomissione, su qualunque worker. La strand occupa il
+ * pool solo mentre ha task; ogni POOL_STRAND_BATCH task si rimette in coda
+ * per non monopolizzare un worker.
+ */
+#define POOL_STRAND_BATCH 16
+
+struct poolStrandTask {
+    void (*fn)(void *arg);
+    void *arg;
+    struct poolStrandTask *next;
+};
+
+struct poolStrand {
+    struct pool *pool;
+    pthread_mutex_t lock;
+    struct poolStrandTask *head;
+    struct poolStrandTask *tail;
+    int scheduled;              /* 1 se un task del pool la sta servendo  */
+};
+
+void poolStrandInit(struct poolStrand *s, struct pool *p);
+// Accoda fn(arg) alla strand. 0 ok, -1 se manca memoria (fn non verra' chiamata)
+int poolStrandSubmit(struct poolStrand *s, void (*fn)(void *), void *arg);
+// 1 se la strand non ha task in coda ne' in esecuzione e non tocchera' piu' s
+int poolStrandIdle(struct poolStrand *s);
+
+#endif
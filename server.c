@@ -3,7 +3,9 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
@@ -13,177 +15,423 @@
 #include <errno.h>
 #include <sys/wait.h>
 #include "map.h"
+#include "net.h"
+#include "wheel.h"
+#include "pool.h"
 
 /*
- * Intervallo in secondi tra un invio di nebbia e il successivo.
+ * Intervallo in secondi tra un invio di nebbia e il successivo (default).
  */
 #define SECONDS_TO_BLUR 5
 
 /*
- * Durata della partita in secondi. Allo scadere il server notifica
- * tutti i client e la sessione si chiude.
+ * Durata della partita in secondi (default). Allo scadere il server
+ * notifica tutti i client e la sessione si chiude.
  */
 #define TIMER 40
 
+/*
+ * Secondi senza dati dal client prima di chiudere la connessione, nelle
+ * fasi in cui il server aspetta una sua risposta (auth, ack finale).
+ */
+#define IDLE_SECONDS 60
+
+/*
+ * Porta TCP e percorso del socket Unix (default). Il socket Unix serve lo
+ * stesso protocollo ai client sulla stessa macchina (bot, benchmark)
+ * senza passare dallo stack TCP.
+ */
+#define SERVER_PORT      8080
+#define UNIX_SOCKET_PATH "maze.sock"
+
+/*
+ * Stanze (partite) che possono esistere insieme (default), ognuna con la
+ * propria mappa.
+ */
+#define MAX_ROOMS 16
+
+/*
+ * Risoluzione della timer wheel (nebbia, fine partita, inattivita').
+ */
+#define WHEEL_TICK_MS 50
+
+/*
+ * Ogni quanti millisecondi gli spettatori ricevono posizioni e oggetti.
+ */
+#define SPECTATE_MS 100
+
+/*
+ * Log asincrono: righe in coda per lo scrittore (potenza di 2), lunghezza
+ * massima di una riga e ogni quanti millisecondi lo scrittore svuota la
+ * coda su filelog.txt.
+ */
+#define LOG_RING      4096
+#define LOG_LINE_MAX  512
+#define LOG_FLUSH_MS  20
+
+/*
+ * Preset di stress (-S): labirinto da 6001x6001 (36 milioni di celle),
+ * nebbia ogni secondo e partita lunga, per far emergere il costo per
+ * cella di generazione, nebbia, adiacenza e bitmap visited.
+ */
+#define STRESS_SIDE          6001
+#define STRESS_TIMER         120
+#define STRESS_SECONDS_TO_BLUR 1
+
+/* --------------------------------------------------------------------------
+ * Configurazione letta da riga di comando all'avvio (vedi main).
+ * -------------------------------------------------------------------------- */
+struct serverConfig {
+    int minWidth, maxWidth;   /* limiti larghezza mappa (estremi inclusi)   */
+    int minHeight, maxHeight; /* limiti altezza mappa                       */
+    int gameSeconds;          /* durata della partita                       */
+    int blurSeconds;          /* intervallo tra due invii di nebbia         */
+    int idleSeconds;          /* inattivita' tollerata in auth e risultato  */
+    int stress;               /* 1: preset di stress, tempi nel log         */
+    enum mapAlgorithm algorithm; /* come generare la mappa                  */
+    const char *loadPath;     /* se != NULL la mappa si carica da qui        */
+    const char *savePath;     /* se != NULL la mappa generata si salva qui   */
+    int port;                 /* porta TCP                                  */
+    const char *unixPath;     /* socket Unix; stringa vuota = disattivato   */
+    int maxRooms;             /* stanze in uso al piu' nello stesso momento */
+    int procs;                /* processi server (-P), ognuno con le sue stanze */
+} gConfig = { MINWIDTHMAP, MAXWIDTHMAP, MINHEIGHTMAP, MAXHEIGHTMAP,
+              TIMER, SECONDS_TO_BLUR, IDLE_SECONDS, 0, MAP_DFS, NULL, NULL,
+              SERVER_PORT, UNIX_SOCKET_PATH, MAX_ROOMS, 1 };
+
 /* --------------------------------------------------------------------------
  * Sincronizzazione
  *
- * mutex          -> protegge la mappa condivisa durante gli spostamenti
  * scoreMutex     -> garantisce scrittura atomica su score.txt
  * scoreCond      -> usata assieme a scoreChanging per serializzare gli accessi
- * lobbyMutex     -> protegge le variabili di lobby (nReady, gameStarted, ecc.)
- * lobbyCond      -> usata per far attendere i thread finche' la partita non parte
- * timerMutex     -> protegge la variabile timeUp
- * logMutex       -> garantisce che le righe di log non si mescolino tra thread
- * listMutex      -> protegge la userList condivisa (insert/remove/send)
+ * logMutex       -> righe di log scritte direttamente, prima che parta lo
+ *                   scrittore (vedi log_event)
+ * roomsMutex     -> protegge roomList, la stanza aperta e serverRng
+ * reapMutex      -> protegge closedList e retiredUsers (da liberare)
+ *
+ * Lobby, mappa, timer e vincitore di una partita hanno i lock della
+ * propria stanza (vedi struct room).
  * -------------------------------------------------------------------------- */
-pthread_mutex_t mutex      = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t scoreMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t  scoreCond  = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t lobbyMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  lobbyCond  = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t timerMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t logMutex   = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t listMutex  = PTHREAD_MUTEX_INITIALIZER;
-char gWinner[256] = {0};
-int  gWinnerCalculated = 0;
-pthread_mutex_t gWinnerMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  gWinnerCond  = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t endMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t endCond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t roomsMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t reapMutex  = PTHREAD_MUTEX_INITIALIZER;
 /* --------------------------------------------------------------------------
  * Stato globale del server
  * -------------------------------------------------------------------------- */
-int nReady        = 0;  /* quanti client hanno inviato username e sono in lobby */
-int nClients      = 0;  /* quanti client sono connessi in totale                */
-int gameStarted   = 0;  /* flag: la partita e' iniziata                         */
-int timeUp        = 0;  /* flag: il timer e' scaduto                            */
 int scoreChanging = 0;  /* semaforo logico: 1 mentre qualcuno scrive score.txt  */
-int nEnd = 0;
 /*
  * fd globale del file di log: aperto nel main e condiviso da tutti i thread.
  * Tutte le scritture passano per log_event() che e' thread-safe
  */
 int gLogFd = -1;
 
-/* pipe usata dai thread per svegliare la select() del main quando la partita finisce */
-int gameEnd = 0;
+/*
+ * Coda del log: MPSC a posti fissi, ogni posto ha un numero di sequenza
+ * che dice di chi e' il turno (seq == pos: libero per il produttore che
+ * prenota pos, seq == pos + 1: pronto per lo scrittore).
+ */
+struct logSlot {
+    unsigned long seq;
+    time_t when;
+    unsigned len;
+    char msg[LOG_LINE_MAX];
+};
+static struct logSlot logRing[LOG_RING];
+static unsigned long logTail;      /* prossimo posto da prenotare (atomico) */
+static unsigned long logHead;      /* prossimo posto da scrivere, solo lo scrittore */
+static unsigned long logDrops;     /* righe perse a coda piena (atomico)    */
+static time_t logNow;              /* orologio grossolano, aggiornato dallo scrittore */
+static int logAsync;               /* 1 mentre lo scrittore gira            */
+static int logStopping;
+static pthread_t logWriterTid;
+
+/* --------------------------------------------------------------------------
+ * Stati di una connessione. Un solo reattore epoll guida tutte le
+ * connessioni attraverso lo stesso percorso che prima seguiva il thread
+ * newUser: auth -> lobby -> gioco -> fine partita -> risultato.
+ * -------------------------------------------------------------------------- */
+enum connState {
+    ST_AUTH,        /* attesa di MSG_ASK_COUNT, MSG_REGISTER o MSG_LOGIN     */
+    ST_PASSWORD,    /* registrazione: attesa di MSG_PASSWORD                 */
+    ST_RELOGIN,     /* registrazione riuscita: attesa di MSG_LOGIN           */
+    ST_LOBBY,       /* autenticato, aspetta che tutti siano pronti           */
+    ST_GAMING,      /* in partita: comandi e nebbia                          */
+    ST_ENDGAME,     /* ha finito, aspetta il calcolo del vincitore           */
+    ST_RESULT,      /* risultato inviato, aspetta MSG_ACK                    */
+    ST_SPECTATE,    /* spettatore: riceve solo i frame della stanza osservata */
+    ST_CLOSED       /* socket chiuso; la struttura resta fino all'uscita     */
+};
 
+/*
+ * Quello che gli altri vedono di un giocatore (posizione, oggetti, esito),
+ * dietro un seqlock: lo scrive solo chi tiene il lock della connessione
+ * (publishPlayer), chi lo legge non prende lock e rilegge se ha
+ * incrociato una scrittura (readPlayer). seq e' dispari mentre si scrive.
+ */
+#define PLAYER_HIDDEN (-1)      /* fuori dalla partita: nessuno lo mostra  */
 
-pthread_t timerTid;
+struct playerView {
+    unsigned seq;
+    int x, y;
+    int items;
+    int phase;                  /* PLAYER_HIDDEN, 0 in gioco, 1 uscito, 2 fuori */
+};
 
 /* --------------------------------------------------------------------------
  * Struttura dati per ogni client connesso.
- * Ogni thread newUser riceve un puntatore a questa struttura e la usa
- * per tutta la durata della sessione.
+ * Vive dall'accept finche' il reaper non la libera: chiuso il socket
+ * resta in memoria per un periodo di grazia, cosi' nessun thread puo'
+ * trovarsi in mano un puntatore a memoria liberata (vedi reapClosed).
+ * lock la protegge per intero: i worker la prendono per ogni evento
+ * epoll e per ogni timer scaduto.
  * -------------------------------------------------------------------------- */
 struct data {
-    int    user;           /* file descriptor del socket del client           */
+    int    user;           /* file descriptor del socket del client (non bloccante) */
     char   ip[INET_ADDRSTRLEN]; /* indirizzo IP del client in formato stringa */
     char   username[256];  /* nome utente, popolato dopo l'autenticazione     */
-    char **map;            /* puntatore alla mappa condivisa                  */
-    int    width;
-    int    height;
+    struct room *room;     /* stanza della partita (fissa dall'accept)        */
+    struct grid *map;      /* mappa condivisa della stanza                    */
+    const struct distField *dist; /* distanza di ogni cella dall'uscita (sola lettura) */
     int    x;              /* posizione corrente del giocatore (riga)         */
     int    y;              /* posizione corrente del giocatore (colonna)      */
-    int  **visited;        /* celle gia' visitate (usate per la nebbia)       */
+    struct bitmap *visited; /* celle gia' visitate, 1 bit per cella (nebbia)  */
+    struct fogState fog;   /* cosa conosce gia' il client (delta di nebbia)   */
     int    collectedItems; /* oggetti raccolti durante la partita             */
+    struct playerView view; /* x, y, oggetti ed esito per chi legge senza lock */
     int    exitFlag;       /* 1 se il giocatore ha raggiunto l'uscita         */
-    int    gameOver;       /* 1 quando il giocatore ha finito: segnala al thread blur di fermarsi */
+    int    gameOver;       /* 1 quando il giocatore ha finito la partita      */
     int    disconnected;   /* 1 se il giocatore si e' disconnesso */
-    pthread_mutex_t socketWriteMutex; /* protegge le send() sul socket        */
+    int    authOk;         /* 1 se l'autenticazione e' andata a buon fine     */
+    int    clientFog;      /* 1: nebbia disegnata dal client, solo MSG_ITEMS  */
+    struct rng rng;        /* generatore privato del giocatore (spawn)        */
+    enum connState state;  /* a che punto della sessione e' il client         */
+    struct netBuf in;      /* byte ricevuti che non formano ancora un frame   */
+    struct netBuf out;     /* frame che il socket non ha ancora accettato     */
+    pthread_mutex_t lock;  /* un solo thread per volta sulla connessione      */
+    struct wheelTimer fogTimer;  /* prossimo invio di nebbia (in partita)     */
+    struct wheelTimer idleTimer; /* controllo di inattivita'                  */
+    uint64_t lastInput;    /* ms (wheelClockMs) dell'ultimo dato ricevuto     */
+    struct poolStrand strand; /* comandi di gioco, eseguiti in ordine dal pool */
+    int    queued;         /* comandi sulla strand non ancora eseguiti        */
+    struct data *roomNext; /* membri della stanza                             */
+    struct data **roomPprev;
+    struct data *reapNext; /* closedList e periodo di grazia                  */
+    struct room *watch;    /* spettatore: stanza osservata (NULL se gioca)    */
+    struct sharedQueue spec; /* spettatore: frame condivisi in uscita         */
+    int    specNeedKey;    /* 1: al prossimo giro serve un MSG_WORLD          */
+    int    specReady;      /* out e' vuoto: la coda spec puo' spedire         */
+    int    specDone;       /* partita finita: chiudere a coda vuota           */
+    struct data *specNext; /* spettatori della stanza osservata               */
+    struct data **specPprev;
 };
 
-struct userNode {
-    char username[256];
-    struct userNode * next;
+static void rearm(struct data *d);
+
+/*
+ * Utenti di una stanza come copia immutabile, gia' serializzata nel frame
+ * MSG_USERS: ogni ingresso o uscita ne costruisce una nuova dalla
+ * precedente e la pubblica con uno store atomico, "list" spedisce quella
+ * pubblicata senza lock. Una versione sostituita puo' essere ancora in
+ * lettura da un comando: finisce in retiredUsers e reapClosed la libera
+ * dopo un periodo di grazia (vedi reapClosed).
+ */
+struct userSnapshot {
+    struct userSnapshot *retireNext;  /* retiredUsers e periodo di grazia */
+    unsigned version;
+    uint32_t nUsers;
+    size_t len;                 /* frame intero: intestazione + payload */
+    char frame[];
 };
 
-struct userList {
-    struct userNode * head;
-    struct userNode * tail;
-    int nUsers;
-} userList = {NULL, NULL, 0};
-
-void insertUser(char * username) {
-    struct userNode *node = malloc(sizeof(struct userNode));
-    if (!node) return;
-    strncpy(node->username, username, sizeof(node->username) - 1);
-    node->username[sizeof(node->username) - 1] = '\0';
-    /* sanitizza eventuali \r\n residui prima di inserire in lista */
-    node->username[strcspn(node->username, "\r\n")] = '\0';
-    node->next = NULL;
+/* --------------------------------------------------------------------------
+ * Stanze
+ *
+ * Ogni partita vive in una stanza: mappa, lobby, timer, punteggi e
+ * vincitore sono suoi, e piu' stanze giocano insieme nello stesso
+ * processo. Le connessioni nuove entrano nella stanza aperta; quando la
+ * sua partita parte la stanza non accetta piu' nessuno e la connessione
+ * successiva ne apre un'altra, con una mappa nuova. Una stanza si libera
+ * quando sono state liberate tutte le sue connessioni (vedi reapClosed).
+ * Al piu' gConfig.maxRooms stanze esistono insieme: oltre, MSG_REFUSED.
+ *
+ * connLock -> protegge members; si prende prima del lock di una connessione
+ * lock     -> lobby e timeUp, e serializza chi cambia users; foglia
+ * specLock -> spettatori, le loro code e i campi spec*; dopo il lock di una
+ *             connessione
+ *
+ * La mappa e il diario degli oggetti non hanno lock: i muri non cambiano,
+ * un oggetto si raccoglie con una compare-and-swap sulla sua cella e il
+ * diario si riempie e si legge senza bloccare (applyMove, journalEnd).
+ * -------------------------------------------------------------------------- */
+struct room {
+    int id;
+    uint64_t seed;              /* seme della mappa                          */
+    struct grid *map;
+    struct distField *dist;     /* distanze dalle uscite (sola lettura)      */
+    struct cellJournal items;   /* oggetti raccolti, senza lock              */
+    pthread_mutex_t lock;
+    int nClients;               /* connessioni aperte nella stanza           */
+    int nReady;                 /* autenticati, in lobby o in partita        */
+    int started;                /* la partita e' partita: stanza chiusa      */
+    int timeUp;                 /* il timer della partita e' scaduto         */
+    struct userSnapshot *users; /* ultima versione (atomico), NULL = nessuno */
+    char winner[256];           /* scritto solo da announceWinner            */
+    struct wheelTimer matchTimer; /* fine partita                            */
+    pthread_mutex_t connLock;
+    struct data *members;       /* connessioni non ancora liberate           */
+    int nMembers;               /* members + spettatori, sotto roomsMutex    */
+    pthread_mutex_t specLock;
+    struct data *spectators;
+    int specEnded;              /* vincitore annunciato: niente nuovi spettatori */
+    struct wheelTimer watchTimer; /* giro degli spettatori (watchExpired)    */
+    /* usati solo da watchExpired */
+    struct sharedFrame *world;  /* ultimo MSG_WORLD costruito                */
+    size_t worldItems;          /* oggetti del diario gia' dentro world      */
+    struct sharedFrame *lastWatch; /* ultimo MSG_WATCH                       */
+    size_t watchItems;          /* oggetti del diario gia' mandati           */
+    struct room *next;          /* roomList                                  */
+};
 
-    pthread_mutex_lock(&listMutex);
-    if (userList.tail == NULL) {
-        userList.head = node;
-        userList.tail = node;
-    } else {
-        userList.tail->next = node;
-        userList.tail = node;
-    }
-    userList.nUsers++;
-    pthread_mutex_unlock(&listMutex);
+struct room *roomList = NULL;
+struct room *openRoom = NULL;   /* dove entrano le nuove connessioni         */
+int nRooms = 0;
+int lastRoomId = 0;
+int gProcIndex = 0;             /* indice di questo processo con -P (0..procs-1) */
+
+struct userSnapshot *retiredUsers = NULL; /* sostituite, da liberare (reapMutex) */
+
+/* old non e' piu' pubblicata: la libera reapClosed. Fuori da r->lock (ordine dei lock) */
+static void retireUserSnapshot(struct userSnapshot *old) {
+    if (!old) return;
+    pthread_mutex_lock(&reapMutex);
+    old->retireNext = retiredUsers;
+    retiredUsers = old;
+    pthread_mutex_unlock(&reapMutex);
 }
 
-void removeUser(char * username) {
-    pthread_mutex_lock(&listMutex);
-    struct userNode *prev = NULL;
-    struct userNode *curr = userList.head;
-
-    while (curr) {
-        if (strcmp(curr->username, username) == 0) {
-            if (prev)
-                prev->next = curr->next;
-            else
-                userList.head = curr->next;
+/* nuova versione di r->users: n utenti, entries (gia' nel formato del frame) da copiare */
+static struct userSnapshot *newUserSnapshot(struct userSnapshot *old, uint32_t n, size_t entries) {
+    struct userSnapshot *snap = malloc(sizeof(struct userSnapshot) + FRAME_HEADER + 4 + entries);
+    if (!snap) return NULL;     /* la versione vecchia resta quella pubblicata */
+    snap->version = old ? old->version + 1 : 1;
+    snap->nUsers  = n;
+    snap->len     = FRAME_HEADER + 4 + entries;
+    snap->frame[0] = MSG_USERS;
+    put32(snap->frame + 1, 4 + entries);
+    put32(snap->frame + FRAME_HEADER, n);
+    return snap;
+}
 
-            if (curr == userList.tail)
-                userList.tail = prev;
+void insertUser(struct room *r, char * username) {
+    /* sanitizza eventuali \r\n residui prima di inserire in lista */
+    size_t len = strcspn(username, "\r\n");
+    if (len > 255) len = 255;
+
+    pthread_mutex_lock(&r->lock);
+    struct userSnapshot *old = r->users;
+    size_t entries = old ? old->len - FRAME_HEADER - 4 : 0;
+    struct userSnapshot *snap = newUserSnapshot(old, old ? old->nUsers + 1 : 1, entries + 4 + len);
+    if (snap) {
+        char *p = snap->frame + FRAME_HEADER + 4;
+        if (entries) memcpy(p, old->frame + FRAME_HEADER + 4, entries);
+        put32(p + entries, len);
+        memcpy(p + entries + 4, username, len);
+        __atomic_store_n(&r->users, snap, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (snap) retireUserSnapshot(old);
+}
 
-            free(curr);
-            userList.nUsers--;
-            pthread_mutex_unlock(&listMutex);
-            return;
+void removeUser(struct room *r, char * username) {
+    size_t nameLen = strlen(username);
+    pthread_mutex_lock(&r->lock);
+    struct userSnapshot *old = r->users;
+    if (!old) {
+        pthread_mutex_unlock(&r->lock);
+        return;
+    }
+    struct userSnapshot *retired = NULL;
+    const char *base = old->frame + FRAME_HEADER + 4, *end = old->frame + old->len;
+    for (const char *p = base; p < end; ) {
+        uint32_t len = get32(p);
+        if (len == nameLen && memcmp(p + 4, username, len) == 0) {
+            /* la nuova versione e' la vecchia senza questa voce */
+            size_t before = p - base, after = end - (p + 4 + len);
+            struct userSnapshot *snap = newUserSnapshot(old, old->nUsers - 1, before + after);
+            if (snap) {
+                memcpy(snap->frame + FRAME_HEADER + 4, base, before);
+                memcpy(snap->frame + FRAME_HEADER + 4 + before, p + 4 + len, after);
+                __atomic_store_n(&r->users, snap, __ATOMIC_RELEASE);
+                retired = old;
+            }
+            break;
         }
-        prev = curr;
-        curr = curr->next;
+        p += 4 + len;
     }
-    pthread_mutex_unlock(&listMutex);
+    pthread_mutex_unlock(&r->lock);
+    retireUserSnapshot(retired);
 }
 
-void sendUserList(struct data * d) {
-    pthread_mutex_lock(&listMutex);
-    send(d->user, &userList.nUsers, sizeof(userList.nUsers), 0);
-
-    struct userNode *current = userList.head;
-    while (current) {
-        /* invia la lunghezza dello username seguita dallo username */
-        int len = strlen(current->username);
-        send(d->user, &len, sizeof(len), 0);
-        send(d->user, current->username, len, 0);
-        current = current->next;
-    }
-    pthread_mutex_unlock(&listMutex);
+/* "list": la versione pubblicata va nel buffer d'uscita cosi' com'e', senza lock */
+unsigned sendUserList(struct data * d) {
+    static const char empty[FRAME_HEADER + 4] = { MSG_USERS, 0, 0, 0, 4 };
+    struct userSnapshot *snap = __atomic_load_n(&d->room->users, __ATOMIC_ACQUIRE);
+    const char *frame = snap ? snap->frame : empty;
+    size_t len = snap ? snap->len : sizeof(empty);
+    if (d->state != ST_CLOSED && !d->disconnected &&
+        netBufAppend(&d->out, frame, len) == 0 && netBufFlush(d->user, &d->out) == 0)
+        rearm(d);
+    return snap ? snap->version : 0;
 }
 
 /* --------------------------------------------------------------------------
  * log_event
  *
  * Scrive una riga su gLogFd nel formato [YYYY-MM-DD HH:MM:SS] <msg>.
- * Il logMutex garantisce che i messaggi di thread diversi non si
- * mescolino tra loro.
+ * Con lo scrittore avviato (logStart) non fa syscall ne' prende lock:
+ * copia il messaggio in un posto della coda, con l'ora dell'orologio
+ * grossolano, e torna. A coda piena la riga si perde e si conta; lo
+ * scrittore lo segnala nel log. Prima dell'avvio (e nel padre con -P)
+ * scrive direttamente, sotto logMutex.
  * -------------------------------------------------------------------------- */
-    void log_event(const char *msg) {
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char ts[32];
-    strftime(ts, sizeof(ts), "[%Y-%m-%d %H:%M:%S] ", t);
-    pthread_mutex_lock(&logMutex);
-    write(gLogFd, ts, strlen(ts));
-    write(gLogFd, msg, strlen(msg));
-    write(gLogFd, "\n", 1);
-    pthread_mutex_unlock(&logMutex);
+void log_event(const char *msg) {
+    size_t len = strlen(msg);
+    if (!__atomic_load_n(&logAsync, __ATOMIC_ACQUIRE)) {
+        time_t now = time(NULL);
+        struct tm t;
+        char ts[32];
+        strftime(ts, sizeof(ts), "[%Y-%m-%d %H:%M:%S] ", localtime_r(&now, &t));
+        pthread_mutex_lock(&logMutex);
+        write(gLogFd, ts, strlen(ts));
+        write(gLogFd, msg, len);
+        write(gLogFd, "\n", 1);
+        pthread_mutex_unlock(&logMutex);
+        return;
+    }
+
+    unsigned long pos = __atomic_load_n(&logTail, __ATOMIC_RELAXED);
+    struct logSlot *slot;
+    for (;;) {
+        slot = &logRing[pos & (LOG_RING - 1)];
+        long dif = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&logTail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            /* lo scrittore e' indietro di un giro intero */
+            __atomic_fetch_add(&logDrops, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&logTail, __ATOMIC_RELAXED);
+        }
+    }
+    if (len > LOG_LINE_MAX) len = LOG_LINE_MAX;
+    slot->when = __atomic_load_n(&logNow, __ATOMIC_RELAXED);
+    slot->len  = len;
+    memcpy(slot->msg, msg, len);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
 }
 
 /* --------------------------------------------------------------------------
@@ -203,17 +451,103 @@ static void log_error(const char *context) {
     log_event(msg);
 }
 
+/* aggiunge a buf "[data ora] msg\n"; il timestamp si rifa' solo quando cambia il secondo */
+static size_t logFormat(char *buf, time_t when, const char *msg, size_t len) {
+    static time_t last = -1;
+    static char ts[32];
+    static size_t tsLen;
+    if (when != last) {
+        struct tm t;
+        tsLen = strftime(ts, sizeof(ts), "[%Y-%m-%d %H:%M:%S] ", localtime_r(&when, &t));
+        last = when;
+    }
+    memcpy(buf, ts, tsLen);
+    memcpy(buf + tsLen, msg, len);
+    buf[tsLen + len] = '\n';
+    return tsLen + len + 1;
+}
+
+/* --------------------------------------------------------------------------
+ * logWriter
+ *
+ * Thread scrittore: ogni LOG_FLUSH_MS aggiorna l'orologio grossolano,
+ * svuota la coda formattando le righe in un buffer e le scrive con una
+ * write() per buffer pieno invece di tre per riga. Quando gli si chiede
+ * di fermarsi svuota la coda un'ultima volta.
+ * -------------------------------------------------------------------------- */
+static void *logWriter(void *arg) {
+    (void)arg;
+    static char batch[64 * 1024];
+    for (;;) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        __atomic_store_n(&logNow, ts.tv_sec, __ATOMIC_RELAXED);
+        int stop = __atomic_load_n(&logStopping, __ATOMIC_ACQUIRE);
+
+        size_t used = 0;
+        unsigned long drops = __atomic_exchange_n(&logDrops, 0, __ATOMIC_RELAXED);
+        if (drops > 0) {
+            char msg[96];
+            int n = snprintf(msg, sizeof(msg), "LOG: %lu righe perse, coda del log piena", drops);
+            used += logFormat(batch + used, ts.tv_sec, msg, n);
+        }
+        for (;;) {
+            struct logSlot *slot = &logRing[logHead & (LOG_RING - 1)];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logHead + 1) break;
+            if (used + 32 + slot->len + 1 > sizeof(batch)) {
+                write(gLogFd, batch, used);
+                used = 0;
+            }
+            used += logFormat(batch + used, slot->when, slot->msg, slot->len);
+            /* libero per il produttore del giro successivo */
+            __atomic_store_n(&slot->seq, logHead + LOG_RING, __ATOMIC_RELEASE);
+            logHead++;
+        }
+        if (used > 0) write(gLogFd, batch, used);
+        if (stop) return NULL;
+
+        struct timespec nap = { 0, LOG_FLUSH_MS * 1000000L };
+        nanosleep(&nap, NULL);
+    }
+}
+
+/* da qui log_event passa dalla coda; va chiamata con i segnali gia' bloccati */
+static void logStart(void) {
+    for (unsigned long i = 0; i < LOG_RING; i++) logRing[i].seq = i;
+    logHead = logTail = 0;
+    logNow = time(NULL);
+    int rc = pthread_create(&logWriterTid, NULL, logWriter, NULL);
+    if (rc != 0) {
+        errno = rc;
+        log_error("pthread_create in logStart");
+        return;
+    }
+    __atomic_store_n(&logAsync, 1, __ATOMIC_RELEASE);
+}
+
+/* ferma lo scrittore dopo l'ultimo svuotamento; registrata con atexit */
+static void logStop(void) {
+    if (!__atomic_load_n(&logAsync, __ATOMIC_ACQUIRE)) return;
+    __atomic_store_n(&logStopping, 1, __ATOMIC_RELEASE);
+    pthread_join(logWriterTid, NULL);
+    __atomic_store_n(&logAsync, 0, __ATOMIC_RELEASE);
+}
+
 /* --------------------------------------------------------------------------
  * printWinnerWithPipe
  *
- * Calcola il vincitore leggendo score.txt con una pipeline shell
- * eseguita in un processo figlio (fork + execlp).
+ * Calcola il vincitore della stanza room leggendo score.txt con una
+ * pipeline shell eseguita in un processo figlio (fork + execlp).
  * Il figlio redireziona stdout sulla pipe e lancia:
- *   sort -k3,3nr -k2,2nr score.txt | head -n1 | awk '{print $1}'
+ *   awk '$4 == room' score.txt | sort -k3,3nr -k2,2nr | head -n1 | awk '{print $1}'
  * Il padre legge il risultato e lo copia in winner.
  * Priorita': prima chi ha trovato l'uscita, poi chi ha piu' oggetti.
  * -------------------------------------------------------------------------- */
-void printWinnerWithPipe(char *winner) {
+void printWinnerWithPipe(int room, char *winner) {
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd),
+             "awk '$4 == %d' score.txt | sort -s -k3,3nr -k2,2nr | head -n1 | awk '{print $1}'",
+             room);
     int fd[2];
     if (pipe(fd) == -1) {
         log_error("pipe in printWinnerWithPipe");
@@ -223,6 +557,8 @@ void printWinnerWithPipe(char *winner) {
     pid_t pid = fork();
     if (pid == -1) {
         log_error("fork in printWinnerWithPipe");
+        close(fd[0]);
+        close(fd[1]);
         return;
     }
 
@@ -232,10 +568,8 @@ void printWinnerWithPipe(char *winner) {
         dup2(fd[1], STDOUT_FILENO);
         close(fd[1]);
 
-        execlp("sh", "sh", "-c",
-               "sort -s -k3,3nr -k2,2nr score.txt | head -n1 | awk '{print $1}'",
-               NULL);
-        exit(1); /* raggiunto solo se execlp fallisce */
+        execlp("sh", "sh", "-c", cmd, NULL);
+        _exit(1); /* raggiunto solo se execlp fallisce; _exit: niente atexit del padre (logStop) */
     } else {
         /* padre: legge il nome del vincitore dal lato lettura della pipe */
         close(fd[1]);
@@ -254,50 +588,26 @@ void printWinnerWithPipe(char *winner) {
     }
 }
 
-int isTimeUp() {
-    pthread_mutex_lock(&timerMutex);
-    int r = timeUp;
-    pthread_mutex_unlock(&timerMutex);
-    return r;
+/* microsecondi trascorsi da t0 (CLOCK_MONOTONIC), per i tempi nel log */
+static long elapsedUs(const struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1000000L + (t1.tv_nsec - t0->tv_nsec) / 1000;
 }
 
-
-/* --------------------------------------------------------------------------
- * asyncSendBlurredMap  [thread]
- *
- * Gira per tutta la durata della partita. Ogni SECONDS_TO_BLUR secondi
- * invia al client la mappa con la nebbia aggiornata attorno alla posizione
- * corrente del giocatore. Si ferma se il socket non e' piu' valido o se il tempo e' scaduto.
- * -------------------------------------------------------------------------- */
-void *asyncSendBlurredMap(void *arg) {
-    struct data *d = (struct data *)arg;
-
-    /* aspetta il segnale di avvio partita dalla lobby */
-    pthread_mutex_lock(&lobbyMutex);
-    while (!gameStarted)
-        pthread_cond_wait(&lobbyCond, &lobbyMutex);
-    pthread_mutex_unlock(&lobbyMutex);
-
-    while (!isTimeUp() && !d->gameOver && !d->exitFlag) {
-        sleep(SECONDS_TO_BLUR);
-        if (d->user <= 0) break;
-        if(isTimeUp() || d->exitFlag || d->gameOver) break;
-        pthread_mutex_lock(&(d->socketWriteMutex));
-        sendBlurredMap(d->user, d->map, d->width, d->height, d->x, d->y, d->visited);
-        pthread_mutex_unlock(&(d->socketWriteMutex));
-        if(isTimeUp() || d->exitFlag || d->gameOver) break;
-        char blurlog[512];
-        snprintf(blurlog, sizeof(blurlog), "[%s@%s] BLUR: mappa sfocata inviata", d->username, d->ip);
-        log_event(blurlog);
-    }
-    return NULL;
+int isTimeUp(struct room *r) {
+    pthread_mutex_lock(&r->lock);
+    int up = r->timeUp;
+    pthread_mutex_unlock(&r->lock);
+    return up;
 }
 
+
 /* --------------------------------------------------------------------------
  * writeScore
  *
  * Aggiunge una riga a score.txt nel formato:
- *   <username> <oggetti_raccolti> <exit_flag>
+ *   <username> <oggetti_raccolti> <exit_flag> <stanza>
  *
  * Gli accessi sono serializzati con scoreMutex + scoreChanging per evitare
  * che due thread scrivano contemporaneamente e corrompano il file.
@@ -312,51 +622,41 @@ void writeScore(char *username, struct data *d) {
     int scoreFile = open("score.txt", O_WRONLY | O_CREAT | O_APPEND, 0644);
     if (scoreFile >= 0) {
         char buffer[512];
-        int len = snprintf(buffer, sizeof(buffer), "%s %d %d\n",
-                           username, d->collectedItems, d->exitFlag);
+        int len = snprintf(buffer, sizeof(buffer), "%s %d %d %d\n",
+                           username, d->collectedItems, d->exitFlag, d->room->id);
         write(scoreFile, buffer, len);
         close(scoreFile);
-        scoreChanging = 0;
-        pthread_cond_signal(&scoreCond);
-        pthread_mutex_unlock(&scoreMutex);
-        char logmsg[512];
-        snprintf(logmsg, sizeof(logmsg), "[%s@%s] SCORE: oggetti=%d exit=%d",
-                 username, d->ip, d->collectedItems, d->exitFlag);
-        log_event(logmsg);
     } else {
         log_error("open score.txt in writeScore");
     }
+    /* anche se open fallisce: chi aspetta scoreCond non deve restare bloccato */
+    scoreChanging = 0;
+    pthread_cond_signal(&scoreCond);
+    pthread_mutex_unlock(&scoreMutex);
+    if (scoreFile < 0) return;
+
+    char logmsg[512];
+    snprintf(logmsg, sizeof(logmsg), "[%s@%s] SCORE: oggetti=%d exit=%d",
+             username, d->ip, d->collectedItems, d->exitFlag);
+    log_event(logmsg);
+}
 
+/* copia un payload testuale in out (troncato a cap-1) togliendo \r\n */
+static void copyText(char *out, size_t cap, const char *payload, uint32_t len) {
+    size_t n = len < cap - 1 ? len : cap - 1;
+    memcpy(out, payload, n);
+    out[n] = '\0';
+    out[strcspn(out, "\r\n")] = 0;
 }
 
 /* --------------------------------------------------------------------------
- * timer  [eseguita come thread]
+ * registration
  *
- * Aspetta TIMER secondi poi imposta timeUp=1. Viene lanciata dall'ultimo
- * giocatore che entra in lobby, in modo che il conto alla rovescia parta
- * solo quando tutti sono connessi.
+ * Lo username e' gia' in d->username (payload di MSG_REGISTER), la password
+ * e' il payload di MSG_PASSWORD: aggiunge l'utente a users.txt.
+ * Restituisce 0 se ok, -1 se l'utente esiste gia', -2 in caso di errore I/O.
  * -------------------------------------------------------------------------- */
-void timer() {
-    log_event("TIMER: countdown avviato");
-    sleep(TIMER);
-    pthread_mutex_lock(&timerMutex);
-    timeUp = 1;
-    pthread_mutex_unlock(&timerMutex);
-    log_event("TIMER: tempo scaduto, fine partita");
-}
-
-int registration(struct data *d) {
-    char password[256];
-    int nusr = recv(d->user, d->username, sizeof(d->username) - 1, 0);
-    if (nusr <= 0) return -2;
-    d->username[nusr] = '\0';
-    d->username[strcspn(d->username, "\r\n")] = 0;
-
-    int npass = recv(d->user, password, sizeof(password) - 1, 0);
-    if (npass <= 0) return -2;
-    password[npass] = '\0';
-    password[strcspn(password, "\r\n")] = 0;
-
+int registration(struct data *d, const char *password) {
     int fdUsers = open("users.txt", O_RDWR | O_CREAT, 0644);
     if (fdUsers < 0) {
         log_error("open users.txt in registration");
@@ -395,21 +695,11 @@ int registration(struct data *d) {
 /* --------------------------------------------------------------------------
  * authenticate
  *
- * Riceve username e password dal client, li cerca nel file users.txt nel
- * formato username;password e restituisce 0 se le credenziali sono corrette,
- * -1 se non trovate, -2 in caso di errore I/O.
+ * Cerca d->username (payload di MSG_LOGIN) nel file users.txt nel
+ * formato username;password e restituisce 0 se l'utente esiste,
+ * -1 se non trovato, -2 in caso di errore I/O.
  * -------------------------------------------------------------------------- */
 int authenticate(struct data *d) {
-    int readedbyte = recv(d->user, d->username, sizeof(d->username) - 1, 0);
-    if (readedbyte <= 0) {
-        char logmsg[512];
-        snprintf(logmsg, sizeof(logmsg), "[%s] AUTH: ricezione username fallita, client disconnesso", d->ip);
-        log_event(logmsg);
-        return -2;
-    }
-    d->username[readedbyte] = '\0';
-    d->username[strcspn(d->username, "\r\n")] = 0;
-
     int fd = open("users.txt", O_RDONLY);
     if (fd < 0) {
         log_error("open users.txt in authenticate");
@@ -441,478 +731,1908 @@ int authenticate(struct data *d) {
 }
 
 /* --------------------------------------------------------------------------
- * gaming
+ * Reattore
  *
- * Ciclo di gioco per un client. Assegna una posizione di spawn casuale su
- * una cella PATH, poi legge i comandi (W/A/S/D/exit) in un loop:
- * - se il giocatore tocca il bordo della mappa, ha trovato l'uscita
- * - se cammina su un ITEM, lo raccoglie e incrementa il contatore
- * - se il muro blocca il movimento, la posizione non cambia
- * Il loop si interrompe per timeout, uscita volontaria o disconnessione.
+ * Tutti i socket (ascolto e client) stanno in un'unica istanza epoll,
+ * registrati con EPOLLONESHOT: un evento arriva a un solo worker, che lo
+ * gestisce per intero e poi riarma il descrittore. I worker sono pochi e
+ * fissi (uno per core), quindi il numero di connessioni dipende solo dalla
+ * memoria e non dai thread.
+ *
+ * I comandi di gioco non si eseguono nel worker epoll: decodificati,
+ * diventano task di gPool (pool.h, work stealing, un thread per core)
+ * accodati sulla strand del giocatore, cosi' quelli di uno stesso
+ * giocatore restano in ordine mentre giocatori diversi procedono in
+ * parallelo. Anche la disconnessione di chi e' in partita passa dalla
+ * strand, dopo gli ultimi comandi ricevuti.
+ *
+ * Anche il tempo passa dal reattore: un timerfd periodico sveglia un
+ * worker, che fa avanzare la timer wheel (wheel.h) ed esegue i timer
+ * scaduti: nebbia di ogni giocatore, fine partita, inattivita'.
+ *
+ * Ordine dei lock: room.connLock -> data.lock -> room.specLock ->
+ * (room.lock, scoreMutex, reapMutex, logMutex, lock della
+ * ruota); data.lock -> roomsMutex -> room.lock.
+ * Chi tiene il lock di una connessione non prende mai connLock ne' il lock
+ * di un'altra connessione: le operazioni su tutti i giocatori della
+ * stanza (avvio partita, vincitore) si fanno dopo averlo rilasciato,
+ * segnalate dai valori POST_*.
  * -------------------------------------------------------------------------- */
-void gaming(struct data *d) {
-    d->collectedItems = 0;
-    d->exitFlag = 0;
-
-    do {
-        d->x = rand() % d->height;
-        d->y = rand() % d->width;
-    } while (d->map[d->x][d->y] != PATH);
+#define POST_START  1   /* tutti pronti: avviare la partita           */
+#define POST_WINNER 2   /* tutti hanno finito: calcolare il vincitore */
 
-    d->visited[d->x][d->y] = 1;
-    adjVisit(d->width, d->height, d->x, d->y, d->visited);
+/* i client mandano solo frame piccoli (credenziali e comandi) */
+#define MAX_CLIENT_FRAME 4096
+/*
+ * Contropressione: il reattore non legge da un client che ha gia' in
+ * sospeso MAX_CLIENT_INPUT byte ricevuti, MAX_QUEUED_COMMANDS comandi
+ * sulla strand o MAX_CLIENT_OUTPUT byte che non ha ancora letto (vedi
+ * wantInput); i dati restano nel socket e TCP ferma il client. Oltre
+ * il limite di outOverflow la connessione si chiude.
+ */
+#define MAX_CLIENT_INPUT    (4 * MAX_CLIENT_FRAME)
+#define MAX_QUEUED_COMMANDS 64
+#define MAX_CLIENT_OUTPUT   (1u << 20)
+#define WORKER_EVENTS    32
+/* attesa massima in epoll_wait: anche un worker senza eventi ripassa dal punto di quiete */
+#define WORKER_WAIT_MS   1000
+
+int gEpollFd  = -1;
+int gListenFd = -1;             /* socket TCP di ascolto               */
+int gUnixFd   = -1;             /* socket Unix di ascolto (-1 se spento) */
+int gTimerFd  = -1;             /* timerfd che fa avanzare gWheel      */
+struct pool *gPool;             /* esegue i comandi di gioco           */
+struct timerWheel gWheel;
+struct rng serverRng;           /* semi di mappe e spawn, sotto roomsMutex */
+struct data *closedList = NULL; /* chiuse, da liberare (reapMutex)     */
+
+/* in = 0: niente EPOLLIN, ma EPOLLRDHUP per accorgersi lo stesso se il client chiude */
+static void armEvents(struct data *d, int in, int out) {
+    struct epoll_event ev = {0};
+    ev.events = (in ? EPOLLIN : EPOLLRDHUP) | EPOLLONESHOT | (out ? EPOLLOUT : 0);
+    ev.data.ptr = d;
+    epoll_ctl(gEpollFd, EPOLL_CTL_MOD, d->user, &ev);
+}
 
-    char logmsg[512];
-    snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: spawn assegnato in (%d,%d)", d->username, d->ip, d->x, d->y);
-    log_event(logmsg);
+/* il giocatore ha abbastanza lavoro in sospeso: i suoi frame restano in d->in */
+static int commandsFull(const struct data *d) {
+    return d->queued >= MAX_QUEUED_COMMANDS || netBufPending(&d->out) > MAX_CLIENT_OUTPUT;
+}
 
-    pthread_mutex_lock(&(d->socketWriteMutex));
-    sendAdjacentMap(d->user, d->map, d->width, d->height, d->x, d->y);
-    pthread_mutex_unlock(&(d->socketWriteMutex));
+/*
+ * Se leggere altro dal client. In lobby no: i suoi frame si consumano solo
+ * a partita avviata (startGame). Chi smette di leggere l'output si
+ * riprende su EPOLLOUT, chi ha la strand piena dopo il comando che la
+ * libera (runCommand).
+ */
+static int wantInput(const struct data *d) {
+    if (d->state == ST_LOBBY || netBufPending(&d->in) >= MAX_CLIENT_INPUT) return 0;
+    if (netBufPending(&d->out) > MAX_CLIENT_OUTPUT) return 0;
+    return d->state != ST_GAMING || d->queued < MAX_QUEUED_COMMANDS;
+}
 
-    snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: mappa iniziale inviata, attesa comandi", d->username, d->ip);
-    log_event(logmsg);
+/* output che un client fermo puo' accumulare: le risposte gia' in corsa e una mappa intera */
+static int outOverflow(const struct data *d) {
+    return netBufPending(&d->out) > 8 * (size_t)MAX_CLIENT_OUTPUT + (size_t)d->map->width * d->map->height;
+}
 
-    char buffer[256];
-    while (!isTimeUp()) {
-        /* select con timeout 1s: sblocca il loop quando scade il timer,
-           e rileva la disconnect senza restare bloccati su recv forever */
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(d->user, &rfds);
-        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
-        int sel = select(d->user + 1, &rfds, NULL, NULL, &tv);
-
-        if (sel < 0) {
-            snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: errore socket", d->username, d->ip);
-            log_event(logmsg);
-            d->disconnected = 1;
-            removeUser(d->username);
-            break;
-        }
-        if (sel == 0) continue; /* timeout: rivaluta isTimeUp() */
+/* riarma il socket: in lettura se wantInput, in scrittura se c'e' output in coda */
+static void rearm(struct data *d) {
+    if (d->state == ST_CLOSED || d->disconnected) return;
+    int out = netBufPending(&d->out) > 0;
+    if (d->state == ST_SPECTATE) {
+        /* a partita finita serve un giro del worker anche a coda vuota, per chiudere */
+        pthread_mutex_lock(&d->watch->specLock);
+        out |= d->spec.count > 0 || d->specDone;
+        pthread_mutex_unlock(&d->watch->specLock);
+    }
+    armEvents(d, wantInput(d), out);
+}
 
-        int r = recv(d->user, buffer, sizeof(buffer) - 1, 0);
-        if (r <= 0) {
-            snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: client disconnesso durante la partita", d->username, d->ip);
-            log_event(logmsg);
-            d->disconnected = 1;
-            removeUser(d->username);
-            break;
-        }
-        buffer[r] = '\0';
-        buffer[strcspn(buffer, "\r\n")] = 0;
+/* accoda un frame e prova subito a spedirlo; il resto parte su EPOLLOUT */
+static void connFrame(struct data *d, char type, const void *payload, uint32_t len) {
+    if (d->state == ST_CLOSED || d->disconnected) return;
+    if (netBufFrame(&d->out, type, payload, len) < 0) {
+        log_error("netBufFrame");
+        return;
+    }
+    if (netBufFlush(d->user, &d->out) == 0) rearm(d);
+}
 
-        if (!strcmp(buffer, "exit")) {
-            snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: uscita volontaria", d->username, d->ip);
-            log_event(logmsg);
-            removeUser(d->username);
-            break;
-        }
+/* come connFrame per un frame gia' costruito (frameAlloc), che libera */
+static void connFrameBuf(struct data *d, char *frame) {
+    if (!frame) return;
+    if (d->state != ST_CLOSED && !d->disconnected &&
+        netBufAppend(&d->out, frame, FRAME_HEADER + (size_t)get32(frame + 1)) == 0 &&
+        netBufFlush(d->user, &d->out) == 0)
+        rearm(d);
+    free(frame);
+}
 
-        if (!strcmp(buffer, "list")) {
-            snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: invio lista utenti", d->username, d->ip);
-            log_event(logmsg);
-            sendUserList(d);
-            continue;
-        }
+static void connAdjacentMap(struct data *d) {
+    char frame[ADJ_FRAME_MAX];
+    int n = buildAdjacentFrame(frame, d->map, d->x, d->y);
+    if (d->state == ST_CLOSED || d->disconnected) return;
+    if (netBufAppend(&d->out, frame, n) == 0 && netBufFlush(d->user, &d->out) == 0)
+        rearm(d);
+}
 
-        snprintf(logmsg, sizeof(logmsg),
-                 "[%s@%s] MOVE: '%.32s' (pos: %d,%d)", d->username, d->ip, buffer, d->x, d->y);
+/* una connessione lascia la stanza: se chi resta e' tutto in lobby si parte */
+static int leaveRoom(struct room *r) {
+    int post = 0;
+    pthread_mutex_lock(&r->lock);
+    r->nClients--;
+    if (!r->started && r->nReady > 0 && r->nReady == r->nClients) {
+        r->started = 1;
+        char logmsg[128];
+        snprintf(logmsg, sizeof(logmsg), "[stanza %d] LOBBY: tutti i giocatori pronti, partita in avvio", r->id);
         log_event(logmsg);
+        post = POST_START;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return post;
+}
 
-        int nextX = d->x, nextY = d->y, win = 0;
-
-        if      (!strcmp(buffer, "W")) { if (d->x == 0)             win = 1; else nextX--; }
-        else if (!strcmp(buffer, "S")) { if (d->x == d->height - 1) win = 1; else nextX++; }
-        else if (!strcmp(buffer, "A")) { if (d->y == 0)             win = 1; else nextY--; }
-        else if (!strcmp(buffer, "D")) { if (d->y == d->width - 1)  win = 1; else nextY++; }
+/* copia x, y, oggetti ed esito in d->view; con il lock di d */
+static void publishPlayer(struct data *d) {
+    struct playerView *v = &d->view;
+    int phase = d->state == ST_GAMING ? 0 :
+                d->state == ST_ENDGAME || d->state == ST_RESULT ? (d->exitFlag ? 1 : 2) : PLAYER_HIDDEN;
+    unsigned seq = v->seq;
+    __atomic_store_n(&v->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&v->x,     d->x,              __ATOMIC_RELAXED);
+    __atomic_store_n(&v->y,     d->y,              __ATOMIC_RELAXED);
+    __atomic_store_n(&v->items, d->collectedItems, __ATOMIC_RELAXED);
+    __atomic_store_n(&v->phase, phase,             __ATOMIC_RELAXED);
+    __atomic_store_n(&v->seq, seq + 2, __ATOMIC_RELEASE);
+}
 
-        if (win) {
-            d->exitFlag = 1;
-            snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: uscita dalla mappa trovata", d->username, d->ip);
-            log_event(logmsg);
-            pthread_mutex_lock(&(d->socketWriteMutex));
-            send(d->user, "M", 1, 0);
-            pthread_mutex_unlock(&(d->socketWriteMutex));
-            break;
+/* una copia coerente di d->view, senza lock: si ripete finche' nessuno ci ha scritto in mezzo */
+static void readPlayer(struct data *d, struct playerView *out) {
+    const struct playerView *v = &d->view;
+    for (;;) {
+        unsigned seq = __atomic_load_n(&v->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        out->x     = __atomic_load_n(&v->x,     __ATOMIC_RELAXED);
+        out->y     = __atomic_load_n(&v->y,     __ATOMIC_RELAXED);
+        out->items = __atomic_load_n(&v->items, __ATOMIC_RELAXED);
+        out->phase = __atomic_load_n(&v->phase, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&v->seq, __ATOMIC_RELAXED) == seq) {
+            out->seq = seq;
+            return;
         }
+    }
+}
 
-        int moved = 0, gotItem = 0;
-        pthread_mutex_lock(&mutex);
-        if (d->map[nextX][nextY] != WALL) {
-            moved = 1;
-            d->x = nextX;
-            d->y = nextY;
-            d->visited[d->x][d->y] = 1;
-            adjVisit(d->width, d->height, d->x, d->y, d->visited);
-            if (d->map[d->x][d->y] == ITEM) {
-                d->map[d->x][d->y] = PATH;
-                d->collectedItems++;
-                gotItem = 1;
-            }
-        }
-        pthread_mutex_unlock(&mutex);
+/* --------------------------------------------------------------------------
+ * closeConn
+ *
+ * Chiude il socket (con un ultimo tentativo di spedire l'output in coda),
+ * libera cio' che serve solo in partita e passa la struttura al reaper.
+ * Se chi resta nella stanza e' tutto in lobby la partita puo' partire
+ * (POST_START).
+ * -------------------------------------------------------------------------- */
+static int closeConn(struct data *d) {
+    char logmsg[512];
+    snprintf(logmsg, sizeof(logmsg), "[%s@%s] CLEANUP: connessione chiusa (authOk=%d)", d->ip, d->username, d->authOk);
+    log_event(logmsg);
 
-        if (gotItem) {
-            snprintf(logmsg, sizeof(logmsg), "[%s@%s] ITEM: raccolto in (%d,%d), totale=%d",
-                     d->username, d->ip, d->x, d->y, d->collectedItems);
-            log_event(logmsg);
-        }
-        snprintf(logmsg, sizeof(logmsg), moved ?
-                 "[%s@%s] MOVE: nuova pos (%d,%d)" :
-                 "[%s@%s] MOVE: movimento bloccato (muro)",
-                 d->username, d->ip, d->x, d->y);
+    netBufFlush(d->user, &d->out);
+    wheelCancel(&gWheel, &d->fogTimer);
+    wheelCancel(&gWheel, &d->idleTimer);
+    if (d->watch) {
+        pthread_mutex_lock(&d->watch->specLock);
+        *d->specPprev = d->specNext;
+        if (d->specNext) d->specNext->specPprev = d->specPprev;
+        sharedQueueFree(&d->spec);
+        pthread_mutex_unlock(&d->watch->specLock);
+    }
+    epoll_ctl(gEpollFd, EPOLL_CTL_DEL, d->user, NULL);
+    close(d->user);
+    d->state = ST_CLOSED;
+    publishPlayer(d);
+    d->gameOver = 1;
+    netBufFree(&d->in);
+    netBufFree(&d->out);
+    freeBitmap(d->visited);
+    d->visited = NULL;
+    fogFree(&d->fog);
+
+    pthread_mutex_lock(&reapMutex);
+    d->reapNext = closedList;
+    closedList = d;
+    pthread_mutex_unlock(&reapMutex);
+    return d->watch ? 0 : leaveRoom(d->room);   /* lo spettatore l'ha gia' lasciata */
+}
+
+/* --------------------------------------------------------------------------
+ * joinLobby
+ *
+ * Autenticazione riuscita: l'utente entra in lista e nella lobby della
+ * sua stanza. L'ultimo che arriva (nReady == nClients) fa partire la
+ * partita.
+ * -------------------------------------------------------------------------- */
+static int joinLobby(struct data *d) {
+    char logmsg[512];
+    struct room *r = d->room;
+    int post = 0;
+    d->authOk = 1;
+    d->state = ST_LOBBY;
+    insertUser(r, d->username);
+    pthread_mutex_lock(&r->lock);
+    r->nReady++;
+    snprintf(logmsg, sizeof(logmsg),
+             "[%s@%s] LOBBY: stanza %d, in attesa (%d/%d)", d->username, d->ip, r->id, r->nReady, r->nClients);
+    log_event(logmsg);
+    if (r->nReady == r->nClients && !r->started) {
+        r->started = 1;
+        snprintf(logmsg, sizeof(logmsg), "[stanza %d] LOBBY: tutti i giocatori pronti, partita in avvio", r->id);
         log_event(logmsg);
+        post = POST_START;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return post;
+}
 
-        pthread_mutex_lock(&(d->socketWriteMutex));
-        sendAdjacentMap(d->user, d->map, d->width, d->height, d->x, d->y);
-        pthread_mutex_unlock(&(d->socketWriteMutex));
+/* --------------------------------------------------------------------------
+ * spectate
+ *
+ * MSG_SPECTATE al posto del login: la connessione lascia la lobby della
+ * sua stanza (non gioca e non conta per l'avvio) e diventa spettatrice
+ * della stanza id, che resta in vita finche' lo spettatore non viene
+ * liberato. Da qui in poi riceve solo i frame di watchExpired e, a fine
+ * partita, il vincitore. MSG_NO se la stanza non c'e' o ha gia' finito.
+ * -------------------------------------------------------------------------- */
+static int spectate(struct data *d, int id) {
+    char logmsg[512];
+    struct room *w;
+    int ended = 1;
+
+    pthread_mutex_lock(&roomsMutex);
+    for (w = roomList; w && w->id != id; w = w->next)
+        ;
+    if (w) w->nMembers++;
+    pthread_mutex_unlock(&roomsMutex);
+
+    if (w) {
+        pthread_mutex_lock(&w->specLock);
+        ended = w->specEnded;
+        if (!ended) {
+            d->specNext = w->spectators;
+            if (w->spectators) w->spectators->specPprev = &d->specNext;
+            w->spectators = d;
+            d->specPprev = &w->spectators;
+            d->specNeedKey = 1;
+            if (!wheelPending(&w->watchTimer)) wheelAdd(&gWheel, &w->watchTimer, SPECTATE_MS);
+        }
+        pthread_mutex_unlock(&w->specLock);
+    }
+    if (ended) {
+        if (w) {
+            pthread_mutex_lock(&roomsMutex);
+            w->nMembers--;
+            pthread_mutex_unlock(&roomsMutex);
+        }
+        snprintf(logmsg, sizeof(logmsg), "[%s] SPECTATE: stanza %d inesistente o partita finita", d->ip, id);
+        log_event(logmsg);
+        connFrame(d, MSG_NO, NULL, 0);
+        return closeConn(d);
     }
 
-    snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: sessione terminata", d->username, d->ip);
+    d->watch = w;
+    d->state = ST_SPECTATE;
+    snprintf(logmsg, sizeof(logmsg), "[%s] SPECTATE: osserva la stanza %d", d->ip, id);
     log_event(logmsg);
+    connFrame(d, MSG_YES, NULL, 0);
+    return leaveRoom(d->room);
 }
+
 /* --------------------------------------------------------------------------
- * newUser  [thread]
+ * handleAuth
  *
- * Entry point per ogni client. Il flusso e':
- *   1. authenticate()  -> autentica l'utente || register() -> registra nuovo utente
- *   2. lobby           -> aspetta che tutti i giocatori siano pronti
- *   3. gaming()        -> ciclo di gioco
- *   4. writeScore()    -> salva il risultato su score.txt
- *   5. se e' l'ultimo thread a finire, calcola il vincitore
- *   6. invia W o L al client
- *   7. libera la memoria e chiude il socket
+ * Fasi ST_AUTH, ST_PASSWORD e ST_RELOGIN: le stesse risposte e gli stessi
+ * messaggi di log del vecchio ciclo pre-auth di newUser.
  * -------------------------------------------------------------------------- */
-void *newUser(void *arg) {
-    struct data *d = (struct data *)arg;
+static int handleAuth(struct data *d, char type, const char *payload, uint32_t len) {
     char logmsg[512];
-    int authOk = 0; /* flag: 1 se l'autenticazione e' andata a buon fine */
-    int error  = 0; /* flag: 1 se si e' verificato un errore in fase di auth */
-    /* ----- AUTH ----- */
-    char type;
-    int n;
 
-/* loop pre-auth: il client può interrogare quanti giocatori sono connessi */
-    do {
-        n = recv(d->user, &type, 1, 0);
-        if (n <= 0) {
-            snprintf(logmsg, sizeof(logmsg),
-                    "[%s] AUTH: nessun dato ricevuto, client disconnesso", d->ip);
-            log_event(logmsg);
-            error = 1;
-            break;
-        }
-        if (type == 'C') {
-            pthread_mutex_lock(&lobbyMutex);
-            int count = nClients;
-            pthread_mutex_unlock(&lobbyMutex);
-            send(d->user, &count, sizeof(count), 0);
-            snprintf(logmsg, sizeof(logmsg),
-                    "[%s] INFO: richiesta nClients -> %d", d->ip, count);
-            log_event(logmsg);
+    if (d->state == ST_AUTH && type == MSG_ASK_COUNT) {
+        pthread_mutex_lock(&d->room->lock);
+        char count[4];
+        put32(count, d->room->nClients);
+        pthread_mutex_unlock(&d->room->lock);
+        connFrame(d, MSG_COUNT, count, sizeof(count));
+        snprintf(logmsg, sizeof(logmsg),
+                "[%s] INFO: richiesta nClients -> %u", d->ip, get32(count));
+        log_event(logmsg);
+        return 0;
+    }
+
+    if ((d->state == ST_AUTH || d->state == ST_RELOGIN) && type == MSG_CLIENT_FOG) {
+        d->clientFog = 1;
+        snprintf(logmsg, sizeof(logmsg), "[%s] AUTH: nebbia lato client richiesta", d->ip);
+        log_event(logmsg);
+        return 0;
+    }
+
+    if (d->state == ST_AUTH && type == MSG_REGISTER) {
+        copyText(d->username, sizeof(d->username), payload, len);
+        d->state = ST_PASSWORD;
+        return 0;
+    }
+
+    if (d->state == ST_PASSWORD) {
+        char password[256];
+        int res = -2;
+        if (type == MSG_PASSWORD) {
+            copyText(password, sizeof(password), payload, len);
+            res = registration(d, password);
         }
-    } while (type == 'C');
-    if (!error && type == 'R') {
-        int res = registration(d);
         if (res == -2) {
             snprintf(logmsg, sizeof(logmsg), "[%s@%s] AUTH: registrazione fallita (errore I/O)", d->username, d->ip);
-            log_event(logmsg);
-            send(d->user, "N", 1, 0);
-            error = 1;
         } else if (res == -1) {
             snprintf(logmsg, sizeof(logmsg), "[%s@%s] AUTH: utente gia' esistente", d->username, d->ip);
-            log_event(logmsg);
-            send(d->user, "N", 1, 0);
-            error = 1;
-        }
-
-        if (!error) {
+        } else {
             snprintf(logmsg, sizeof(logmsg), "[%s@%s] AUTH: registrazione avvenuta con successo", d->username, d->ip);
             log_event(logmsg);
-            send(d->user, "Y", 1, 0);
-
-            res = authenticate(d);
-            if (res == -2) {
-                snprintf(logmsg, sizeof(logmsg), "[%s] AUTH: nessun dato ricevuto dopo registrazione, client disconnesso", d->ip);
-                log_event(logmsg);
-                send(d->user, "N", 1, 0);
-                error = 1;
-            } else if (res == -1) {
-                snprintf(logmsg, sizeof(logmsg), "[%s@%s] AUTH: login fallito dopo registrazione", d->username, d->ip);
-                log_event(logmsg);
-                send(d->user, "N", 1, 0);
-                error = 1;
-            }
+            connFrame(d, MSG_YES, NULL, 0);
+            d->state = ST_RELOGIN;
+            return 0;
         }
+        log_event(logmsg);
+        connFrame(d, MSG_NO, NULL, 0);
+        return closeConn(d);
+    }
 
-        if (!error) {
-            snprintf(logmsg, sizeof(logmsg), "[%s@%s] AUTH: login avvenuto con successo dopo registrazione", d->username, d->ip);
-            log_event(logmsg);
-            send(d->user, "Y", 1, 0);
-            authOk = 1;
-        }
+    if (d->state == ST_AUTH && type == MSG_SPECTATE) {
+        /* senza numero (o con 0) la stanza in cui la connessione e' entrata */
+        int id = len >= 4 ? (int)get32(payload) : 0;
+        return spectate(d, id > 0 ? id : d->room->id);
+    }
 
-    } else if (!error && type == 'L') {
+    if (type == MSG_LOGIN) {
+        int afterReg = d->state == ST_RELOGIN;
+        copyText(d->username, sizeof(d->username), payload, len);
         int res = authenticate(d);
-        if (res == -2) {
-            snprintf(logmsg, sizeof(logmsg), "[%s] AUTH: nessun dato ricevuto durante login, client disconnesso", d->ip);
-            log_event(logmsg);
-            send(d->user, "N", 1, 0);
-            error = 1;
-        } else if (res == -1) {
-            snprintf(logmsg, sizeof(logmsg), "[%s@%s] AUTH: utente non trovato durante login", d->username, d->ip);
-            log_event(logmsg);
-            send(d->user, "N", 1, 0);
-            error = 1;
-        }
-
-        if (!error) {
-            snprintf(logmsg, sizeof(logmsg), "[%s@%s] AUTH: login avvenuto con successo", d->username, d->ip);
+        if (res == 0) {
+            snprintf(logmsg, sizeof(logmsg),
+                     afterReg ? "[%s@%s] AUTH: login avvenuto con successo dopo registrazione"
+                              : "[%s@%s] AUTH: login avvenuto con successo", d->username, d->ip);
             log_event(logmsg);
-            send(d->user, "Y", 1, 0);
-            authOk = 1;
+            connFrame(d, MSG_YES, NULL, 0);
+            return joinLobby(d);
         }
-
-    } else if (!error) {
-        snprintf(logmsg, sizeof(logmsg), "[%s] AUTH: tipo non valido '%c'", d->ip, type);
+        if (res == -2)
+            snprintf(logmsg, sizeof(logmsg), "[%s@%s] AUTH: errore I/O durante il login", d->username, d->ip);
+        else
+            snprintf(logmsg, sizeof(logmsg),
+                     afterReg ? "[%s@%s] AUTH: login fallito dopo registrazione"
+                              : "[%s@%s] AUTH: utente non trovato durante login", d->username, d->ip);
         log_event(logmsg);
-        send(d->user, "N", 1, 0);
-        error = 1;
+        connFrame(d, MSG_NO, NULL, 0);
+        return closeConn(d);
     }
 
-    /* ----- LOBBY + GAME + ENDGAME: solo se auth ok ----- */
-    if (!error) {
-        insertUser(d->username);
-        pthread_mutex_lock(&lobbyMutex);
-        nReady++;
-        snprintf(logmsg, sizeof(logmsg),
-                 "[%s@%s] LOBBY: in attesa (%d/%d)", d->username, d->ip, nReady, nClients);
-        log_event(logmsg);
-        if (nReady == nClients) {
-            gameStarted = 1;
-            log_event("LOBBY: tutti i giocatori pronti, partita in avvio");
-            pthread_create(&timerTid, NULL, (void *)timer, NULL);
-            pthread_cond_broadcast(&lobbyCond);
-        } else {
-            while (!gameStarted)
-                pthread_cond_wait(&lobbyCond, &lobbyMutex);
-        }
-        pthread_mutex_unlock(&lobbyMutex);
-
-        snprintf(logmsg, sizeof(logmsg), "[%s@%s] LOBBY: partita avviata, inizio gioco", d->username, d->ip);
-        log_event(logmsg);
-
-        pthread_t blurTid;
-        pthread_create(&blurTid, NULL, asyncSendBlurredMap, d);
-        pthread_detach(blurTid);
-
-        gaming(d);
-        writeScore(d->username, d);
-
-  /* ----- ENDGAME ----- */
-  d->gameOver = 1;
-  if (!d->disconnected)
-      send(d->user, "E", 1, 0);
-
-  pthread_mutex_lock(&lobbyMutex);
-  nReady--;
-  snprintf(logmsg, sizeof(logmsg),
-           "[%s@%s] ENDGAME: partita terminata (%d ancora in gioco)", d->username, d->ip, nReady);
-  log_event(logmsg);
-  if (nReady == 0) {
-      log_event("ENDGAME: tutti i client hanno finito, calcolo vincitore in corso");
-      printWinnerWithPipe(gWinner);
-      snprintf(logmsg, sizeof(logmsg), "ENDGAME: vincitore -> '%s'", gWinner);
-      log_event(logmsg);
-      pthread_mutex_lock(&gWinnerMutex);
-      gWinnerCalculated = 1;
-      pthread_cond_broadcast(&gWinnerCond);
-      pthread_mutex_unlock(&gWinnerMutex);
-  }
-  pthread_mutex_unlock(&lobbyMutex);
-
-  /* i client morti non aspettano: uscirebbero subito senza poter ricevere nulla */
-  if (!d->disconnected) {
-      pthread_mutex_lock(&gWinnerMutex);
-      while (!gWinnerCalculated)
-          pthread_cond_wait(&gWinnerCond, &gWinnerMutex);
-      pthread_mutex_unlock(&gWinnerMutex);
-
-      char closeM;
-      if (strcmp(gWinner, d->username) == 0) {
-          snprintf(logmsg, sizeof(logmsg), "[%s@%s] RESULT: vincitore", d->username, d->ip);
-          log_event(logmsg);
-          send(d->user, "W", 1, 0);
-      } else {
-          snprintf(logmsg, sizeof(logmsg), "[%s@%s] RESULT: sconfitto", d->username, d->ip);
-          log_event(logmsg);
-          send(d->user, "L", 1, 0);
-      }
-      recv(d->user, &closeM, 1, 0);
-    }
-    }
-
-    /* ----- CLEANUP ----- */
-    snprintf(logmsg, sizeof(logmsg), "[%s@%s] CLEANUP: connessione chiusa (authOk=%d)", d->ip, d->username, authOk);
+    snprintf(logmsg, sizeof(logmsg), "[%s] AUTH: tipo non valido '%c'", d->ip, type);
     log_event(logmsg);
-    close(d->user);
-
-    pthread_mutex_lock(&lobbyMutex);
-    nClients--;
-    if (nClients == 0) {
-        pthread_mutex_lock(&endMutex);
-        gameEnd = 1;
-        pthread_mutex_unlock(&endMutex);
-    }
-    pthread_mutex_unlock(&lobbyMutex);
-
-    for (int i = 0; i < d->height; i++)
-        free(d->visited[i]);
-    free(d->visited);
-    //pthread_mutex_destroy(&(d->socketWriteMutex));
-    //free(d);
-    return NULL;
+    connFrame(d, MSG_NO, NULL, 0);
+    return closeConn(d);
 }
 
 /* --------------------------------------------------------------------------
- * main
+ * enterGame
  *
- * Apre il log, azzera score.txt, crea il socket TCP sulla porta 8080 e
- * genera la mappa. Poi entra nel loop di select() che accetta nuovi client
- * finche' l'ultimo thread attivo non segnala la fine della partita
- * scrivendo la variabile globale
+ * Avvio partita per un client in lobby: spawn casuale su una cella PATH,
+ * prima mappa adiacente e primo timer della nebbia.
  * -------------------------------------------------------------------------- */
-int main() {
-    srand(time(NULL));
-    signal(SIGPIPE, SIG_IGN); /* send() su socket chiuso ritorna -1 invece di killare il processo */
-
-    /* azzera i file di stato all'avvio: ogni sessione parte da zero */
-    close(open("score.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644));
+static void enterGame(struct data *d) {
+    char logmsg[512];
+    snprintf(logmsg, sizeof(logmsg), "[%s@%s] LOBBY: partita avviata, inizio gioco", d->username, d->ip);
+    log_event(logmsg);
 
-    /* apre il log globale: tutti i thread scriveranno qui tramite gLogFd */
-    gLogFd = open("filelog.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (gLogFd < 0) {
-        //log non disponibile
-        const char *err = "FATAL: impossibile aprire filelog.txt\n";
-        write(STDERR_FILENO, err, strlen(err));
-        exit(1);
+    d->state = ST_GAMING;
+    d->collectedItems = 0;
+    d->exitFlag = 0;
+
+    do {
+        d->x = rngBelow(&d->rng, d->map->height);
+        d->y = rngBelow(&d->rng, d->map->width);
+    } while (gridGetRelaxed(d->map, d->x, d->y) != PATH);
+
+    adjVisit(d->visited, d->x, d->y);
+    publishPlayer(d);
+
+    snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: spawn assegnato in (%d,%d)", d->username, d->ip, d->x, d->y);
+    log_event(logmsg);
+
+    connAdjacentMap(d);
+    wheelAdd(&gWheel, &d->fogTimer, gConfig.blurSeconds * 1000ull);
+
+    snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: mappa iniziale inviata, attesa comandi", d->username, d->ip);
+    log_event(logmsg);
+}
+
+/* --------------------------------------------------------------------------
+ * finishPlayer
+ *
+ * Il giocatore esce dalla partita (uscita trovata, exit, tempo scaduto o
+ * disconnessione): scrive il punteggio, manda MSG_END e libera il posto.
+ * Se era l'ultimo ancora in gioco ritorna POST_WINNER.
+ * -------------------------------------------------------------------------- */
+static int finishPlayer(struct data *d) {
+    char logmsg[512];
+    snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: sessione terminata", d->username, d->ip);
+    log_event(logmsg);
+
+    writeScore(d->username, d);
+
+    /* ----- ENDGAME ----- */
+    d->gameOver = 1;
+    d->state = ST_ENDGAME;
+    publishPlayer(d);
+    wheelCancel(&gWheel, &d->fogTimer);
+    connFrame(d, MSG_END, NULL, 0);
+
+    struct room *r = d->room;
+    pthread_mutex_lock(&r->lock);
+    r->nReady--;
+    snprintf(logmsg, sizeof(logmsg),
+             "[%s@%s] ENDGAME: partita terminata (%d ancora in gioco)", d->username, d->ip, r->nReady);
+    log_event(logmsg);
+    int last = r->nReady == 0;
+    pthread_mutex_unlock(&r->lock);
+    return last ? POST_WINNER : 0;
+}
+
+/* uscita dalla mappa: notifica e fine della partita per il giocatore */
+static int exitFound(struct data *d) {
+    char logmsg[512];
+    d->exitFlag = 1;
+    snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: uscita dalla mappa trovata", d->username, d->ip);
+    log_event(logmsg);
+    connFrame(d, MSG_EXIT_FOUND, NULL, 0);
+    return finishPlayer(d);
+}
+
+static int cmdPath(struct data *d, const char *cmd);
+
+/* --------------------------------------------------------------------------
+ * cmdMove
+ *
+ * Una mossa singola (W/A/S/D), risposta con la mappa adiacente:
+ * - se il giocatore tocca il bordo della mappa, ha trovato l'uscita
+ * - se cammina su un ITEM, lo raccoglie e incrementa il contatore
+ * - se il muro blocca il movimento, la posizione non cambia
+ * Un testo non riconosciuto lascia il giocatore dov'e'.
+ * -------------------------------------------------------------------------- */
+static int cmdMove(struct data *d, const char *cmd) {
+    char logmsg[512];
+    if (cmd[0] && cmd[1]) return cmdPath(d, cmd);
+
+    snprintf(logmsg, sizeof(logmsg),
+             "[%s@%s] MOVE: '%.32s' (pos: %d,%d)", d->username, d->ip, cmd, d->x, d->y);
+    log_event(logmsg);
+
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    enum moveResult res = applyMove(d->map, d->visited, &d->fog, &d->room->items, &d->x, &d->y, cmd[0]);
+
+    if (res == MOVE_EXIT) return exitFound(d);
+
+    if (res == MOVE_ITEM) {
+        d->collectedItems++;
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] ITEM: raccolto in (%d,%d), totale=%d",
+                 d->username, d->ip, d->x, d->y, d->collectedItems);
+        log_event(logmsg);
     }
+    publishPlayer(d);
+    if (res != MOVE_BLOCKED)
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] MOVE: nuova pos (%d,%d), uscita a %u passi",
+                 d->username, d->ip, d->x, d->y, distAt(d->dist, d->x, d->y));
+    else
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] MOVE: movimento bloccato (muro)",
+                 d->username, d->ip);
+    log_event(logmsg);
 
-    log_event("SERVER: avvio in corso");
+    connAdjacentMap(d);
 
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        log_error("socket");
-        exit(1);
+    if (gConfig.stress) {
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] STRESS: mossa+adiacenza in %ld us",
+                 d->username, d->ip, elapsedUs(&t0));
+        log_event(logmsg);
     }
+    return 0;
+}
 
-    /* riuso immediato della porta dopo un riavvio (evita "Address already in use") */
-    int opt = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+/* --------------------------------------------------------------------------
+ * cmdPath
+ *
+ * Sequenza di mosse (es. "WWWDDS", al piu' MAX_PATH_MOVES): applicata in
+ * un solo passaggio, senza lock sulla mappa, si ferma al primo muro o
+ * all'uscita. Una sola risposta MSG_PATH con la posizione finale e tutta
+ * l'area rivelata lungo il percorso, invece di una mappa adiacente per
+ * mossa.
+ * -------------------------------------------------------------------------- */
+static int cmdPath(struct data *d, const char *cmd) {
+    char logmsg[512];
+    int n = strlen(cmd);
+    if (n > MAX_PATH_MOVES) n = MAX_PATH_MOVES;
 
-    struct sockaddr_in srv = {0};
-    srv.sin_family      = AF_INET;
-    srv.sin_port        = htons(8080);
-    srv.sin_addr.s_addr = INADDR_ANY;
+    snprintf(logmsg, sizeof(logmsg),
+             "[%s@%s] MOVE: percorso '%.*s' (pos: %d,%d)", d->username, d->ip, n, cmd, d->x, d->y);
+    log_event(logmsg);
 
-    if (bind(sockfd, (struct sockaddr *)&srv, sizeof(srv)) < 0) {
-        log_error("bind");
-        exit(1);
+    struct moveBatch batch;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    enum moveResult res = applyMoves(d->map, d->visited, &d->fog, &d->room->items,
+                                     &d->x, &d->y, cmd, n, &batch);
+
+    if (batch.items > 0) {
+        d->collectedItems += batch.items;
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] ITEM: raccolti %d lungo il percorso, totale=%d",
+                 d->username, d->ip, batch.items, d->collectedItems);
+        log_event(logmsg);
     }
-    listen(sockfd, 100);
+    publishPlayer(d);
+    snprintf(logmsg, sizeof(logmsg), "[%s@%s] MOVE: %d/%d mosse, nuova pos (%d,%d), uscita a %u passi",
+             d->username, d->ip, batch.applied, n, d->x, d->y, distAt(d->dist, d->x, d->y));
+    log_event(logmsg);
 
-    int w, h;
-    char **map = generateMap(&w, &h);
+    uint32_t status = res == MOVE_EXIT ? PATH_EXIT : res == MOVE_DONE ? PATH_DONE : PATH_STOPPED;
+    connFrameBuf(d, buildPathFrame(d->map, d->visited, d->x, d->y, &batch, status));
 
-    log_event("SERVER: in ascolto sulla porta 8080");
+    if (gConfig.stress) {
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] STRESS: percorso di %d mosse in %ld us",
+                 d->username, d->ip, batch.applied, elapsedUs(&t0));
+        log_event(logmsg);
+    }
+    return res == MOVE_EXIT ? exitFound(d) : 0;
+}
 
-    /* ----- LOOP PRINCIPALE: select() su socket e pipe di controllo ----- */
-    while (1) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(sockfd, &rfds);
+static int cmdExit(struct data *d, const char *cmd) {
+    char logmsg[512];
+    if (strcmp(cmd, "exit") != 0) return cmdMove(d, cmd);
+    snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: uscita volontaria", d->username, d->ip);
+    log_event(logmsg);
+    removeUser(d->room, d->username);
+    return finishPlayer(d);
+}
+
+static int cmdList(struct data *d, const char *cmd) {
+    char logmsg[512];
+    if (strcmp(cmd, "list") != 0) return cmdMove(d, cmd);
+    unsigned version = sendUserList(d);
+    snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: lista utenti inviata (versione %u)", d->username, d->ip, version);
+    log_event(logmsg);
+    return 0;
+}
+
+/* tabella di dispatch sul primo byte del comando; NULL = mossa nulla */
+static int (*const commandTable[256])(struct data *, const char *) = {
+    ['W'] = cmdMove, ['A'] = cmdMove, ['S'] = cmdMove, ['D'] = cmdMove,
+    ['e'] = cmdExit, ['l'] = cmdList,
+};
+
+/* --------------------------------------------------------------------------
+ * handleCommand
+ *
+ * Un comando di gioco (mossa, sequenza di mosse, list, exit) o una
+ * richiesta di risincronizzazione della nebbia.
+ * -------------------------------------------------------------------------- */
+static int handleCommand(struct data *d, char type, const char *payload, uint32_t len) {
+    char logmsg[512];
+    char buffer[256];
+
+    if (isTimeUp(d->room)) return finishPlayer(d);
+
+    if (type == MSG_RESYNC) {
+        /* il client ha perso un delta: il prossimo invio sara' completo */
+        d->fog.keyframe = 1;
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] BLUR: richiesta risincronizzazione", d->username, d->ip);
+        log_event(logmsg);
+        return 0;
+    }
+    if (type != MSG_COMMAND) return 0;
+    copyText(buffer, sizeof(buffer), payload, len);
 
-        int maxfd = sockfd;
+    int (*fn)(struct data *, const char *) = commandTable[(unsigned char)buffer[0]];
+    return fn ? fn(d, buffer) : cmdMove(d, buffer);
+}
 
-        pthread_mutex_lock(&endMutex);
-        if (gameEnd) {
-            pthread_mutex_unlock(&endMutex);
+/* il peer ha chiuso (o errore di socket): dipende da dove si trovava */
+static int handleHangup(struct data *d) {
+    char logmsg[512];
+    int post = 0;
+    switch (d->state) {
+        case ST_AUTH:
+        case ST_PASSWORD:
+        case ST_RELOGIN:
+            snprintf(logmsg, sizeof(logmsg),
+                     "[%s] AUTH: nessun dato ricevuto, client disconnesso", d->ip);
+            log_event(logmsg);
+            break;
+        case ST_LOBBY:
+            snprintf(logmsg, sizeof(logmsg), "[%s@%s] LOBBY: client disconnesso in attesa", d->username, d->ip);
+            log_event(logmsg);
+            removeUser(d->room, d->username);
+            pthread_mutex_lock(&d->room->lock);
+            d->room->nReady--;
+            pthread_mutex_unlock(&d->room->lock);
             break;
+        case ST_GAMING:
+            snprintf(logmsg, sizeof(logmsg), "[%s@%s] GAME: client disconnesso durante la partita", d->username, d->ip);
+            log_event(logmsg);
+            d->disconnected = 1;
+            removeUser(d->room, d->username);
+            post = finishPlayer(d);
+            break;
+        case ST_SPECTATE:
+            snprintf(logmsg, sizeof(logmsg), "[%s] SPECTATE: spettatore disconnesso", d->ip);
+            log_event(logmsg);
+            d->disconnected = 1;
+            break;
+        default:
+            /* i client morti non aspettano il risultato */
+            d->disconnected = 1;
+            break;
+    }
+    return post | closeConn(d);
+}
+
+/* comando decodificato in attesa di un worker del pool */
+struct command {
+    struct data *d;
+    char     type;
+    uint32_t len;
+    char     payload[];
+};
+
+static void runCommand(void *arg);
+
+/* accoda il comando sulla strand del giocatore (copiando il payload) */
+static void queueCommand(struct data *d, char type, const char *payload, uint32_t len) {
+    struct command *c = malloc(sizeof(struct command) + len);
+    if (!c) {
+        log_error("malloc in queueCommand");
+        return;
+    }
+    c->d = d;
+    c->type = type;
+    c->len = len;
+    memcpy(c->payload, payload, len);
+    if (poolStrandSubmit(&d->strand, runCommand, c) < 0) {
+        log_error("poolStrandSubmit");
+        free(c);
+        return;
+    }
+    d->queued++;
+}
+
+/* consuma i frame completi gia' ricevuti; in lobby, o in partita con la strand piena, restano in coda */
+static int processInput(struct data *d) {
+    char type;
+    const char *payload;
+    uint32_t len;
+    int post = 0, r = 0;
+
+    while (d->state != ST_CLOSED && d->state != ST_LOBBY &&
+           !(d->state == ST_GAMING && commandsFull(d)) &&
+           (r = netBufNextFrame(&d->in, &type, &payload, &len, MAX_CLIENT_FRAME)) > 0) {
+        switch (d->state) {
+            case ST_GAMING:
+                queueCommand(d, type, payload, len);
+                break;
+            case ST_ENDGAME:
+            case ST_SPECTATE:
+                break;      /* comandi dopo la fine o da uno spettatore: ignorati */
+            case ST_RESULT:
+                post |= closeConn(d);   /* MSG_ACK: il client ha il risultato */
+                break;
+            default:
+                post |= handleAuth(d, type, payload, len);
         }
+    }
+    if (r < 0 && d->state != ST_CLOSED) {
+        char logmsg[512];
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] SERVER: frame troppo grande, connessione chiusa", d->username, d->ip);
+        log_event(logmsg);
+        post |= closeConn(d);
+    }
+    return post;
+}
 
-        pthread_mutex_unlock(&endMutex);
+/* --------------------------------------------------------------------------
+ * announceWinner
+ *
+ * Tutti i giocatori della stanza hanno finito: calcola il vincitore
+ * (printWinnerWithPipe) e manda W o L a chi e' ancora connesso, che poi
+ * risponde con MSG_ACK.
+ * -------------------------------------------------------------------------- */
+static void announceWinner(struct room *r) {
+    char logmsg[512];
+    snprintf(logmsg, sizeof(logmsg), "[stanza %d] ENDGAME: tutti i client hanno finito, calcolo vincitore in corso", r->id);
+    log_event(logmsg);
+    printWinnerWithPipe(r->id, r->winner);
+    snprintf(logmsg, sizeof(logmsg), "[stanza %d] ENDGAME: vincitore -> '%s'", r->id, r->winner);
+    log_event(logmsg);
 
-        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+    pthread_mutex_lock(&r->connLock);
+    for (struct data *d = r->members; d; d = d->roomNext) {
+        pthread_mutex_lock(&d->lock);
+        if (d->state == ST_ENDGAME) {
+            char result;
+            if (strcmp(r->winner, d->username) == 0) {
+                snprintf(logmsg, sizeof(logmsg), "[%s@%s] RESULT: vincitore", d->username, d->ip);
+                result = MSG_WIN;
+            } else {
+                snprintf(logmsg, sizeof(logmsg), "[%s@%s] RESULT: sconfitto", d->username, d->ip);
+                result = MSG_LOSE;
+            }
+            log_event(logmsg);
+            d->state = ST_RESULT;
+            connFrame(d, result, NULL, 0);
+            processInput(d);    /* l'ack potrebbe essere gia' arrivato */
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_unlock(&r->connLock);
+
+    /* spettatori: il vincitore, poi si chiudono appena la coda e' vuota */
+    struct sharedFrame *end = sharedAlloc(MSG_END, strlen(r->winner));
+    if (end) memcpy(end->data + FRAME_HEADER, r->winner, strlen(r->winner));
+    pthread_mutex_lock(&r->specLock);
+    r->specEnded = 1;
+    for (struct data *d = r->spectators; d; d = d->specNext) {
+        if (end) sharedQueueForce(&d->spec, end);   /* il vincitore non si salta */
+        d->specDone = 1;
+        if (d->specReady) sharedQueueFlush(d->user, &d->spec);
+        armEvents(d, 1, 1);
+    }
+    pthread_mutex_unlock(&r->specLock);
+    sharedRelease(end);
+}
 
-        if (select(maxfd + 1, &rfds, NULL, NULL, &tv) < 0) {
-            log_error("select");
-            break;
+/* --------------------------------------------------------------------------
+ * fogExpired  [timer]
+ *
+ * Ogni gConfig.blurSeconds secondi, per ogni giocatore in partita, invia
+ * la nebbia aggiornata: la prima volta (e dopo un MSG_RESYNC) la mappa
+ * intera, poi solo le celle cambiate (MSG_DELTA). Se la nebbia la disegna
+ * il client invia solo gli oggetti raccolti in celle gia' viste
+ * (MSG_ITEMS), senza rendere nulla. Se non e' cambiato nulla non invia
+ * niente. Il timer e' del giocatore, quindi gli invii
+ * sono sfasati secondo l'ingresso in partita invece di partire tutti
+ * insieme.
+ * -------------------------------------------------------------------------- */
+static void fogExpired(void *arg) {
+    struct data *d = arg;
+    pthread_mutex_lock(&d->lock);
+    if (d->state != ST_GAMING) {
+        pthread_mutex_unlock(&d->lock);
+        return;
+    }
+    if (netBufPending(&d->out) > MAX_CLIENT_OUTPUT) {
+        /* il client non legge: niente nuova nebbia, i cambiamenti restano per il prossimo giro */
+        wheelAdd(&gWheel, &d->fogTimer, gConfig.blurSeconds * 1000ull);
+        pthread_mutex_unlock(&d->lock);
+        return;
+    }
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    /* la mappa puo' cambiare intanto: un oggetto raccolto ora arriva col prossimo giro */
+    char *frame = d->clientFog
+        ? buildItemEvents(&d->fog, d->visited, &d->room->items, d->map->width)
+        : fogBuildUpdate(&d->fog, d->map, d->x, d->y, d->visited, &d->room->items);
+    if (frame) {
+        const char *kind = frame[0] == MSG_DELTA ? "delta inviato" :
+                           frame[0] == MSG_ITEMS ? "oggetti raccolti inviati" : "mappa sfocata inviata";
+        uint32_t bytes = get32(frame + 1);
+        connFrameBuf(d, frame);
+        char blurlog[512];
+        if (gConfig.stress)
+            snprintf(blurlog, sizeof(blurlog), "[%s@%s] BLUR: %s (%u byte) in %ld us",
+                     d->username, d->ip, kind, bytes, elapsedUs(&t0));
+        else
+            snprintf(blurlog, sizeof(blurlog), "[%s@%s] BLUR: %s (%u byte)",
+                     d->username, d->ip, kind, bytes);
+        log_event(blurlog);
+    }
+    wheelAdd(&gWheel, &d->fogTimer, gConfig.blurSeconds * 1000ull);
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* --------------------------------------------------------------------------
+ * matchExpired  [timer]
+ *
+ * Scade gConfig.gameSeconds secondi dopo l'avvio della partita della
+ * stanza: imposta timeUp=1 e chiude la partita di chi e' ancora in gioco.
+ * -------------------------------------------------------------------------- */
+static void matchExpired(void *arg) {
+    struct room *r = arg;
+    char logmsg[512];
+    pthread_mutex_lock(&r->lock);
+    r->timeUp = 1;
+    pthread_mutex_unlock(&r->lock);
+    snprintf(logmsg, sizeof(logmsg), "[stanza %d] TIMER: tempo scaduto, fine partita", r->id);
+    log_event(logmsg);
+
+    int post = 0;
+    pthread_mutex_lock(&r->connLock);
+    for (struct data *d = r->members; d; d = d->roomNext) {
+        pthread_mutex_lock(&d->lock);
+        if (d->state == ST_GAMING) post |= finishPlayer(d);
+        pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_unlock(&r->connLock);
+    if (post & POST_WINNER) announceWinner(r);
+}
+
+/* --------------------------------------------------------------------------
+ * watchExpired  [timer]
+ *
+ * Ogni SPECTATE_MS, finche' la stanza ha spettatori, costruisce un solo
+ * MSG_WATCH: oggetti raccolti dall'ultimo giro (formato MSG_ITEMS), poi
+ * u32 n e per ogni giocatore in partita x, y, oggetti (u32), stato (1
+ * byte: 0 in gioco, 1 uscito, 2 fuori) e nome (u32 len + byte). I
+ * giocatori si leggono dal loro seqlock (readPlayer), senza prendere il
+ * lock di nessuna connessione: un giocatore che muove non aspetta il giro
+ * degli spettatori e viceversa. Il frame
+ * va in coda a tutti gli spettatori per riferimento, senza copie, e solo
+ * se e' cambiato qualcosa. Chi ha la coda piena salta il giro: avendo
+ * perso degli oggetti, quando ha di nuovo spazio riceve un MSG_WORLD
+ * completo (ricostruito al piu' una volta per giro e condiviso allo
+ * stesso modo) seguito dall'ultimo MSG_WATCH. Uno spettatore lento non
+ * ferma ne' la stanza ne' gli altri spettatori.
+ * -------------------------------------------------------------------------- */
+static struct sharedFrame *buildWatchFrame(struct room *r, size_t *from) {
+    struct netBuf players = {0};
+    uint32_t n = 0;
+    pthread_mutex_lock(&r->connLock);
+    for (struct data *d = r->members; d; d = d->roomNext) {
+        struct playerView v;
+        readPlayer(d, &v);
+        if (v.phase == PLAYER_HIDDEN) continue;
+        /* il nome non cambia piu' dopo l'autenticazione, prima della partita */
+        uint32_t nameLen = strlen(d->username);
+        char rec[17];
+        put32(rec,     v.x);
+        put32(rec + 4, v.y);
+        put32(rec + 8, v.items);
+        rec[12] = v.phase;
+        put32(rec + 13, nameLen);
+        if (netBufAppend(&players, rec, sizeof(rec)) == 0 &&
+            netBufAppend(&players, d->username, nameLen) == 0)
+            n++;
+    }
+    pthread_mutex_unlock(&r->connLock);
+
+    *from = r->watchItems;
+    size_t end = journalEnd(&r->items, *from);
+    uint32_t nItems = end - *from;
+    struct sharedFrame *f = sharedAlloc(MSG_WATCH, 8 + 4 * nItems + netBufPending(&players));
+    if (f) {
+        char *p = f->data + FRAME_HEADER;
+        put32(p, nItems);
+        p += 4;
+        for (uint32_t i = 0; i < nItems; i++, p += 4) put32(p, r->items.cells[*from + i]);
+        r->watchItems = end;
+        put32(p, n);
+        if (n) memcpy(p + 4, players.data + players.off, netBufPending(&players));
+    }
+    netBufFree(&players);
+    return f;
+}
+
+static void watchExpired(void *arg) {
+    struct room *r = arg;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    size_t from;
+    struct sharedFrame *f = buildWatchFrame(r, &from);
+    if (!f) {
+        log_error("buildWatchFrame");
+        wheelAdd(&gWheel, &r->watchTimer, SPECTATE_MS);
+        return;
+    }
+    /* niente di nuovo: va solo a chi deve ripartire da MSG_WORLD */
+    int changed = !r->lastWatch || r->lastWatch->len != f->len ||
+                  memcmp(r->lastWatch->data, f->data, f->len) != 0;
+    if (changed) {
+        sharedRelease(r->lastWatch);
+        r->lastWatch = f;
+    } else {
+        sharedRelease(f);
+    }
+
+    int sent = 0, skipped = 0;
+    pthread_mutex_lock(&r->specLock);
+    for (struct data *d = r->spectators; d && !r->specEnded; d = d->specNext) {
+        if (d->specNeedKey) {
+            if (SHARED_QUEUE - d->spec.count < 2) {
+                skipped++;
+                continue;
+            }
+            /* la mappa condivisa deve contenere almeno gli oggetti prima di questo giro */
+            if (!r->world || r->worldItems < from) {
+                sharedRelease(r->world);
+                /* prima il diario: quello che contiene e' gia' PATH nella mappa copiata dopo */
+                r->worldItems = journalEnd(&r->items, 0);
+                r->world = buildWorldFrame(r->map);
+                if (!r->world) {
+                    skipped++;
+                    continue;
+                }
+            }
+            sharedQueuePush(&d->spec, r->world);
+            sharedQueuePush(&d->spec, r->lastWatch);
+            d->specNeedKey = 0;
+        } else if (changed && sharedQueuePush(&d->spec, r->lastWatch) < 0) {
+            d->specNeedKey = 1;
+            skipped++;
+            continue;
+        } else if (!changed) {
+            continue;
+        }
+        sent++;
+        if (d->specReady && sharedQueueFlush(d->user, &d->spec) == 0) armEvents(d, 1, 1);
+    }
+    int more = r->spectators && !r->specEnded;
+    pthread_mutex_unlock(&r->specLock);
+
+    if (gConfig.stress && sent + skipped > 0) {
+        char logmsg[256];
+        snprintf(logmsg, sizeof(logmsg), "[stanza %d] SPECTATE: frame da %zu byte a %d spettatori (%d saltati) in %ld us",
+                 r->id, r->lastWatch->len, sent, skipped, elapsedUs(&t0));
+        log_event(logmsg);
+    }
+    if (more) wheelAdd(&gWheel, &r->watchTimer, SPECTATE_MS);
+}
+
+/* tutti in lobby: la stanza si chiude, parte il countdown e ogni client entra in partita */
+static void startGame(struct room *r) {
+    char logmsg[512];
+    pthread_mutex_lock(&roomsMutex);
+    if (openRoom == r) openRoom = NULL;     /* i prossimi in una stanza nuova */
+    pthread_mutex_unlock(&roomsMutex);
+
+    wheelAdd(&gWheel, &r->matchTimer, gConfig.gameSeconds * 1000ull);
+    snprintf(logmsg, sizeof(logmsg), "[stanza %d] TIMER: countdown avviato", r->id);
+    log_event(logmsg);
+
+    int post = 0;
+    pthread_mutex_lock(&r->connLock);
+    for (struct data *d = r->members; d; d = d->roomNext) {
+        pthread_mutex_lock(&d->lock);
+        if (d->state == ST_LOBBY) {
+            enterGame(d);
+            post |= processInput(d);    /* comandi arrivati durante la lobby */
+            rearm(d);                   /* in lobby non si leggeva */
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_unlock(&r->connLock);
+    if (post & POST_WINNER) announceWinner(r);
+}
+
+/* esegue le operazioni su tutti i giocatori della stanza chieste da un handler */
+static void runPost(struct room *r, int post) {
+    if (post & POST_START) startGame(r);
+    if (post & POST_WINNER) announceWinner(r);
+}
+
+/* --------------------------------------------------------------------------
+ * idleExpired  [timer]
+ *
+ * Controllo di inattivita': se il client non manda nulla da
+ * gConfig.idleSeconds secondi mentre il server aspetta una sua risposta
+ * (autenticazione o ack del risultato) la connessione si chiude. In lobby
+ * e in partita il silenzio e' lecito e il controllo si ripete e basta.
+ * -------------------------------------------------------------------------- */
+static void idleExpired(void *arg) {
+    struct data *d = arg;
+    struct room *r = d->room;
+    uint64_t idleMs = gConfig.idleSeconds * 1000ull;
+    int post = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->state == ST_CLOSED) {
+        pthread_mutex_unlock(&d->lock);
+        return;
+    }
+    uint64_t quiet = wheelClockMs() - d->lastInput;
+    int waiting = d->state == ST_AUTH || d->state == ST_PASSWORD ||
+                  d->state == ST_RELOGIN || d->state == ST_RESULT;
+    if (d->state == ST_SPECTATE) {
+        /* partita finita ma coda mai svuotata: lo spettatore non legge piu' */
+        pthread_mutex_lock(&d->watch->specLock);
+        waiting = d->specDone;
+        pthread_mutex_unlock(&d->watch->specLock);
+    }
+    if (quiet < idleMs || !waiting) {
+        wheelAdd(&gWheel, &d->idleTimer, quiet < idleMs ? idleMs - quiet : idleMs);
+    } else {
+        char logmsg[512];
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] IDLE: nessun dato da %d s, connessione chiusa",
+                 d->username, d->ip, gConfig.idleSeconds);
+        log_event(logmsg);
+        d->disconnected = 1;
+        post = closeConn(d);
+    }
+    pthread_mutex_unlock(&d->lock);
+    runPost(r, post);
+}
+
+/* --------------------------------------------------------------------------
+ * newRoom
+ *
+ * Crea una stanza con una mappa nuova (o caricata da gConfig.loadPath,
+ * una copia privata per stanza) e la aggiunge a roomList. Si chiama con
+ * roomsMutex preso: una generazione lunga ferma gli altri accept, non le
+ * partite in corso. NULL se fallisce.
+ * -------------------------------------------------------------------------- */
+static struct room *newRoom(void) {
+    char genmsg[512];
+    struct room *r = calloc(1, sizeof(struct room));
+    if (!r) {
+        log_error("calloc in newRoom");
+        return NULL;
+    }
+    /* con -P gli id sono a passo procs: unici fra i processi, anche in score.txt */
+    r->id = gProcIndex + 1 + gConfig.procs * lastRoomId++;
+
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r->seed = rngNext(&serverRng);
+    if (gConfig.loadPath) {
+        /* mappa pronta: nessuna generazione, le pagine del file sono condivise */
+        struct mazeFileHeader hdr;
+        r->map = loadMap(gConfig.loadPath, &hdr);
+        if (!r->map) {
+            log_error("loadMap");
+            free(r);
+            return NULL;
+        }
+        if (!mapSizeFits(r->map->width, r->map->height)) {
+            snprintf(genmsg, sizeof(genmsg), "ROOM: mappa %dx%d in %s troppo grande per il protocollo",
+                     r->map->width, r->map->height, gConfig.loadPath);
+            log_event(genmsg);
+            freeMap(r->map);
+            free(r);
+            return NULL;
+        }
+        snprintf(genmsg, sizeof(genmsg), "[stanza %d] ROOM: mappa %dx%d caricata da %s in %ld us (seme %llu, %llu oggetti)",
+                 r->id, r->map->width, r->map->height, gConfig.loadPath, elapsedUs(&t0),
+                 (unsigned long long)hdr.seed, (unsigned long long)hdr.itemCount);
+    } else {
+        r->map = generateMap(gConfig.algorithm, gConfig.minWidth, gConfig.maxWidth,
+                             gConfig.minHeight, gConfig.maxHeight, r->seed);
+        if (!r->map) {
+            log_event("ROOM: generazione della mappa fallita");
+            free(r);
+            return NULL;
+        }
+        snprintf(genmsg, sizeof(genmsg), "[stanza %d] ROOM: mappa %dx%d generata in %ld us (partita %ds, nebbia ogni %ds%s)",
+                 r->id, r->map->width, r->map->height, elapsedUs(&t0), gConfig.gameSeconds, gConfig.blurSeconds,
+                 gConfig.stress ? ", preset stress" : "");
+    }
+    log_event(genmsg);
+
+    /* distanze dalle uscite: una BFS ora, poi ogni lettura in partita e' O(1) */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r->dist = computeDistField(r->map);
+    if (!r->dist) {
+        log_event("ROOM: calcolo delle distanze dalle uscite fallito");
+        freeMap(r->map);
+        free(r);
+        return NULL;
+    }
+    snprintf(genmsg, sizeof(genmsg), "[stanza %d] ROOM: distanze dalle uscite calcolate in %ld us", r->id, elapsedUs(&t0));
+    log_event(genmsg);
+
+    /* un posto nel diario per ogni oggetto: poi non si rialloca mai */
+    if (journalInit(&r->items, r->map) < 0) {
+        log_error("journalInit");
+        freeDistField(r->dist);
+        freeMap(r->map);
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_mutex_init(&r->connLock, NULL);
+    pthread_mutex_init(&r->specLock, NULL);
+    wheelTimerInit(&r->matchTimer, matchExpired, r);
+    wheelTimerInit(&r->watchTimer, watchExpired, r);
+    r->next = roomList;
+    roomList = r;
+    nRooms++;
+    return r;
+}
+
+/* libera una stanza senza piu' connessioni; solo dal reaper, con roomsMutex */
+static void freeRoom(struct room *r) {
+    char logmsg[128];
+    snprintf(logmsg, sizeof(logmsg), "[stanza %d] ROOM: stanza vuota, risorse liberate", r->id);
+    log_event(logmsg);
+
+    wheelCancel(&gWheel, &r->matchTimer);
+    wheelCancel(&gWheel, &r->watchTimer);
+    sharedRelease(r->world);
+    sharedRelease(r->lastWatch);
+    freeDistField(r->dist);
+    freeMap(r->map);
+    journalFree(&r->items);
+    free(r->users);             /* le versioni sostituite sono in retiredUsers */
+    pthread_mutex_destroy(&r->lock);
+    pthread_mutex_destroy(&r->connLock);
+    pthread_mutex_destroy(&r->specLock);
+    free(r);
+}
+
+/* --------------------------------------------------------------------------
+ * reapClosed
+ *
+ * Libera le connessioni chiuse e le stanze rimaste vuote. Una struct data
+ * chiusa puo' essere ancora in mano a un worker che ha gia' ricevuto da
+ * epoll un suo evento, o a un task della sua strand: la si toglie dalla
+ * stanza (nessun giro sui membri la trova piu') e la si libera solo dopo
+ * un periodo di grazia, quando ogni worker e' ripassato dal punto di
+ * quiete (inizio del ciclo, nessun evento in mano; vedi gQuiet) e la
+ * strand e' vuota. Le callback dei timer girano in handleTick prima del
+ * reaper, quindi nessuna e' in corso.
+ *
+ * Le userSnapshot sostituite (retiredUsers) seguono gli stessi periodi:
+ * le leggono solo i comandi, quindi per loro conta anche che ogni task
+ * del pool in corso all'inizio del periodo sia finito (poolQuietPassed).
+ *
+ * Gira solo dentro handleTick (un worker alla volta, timerfd in
+ * EPOLLONESHOT): graceList, nextGrace e le liste di snapshot non hanno lock.
+ * -------------------------------------------------------------------------- */
+long gWorkers;
+unsigned long *gQuiet;          /* passaggi dal punto di quiete, uno per worker (atomico) */
+static unsigned long *graceSnap; /* gQuiet all'inizio del periodo di grazia */
+static struct data *graceList;  /* aspettano la fine del periodo in corso  */
+static struct data *nextGrace;  /* aspettano il prossimo periodo           */
+static unsigned long *poolSnap; /* gPool->quiet all'inizio del periodo     */
+static struct userSnapshot *graceUsers, *nextGraceUsers;
+
+static void reapClosed(void) {
+    pthread_mutex_lock(&reapMutex);
+    struct data *closed = closedList;
+    closedList = NULL;
+    struct userSnapshot *retired = retiredUsers;
+    retiredUsers = NULL;
+    pthread_mutex_unlock(&reapMutex);
+
+    while (retired) {
+        struct userSnapshot *snap = retired;
+        retired = snap->retireNext;
+        snap->retireNext = nextGraceUsers;
+        nextGraceUsers = snap;
+    }
+
+    while (closed) {
+        struct data *d = closed;
+        closed = d->reapNext;
+        pthread_mutex_lock(&d->room->connLock);
+        *d->roomPprev = d->roomNext;
+        if (d->roomNext) d->roomNext->roomPprev = d->roomPprev;
+        pthread_mutex_unlock(&d->room->connLock);
+        d->reapNext = nextGrace;
+        nextGrace = d;
+    }
+
+    if (graceList || graceUsers) {
+        for (long i = 0; i < gWorkers; i++)
+            if (__atomic_load_n(&gQuiet[i], __ATOMIC_SEQ_CST) == graceSnap[i]) return;
+        if (!poolQuietPassed(gPool, poolSnap)) return;
+
+        while (graceUsers) {
+            struct userSnapshot *snap = graceUsers;
+            graceUsers = snap->retireNext;
+            free(snap);
         }
-        /* nuova connessione TCP in arrivo */
-        if (FD_ISSET(sockfd, &rfds)) {
-            pthread_mutex_lock(&lobbyMutex);
-            if (gameStarted) {
-                pthread_mutex_unlock(&lobbyMutex);   // unlock e scarta la connessione
-                struct sockaddr_in cli;
-                socklen_t clen = sizeof(cli);
-                int cfd = accept(sockfd, (struct sockaddr *)&cli, &clen);
-                if (cfd >= 0) {
-                    char logmsg[256];
-                    snprintf(logmsg, sizeof(logmsg),
-                             "SERVER: rifiutata connessione da %s (partita gia' iniziata)",
-                             inet_ntoa(cli.sin_addr));
-                    log_event(logmsg);
-                    send(cfd, "R", 1, 0);
-                    close(cfd);
+
+        int freed = 0;
+        while (graceList) {
+            struct data *d = graceList;
+            graceList = d->reapNext;
+            if (!poolStrandIdle(&d->strand)) {
+                d->reapNext = nextGrace;    /* comandi ancora in coda: al prossimo giro */
+                nextGrace = d;
+                continue;
+            }
+            pthread_mutex_lock(&roomsMutex);
+            d->room->nMembers--;
+            if (d->watch) d->watch->nMembers--;
+            pthread_mutex_unlock(&roomsMutex);
+            pthread_mutex_destroy(&d->lock);
+            free(d);
+            freed = 1;
+        }
+
+        /* un accept in corso (newRoom) tiene roomsMutex a lungo: si riprova al prossimo tick */
+        if (freed && pthread_mutex_trylock(&roomsMutex) == 0) {
+            for (struct room **pr = &roomList; *pr; ) {
+                struct room *r = *pr;
+                if (r != openRoom && r->nMembers == 0) {
+                    *pr = r->next;
+                    nRooms--;
+                    freeRoom(r);
+                } else {
+                    pr = &r->next;
                 }
-                continue;   // torna al loop, non break
             }
-            pthread_mutex_unlock(&lobbyMutex);       // unlock prima di accept
-        
-            struct sockaddr_in cli;
-            socklen_t clen = sizeof(cli);
-            int cfd = accept(sockfd, (struct sockaddr *)&cli, &clen);
-            if (cfd < 0) { log_error("accept"); continue; }
-        
-            send(cfd, "A", 1, 0);
-        
-            struct data *d = malloc(sizeof(struct data));
-            d->user           = cfd;
-            strncpy(d->ip, inet_ntoa(cli.sin_addr), INET_ADDRSTRLEN - 1);
-            d->ip[INET_ADDRSTRLEN - 1] = '\0';
-            d->map            = map;
-            d->width          = w;
-            d->height         = h;
-            d->collectedItems = 0;
-            d->exitFlag       = 0;
-            d->gameOver       = 0;
-            d->disconnected   = 0;
-            pthread_mutex_init(&(d->socketWriteMutex), NULL);
-        
-            d->visited = malloc(h * sizeof(int *));
-            for (int i = 0; i < h; i++)
-                d->visited[i] = calloc(w, sizeof(int));
-        
-            pthread_mutex_lock(&lobbyMutex);   // ora è libero, nessun deadlock
-            nClients++;
-            pthread_mutex_unlock(&lobbyMutex);
-        
-            pthread_t tid;
-            pthread_create(&tid, NULL, newUser, d);
-            pthread_detach(tid);
-        
-            char logmsg[256];
+            pthread_mutex_unlock(&roomsMutex);
+        }
+    }
+
+    if (!graceList && !graceUsers && (nextGrace || nextGraceUsers)) {
+        graceList = nextGrace;
+        nextGrace = NULL;
+        graceUsers = nextGraceUsers;
+        nextGraceUsers = NULL;
+        for (long i = 0; i < gWorkers; i++)
+            graceSnap[i] = __atomic_load_n(&gQuiet[i], __ATOMIC_SEQ_CST);
+        poolQuietSnap(gPool, poolSnap);
+    }
+}
+
+/* il timerfd e' scattato: la ruota raggiunge l'ora corrente */
+static void handleTick(void) {
+    uint64_t expirations;
+    while (read(gTimerFd, &expirations, sizeof(expirations)) < 0 && errno == EINTR)
+        ;
+    wheelAdvance(&gWheel);
+    reapClosed();
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = &gTimerFd;
+    epoll_ctl(gEpollFd, EPOLL_CTL_MOD, gTimerFd, &ev);
+}
+
+/* task del pool: un comando di gioco, nell'ordine di arrivo */
+static void runCommand(void *arg) {
+    struct command *c = arg;
+    struct data *d = c->d;
+    int post = 0;
+    pthread_mutex_lock(&d->lock);
+    int wasFull = d->queued-- == MAX_QUEUED_COMMANDS;
+    if (d->state == ST_GAMING) post = handleCommand(d, c->type, c->payload, c->len);
+    if (d->state != ST_CLOSED && !d->disconnected && outOverflow(d)) {
+        char logmsg[512];
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] SERVER: il client non legge l'output, connessione chiusa", d->username, d->ip);
+        log_event(logmsg);
+        post |= handleHangup(d);
+    } else if (wasFull && d->state == ST_GAMING) {
+        /* c'e' di nuovo posto sulla strand: si riprende da d->in e dal socket */
+        post |= processInput(d);
+        rearm(d);
+    }
+    pthread_mutex_unlock(&d->lock);
+    free(c);
+    runPost(d->room, post);
+}
+
+/* task del pool: disconnessione in partita, dopo i comandi gia' accodati */
+static void runHangup(void *arg) {
+    struct data *d = arg;
+    int post = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->state != ST_CLOSED) post = handleHangup(d);
+    pthread_mutex_unlock(&d->lock);
+    runPost(d->room, post);
+}
+
+/*
+ * Spettatore: spedisce la coda condivisa, ma solo dopo il proprio output
+ * (MSG_YES) per non mescolare i byte di due frame. A partita finita e coda
+ * vuota chiude la connessione.
+ */
+static int flushSpectator(struct data *d) {
+    struct room *w = d->watch;
+    int res = 0;
+    pthread_mutex_lock(&w->specLock);
+    d->specReady = netBufPending(&d->out) == 0;
+    if (d->specReady) res = sharedQueueFlush(d->user, &d->spec);
+    int done = d->specDone && d->spec.count == 0;
+    pthread_mutex_unlock(&w->specLock);
+
+    if (res < 0) return handleHangup(d);
+    if (done) return closeConn(d);
+    return 0;
+}
+
+/* evento epoll su un client: output in sospeso, poi input */
+static void handleEvent(struct data *d, uint32_t events) {
+    int post = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->state == ST_CLOSED) {
+        pthread_mutex_unlock(&d->lock);
+        return;
+    }
+
+    int eof = 0;
+    if ((events & EPOLLOUT) && netBufFlush(d->user, &d->out) < 0) eof = 1;
+    size_t before = netBufPending(&d->in);
+    if (!eof && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+        netBufFill(d->user, &d->in, MAX_CLIENT_INPUT, &eof) < 0)
+        eof = 1;
+    if (netBufPending(&d->in) != before) d->lastInput = wheelClockMs();
+    /* il client ha chiuso il suo lato ma d->in e' pieno: il resto non si leggera' mai */
+    if ((events & EPOLLRDHUP) && netBufPending(&d->in) >= MAX_CLIENT_INPUT) eof = 1;
+
+    post |= processInput(d);
+    if (!eof && d->state != ST_CLOSED && outOverflow(d)) {
+        char logmsg[512];
+        snprintf(logmsg, sizeof(logmsg), "[%s@%s] SERVER: il client non legge l'output, connessione chiusa", d->username, d->ip);
+        log_event(logmsg);
+        eof = 1;
+    }
+    if (eof && d->state == ST_GAMING) {
+        /* niente piu' invii ne' eventi: la chiusura la fa la strand */
+        d->disconnected = 1;
+        if (poolStrandSubmit(&d->strand, runHangup, d) < 0) post |= handleHangup(d);
+    } else if (eof && d->state != ST_CLOSED) {
+        post |= handleHangup(d);
+    } else if (d->state == ST_SPECTATE) {
+        post |= flushSpectator(d);
+    }
+    rearm(d);
+    pthread_mutex_unlock(&d->lock);
+    runPost(d->room, post);
+}
+
+/* --------------------------------------------------------------------------
+ * acceptClients
+ *
+ * Accetta tutte le connessioni in coda sul socket di ascolto lfd (TCP o
+ * Unix, il percorso e' lo stesso). Ogni connessione entra nella stanza
+ * aperta, o in una nuova se quella ha gia' iniziato la partita; con
+ * gConfig.maxRooms stanze in uso la rifiuta con MSG_REFUSED. Crea la
+ * struttura del client, la aggiunge ai membri della stanza e registra il
+ * socket in epoll.
+ * -------------------------------------------------------------------------- */
+
+/* stanza per una connessione nuova (*n = suo numero nella stanza); NULL se non ce n'e' */
+static struct room *enterRoom(struct data *d, int *n) {
+    pthread_mutex_lock(&roomsMutex);
+    struct room *r = openRoom;
+    if (r) {
+        pthread_mutex_lock(&r->lock);
+        int started = r->started;
+        if (!started) *n = ++r->nClients;
+        pthread_mutex_unlock(&r->lock);
+        if (started) r = openRoom = NULL;   /* startGame non l'ha ancora tolta */
+    }
+    if (!r && nRooms < gConfig.maxRooms && (r = newRoom()) != NULL) {
+        openRoom = r;
+        *n = r->nClients = 1;   /* nessun altro la vede prima di roomsMutex */
+    }
+    if (r) {
+        r->nMembers++;
+        d->room = r;
+        rngSeed(&d->rng, rngNext(&serverRng));
+    }
+    pthread_mutex_unlock(&roomsMutex);
+    return r;
+}
+
+/* indirizzo del client per i log: IP per TCP, "unix" per il socket locale */
+static void peerName(const struct sockaddr_storage *ss, char *out, size_t len) {
+    if (ss->ss_family == AF_INET)
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)ss)->sin_addr, out, len);
+    else
+        snprintf(out, len, "unix");
+}
+
+static void acceptClients(int lfd) {
+    struct sockaddr_storage cli;
+    socklen_t clen = sizeof(cli);
+    int cfd;
+    char logmsg[256];
+    char ip[INET_ADDRSTRLEN];
+
+    while ((cfd = accept(lfd, (struct sockaddr *)&cli, &clen)) >= 0) {
+        clen = sizeof(cli);
+        peerName(&cli, ip, sizeof(ip));
+        fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+        struct data *d = calloc(1, sizeof(struct data));
+        if (!d) {
+            log_error("calloc in acceptClients");
+            close(cfd);
+            continue;
+        }
+        d->view.phase = PLAYER_HIDDEN;  /* prima di entrare in members: gli spettatori la vedono da subito */
+        int n;
+        struct room *r = enterRoom(d, &n);
+        if (!r) {
             snprintf(logmsg, sizeof(logmsg),
-                     "SERVER: connessione accettata da %s (client #%d)",
-                     inet_ntoa(cli.sin_addr), nClients);
+                     "SERVER: rifiutata connessione da %s (nessuna stanza libera)", ip);
+            log_event(logmsg);
+            sendFrame(cfd, MSG_REFUSED, NULL, 0);
+            close(cfd);
+            free(d);
+            continue;
+        }
+        d->user = cfd;
+        memcpy(d->ip, ip, sizeof(d->ip));   /* peerName lo ha gia' terminato entro INET_ADDRSTRLEN */
+        d->map   = r->map;
+        d->dist  = r->dist;
+        d->state = ST_AUTH;
+        pthread_mutex_init(&d->lock, NULL);
+        wheelTimerInit(&d->fogTimer, fogExpired, d);
+        wheelTimerInit(&d->idleTimer, idleExpired, d);
+        poolStrandInit(&d->strand, gPool);
+        d->lastInput = wheelClockMs();
+
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        d->visited = allocBitmap(r->map->width, r->map->height);
+        if (!d->visited || fogInit(&d->fog, r->map->width, r->map->height) < 0) {
+            log_event("SERVER: memoria esaurita, connessione scartata");
+            freeBitmap(d->visited);
+            close(cfd);
+            runPost(r, leaveRoom(r));
+            pthread_mutex_lock(&roomsMutex);
+            r->nMembers--;
+            pthread_mutex_unlock(&roomsMutex);
+            free(d);
+            continue;
+        }
+        if (gConfig.stress) {
+            char stressmsg[128];
+            snprintf(stressmsg, sizeof(stressmsg), "STRESS: bitmap visited allocata in %ld us",
+                     elapsedUs(&t0));
+            log_event(stressmsg);
+        }
+
+        pthread_mutex_lock(&r->connLock);
+        d->roomNext = r->members;
+        if (r->members) r->members->roomPprev = &d->roomNext;
+        r->members = d;
+        d->roomPprev = &r->members;
+        pthread_mutex_unlock(&r->connLock);
+
+        snprintf(logmsg, sizeof(logmsg),
+                 "SERVER: connessione accettata da %s (stanza %d, client #%d)", d->ip, r->id, n);
+        log_event(logmsg);
+
+        /* registrazione e primo frame sotto lock: nessun evento prima della fine */
+        pthread_mutex_lock(&d->lock);
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = d;
+        epoll_ctl(gEpollFd, EPOLL_CTL_ADD, cfd, &ev);
+        connFrame(d, MSG_ACCEPTED, NULL, 0);
+        wheelAdd(&gWheel, &d->idleTimer, gConfig.idleSeconds * 1000ull);
+        pthread_mutex_unlock(&d->lock);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        log_error("accept");
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = lfd == gUnixFd ? (void *)&gUnixFd : (void *)&gListenFd;
+    epoll_ctl(gEpollFd, EPOLL_CTL_MOD, lfd, &ev);
+}
+
+/* --------------------------------------------------------------------------
+ * worker  [thread]
+ *
+ * Uno per core. Prende eventi dall'istanza epoll condivisa: data.ptr
+ * &gListenFd o &gUnixFd e' un socket di ascolto, &gTimerFd il timerfd
+ * della ruota, altrimenti la struttura del client. arg e' l'indice del
+ * worker in gQuiet.
+ * -------------------------------------------------------------------------- */
+static void *worker(void *arg) {
+    long self = (long)arg;
+    unsigned long quiet = 0;
+    struct epoll_event events[WORKER_EVENTS];
+    while (1) {
+        /* punto di quiete: gli eventi del giro precedente sono stati gestiti */
+        __atomic_store_n(&gQuiet[self], ++quiet, __ATOMIC_SEQ_CST);
+        int n = epoll_wait(gEpollFd, events, WORKER_EVENTS, WORKER_WAIT_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_error("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &gListenFd || tag == &gUnixFd) acceptClients(*(int *)tag);
+            else if (tag == &gTimerFd) handleTick();
+            else handleEvent(tag, events[i].events);
+        }
+    }
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ * main
+ *
+ * Apre il log, azzera score.txt, crea i socket di ascolto (TCP e Unix) e
+ * la prima stanza. Poi avvia il reattore (epoll + timerfd + worker, vedi
+ * sopra): le partite si susseguono nelle stanze senza riavviare il
+ * processo, che termina solo con SIGINT o SIGTERM.
+ *
+ * Opzioni:
+ *   -s <seme>     seme della partita (mappa e spawn riproducibili);
+ *                 senza -s il seme viene preso dal sistema e scritto nel log
+ *   -W <min[:max]> larghezza della mappa (o intervallo da cui ogni stanza la estrae)
+ *   -H <min[:max]> altezza della mappa
+ *   -t <secondi>  durata della partita
+ *   -b <secondi>  intervallo tra due invii di nebbia
+ *   -i <secondi>  inattivita' tollerata durante auth e attesa dell'ack finale
+ *   -g <alg>      algoritmo di generazione: dfs (default), tiles
+ *                 (blocchi scavati in parallelo su tutti i core) o eller
+ *                 (riga per riga, memoria di lavoro O(larghezza))
+ *   -m <file>     carica la mappa da un file mappa (mmap), niente generazione:
+ *                 tutte le stanze giocano sulla stessa mappa
+ *   -o <file>     salva la mappa della prima stanza in un file mappa
+ *   -S            preset di stress; le opzioni successive lo sovrascrivono
+ *   -p <porta>    porta TCP (default 8080)
+ *   -u <percorso> socket Unix (default maze.sock); -u "" lo disattiva
+ *   -r <n>        stanze in uso al piu' nello stesso momento (default 16;
+ *                 con -P vale per ogni processo)
+ *   -P <n>        n processi server sulla stessa porta (vedi preforkServers)
+ * -------------------------------------------------------------------------- */
+static void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [-s seme] [-W min[:max]] [-H min[:max]] [-t secondi] [-b secondi] [-i secondi] [-g dfs|tiles|eller] [-m file] [-o file] [-S] [-p porta] [-u socket] [-r stanze] [-P processi]\n", prog);
+    exit(1);
+}
+
+/*
+ * socket TCP in ascolto su tutte le interfacce; con reusePort piu' processi
+ * legano la stessa porta e il kernel divide tra loro le connessioni.
+ * -1 se fallisce
+ */
+static int listenTcp(int port, int reusePort) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_error("socket");
+        return -1;
+    }
+
+    /* riuso immediato della porta dopo un riavvio (evita "Address already in use") */
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        log_error("SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in srv = {0};
+    srv.sin_family      = AF_INET;
+    srv.sin_port        = htons(port);
+    srv.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(fd, (struct sockaddr *)&srv, sizeof(srv)) < 0) {
+        log_error("bind");
+        close(fd);
+        return -1;
+    }
+    listen(fd, SOMAXCONN);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* socket Unix stream sul percorso dato; -1 se fallisce */
+static int listenUnix(const char *path) {
+    struct sockaddr_un srv = {0};
+    if (strlen(path) >= sizeof(srv.sun_path)) {
+        log_event("SERVER: percorso del socket Unix troppo lungo");
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_error("socket unix");
+        return -1;
+    }
+    srv.sun_family = AF_UNIX;
+    strcpy(srv.sun_path, path);
+
+    /* il file di un'esecuzione precedente impedirebbe il bind */
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&srv, sizeof(srv)) < 0) {
+        log_error("bind unix");
+        close(fd);
+        return -1;
+    }
+    listen(fd, SOMAXCONN);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* --------------------------------------------------------------------------
+ * preforkServers  (-P)
+ *
+ * Crea gConfig.procs processi figli, ognuno un server completo (reattore,
+ * pool, stanze, ruota) con il proprio socket TCP sulla stessa porta: con
+ * SO_REUSEPORT il kernel divide le connessioni fra i socket e ogni
+ * processo accetta per conto suo. Una stanza non esce dal processo che
+ * l'ha creata, quindi fra processi non serve alcun lock; in comune
+ * restano solo i file (log e score.txt in append). Il socket Unix e'
+ * uno solo, aperto dal padre: lo ereditano e lo accettano tutti.
+ *
+ * Nel figlio ritorna il suo indice. Il padre non ritorna: gira SIGINT e
+ * SIGTERM ai figli e termina quando sono usciti tutti. Si chiama prima
+ * di creare qualunque thread.
+ * -------------------------------------------------------------------------- */
+static int preforkServers(void) {
+    char logmsg[128];
+    sigset_t set, chld;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGCHLD);
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    /* bloccati prima della fork: nessun segnale si perde fra fork e sigwait */
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    pid_t *pids = calloc(gConfig.procs, sizeof(pid_t));
+    if (!pids) {
+        log_error("calloc in preforkServers");
+        exit(1);
+    }
+    int alive = 0;
+    for (int i = 0; i < gConfig.procs; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            free(pids);
+            sigprocmask(SIG_UNBLOCK, &chld, NULL);
+            return i;
+        }
+        if (pid < 0) {
+            log_error("fork in preforkServers");
+            break;
+        }
+        pids[alive++] = pid;
+    }
+    snprintf(logmsg, sizeof(logmsg), "SERVER: %d processi avviati sulla porta %d", alive, gConfig.port);
+    log_event(logmsg);
+
+    while (alive > 0) {
+        int sig;
+        sigwait(&set, &sig);
+        if (sig != SIGCHLD) {
+            for (int i = 0; i < gConfig.procs; i++)
+                if (pids[i] > 0) kill(pids[i], SIGTERM);
+            continue;
+        }
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < gConfig.procs; i++)
+                if (pids[i] == pid) pids[i] = 0;
+            alive--;
+            snprintf(logmsg, sizeof(logmsg), "SERVER: processo %d uscito (stato %d)", (int)pid, status);
             log_event(logmsg);
         }
     }
+    log_event("SERVER: tutti i processi terminati");
+    if (gUnixFd >= 0) unlink(gConfig.unixPath);
+    close(gLogFd);
+    exit(0);
+}
+
+/* legge "n" oppure "min:max" in *lo e *hi; ritorna -1 se non valido */
+static int parseRange(const char *arg, int *lo, int *hi) {
+    char *end;
+    long a = strtol(arg, &end, 10), b = a;
+    if (*end == ':') b = strtol(end + 1, &end, 10);
+    if (*end != '\0' || a < 3 || b < a || b > 100000) return -1;
+    *lo = (int)a;
+    *hi = (int)b;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t seed = 0;
+    int haveSeed = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:W:H:t:b:i:g:m:o:Sp:u:r:P:")) != -1) {
+        switch (opt) {
+            case 's':
+                seed = strtoull(optarg, NULL, 0);
+                haveSeed = 1;
+                break;
+            case 'W':
+                if (parseRange(optarg, &gConfig.minWidth, &gConfig.maxWidth) < 0) usage(argv[0]);
+                break;
+            case 'H':
+                if (parseRange(optarg, &gConfig.minHeight, &gConfig.maxHeight) < 0) usage(argv[0]);
+                break;
+            case 't':
+                gConfig.gameSeconds = atoi(optarg);
+                if (gConfig.gameSeconds <= 0) usage(argv[0]);
+                break;
+            case 'b':
+                gConfig.blurSeconds = atoi(optarg);
+                if (gConfig.blurSeconds <= 0) usage(argv[0]);
+                break;
+            case 'i':
+                gConfig.idleSeconds = atoi(optarg);
+                if (gConfig.idleSeconds <= 0) usage(argv[0]);
+                break;
+            case 'g':
+                if (strcmp(optarg, "dfs") == 0)        gConfig.algorithm = MAP_DFS;
+                else if (strcmp(optarg, "tiles") == 0) gConfig.algorithm = MAP_TILED;
+                else if (strcmp(optarg, "eller") == 0) gConfig.algorithm = MAP_ELLER;
+                else usage(argv[0]);
+                break;
+            case 'm':
+                gConfig.loadPath = optarg;
+                break;
+            case 'o':
+                gConfig.savePath = optarg;
+                break;
+            case 'S':
+                gConfig.minWidth  = gConfig.maxWidth  = STRESS_SIDE;
+                gConfig.minHeight = gConfig.maxHeight = STRESS_SIDE;
+                gConfig.gameSeconds = STRESS_TIMER;
+                gConfig.blurSeconds = STRESS_SECONDS_TO_BLUR;
+                gConfig.stress = 1;
+                break;
+            case 'p':
+                gConfig.port = atoi(optarg);
+                if (gConfig.port <= 0 || gConfig.port > 65535) usage(argv[0]);
+                break;
+            case 'u':
+                gConfig.unixPath = optarg;
+                break;
+            case 'r':
+                gConfig.maxRooms = atoi(optarg);
+                if (gConfig.maxRooms <= 0) usage(argv[0]);
+                break;
+            case 'P':
+                gConfig.procs = atoi(optarg);
+                if (gConfig.procs <= 0) usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!haveSeed) seed = rngEntropySeed();
+    if (!mapSizeFits(gConfig.maxWidth, gConfig.maxHeight)) {
+        fprintf(stderr, "%s: mappa %dx%d troppo grande (indici di cella a 32 bit, frame al piu' %u byte)\n",
+                argv[0], gConfig.maxWidth, gConfig.maxHeight, FRAME_MAX_PAYLOAD);
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN); /* send() su socket chiuso ritorna -1 invece di killare il processo */
+
+    /* azzera i file di stato all'avvio: ogni sessione parte da zero */
+    close(open("score.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+    /* apre il log globale: tutti i thread (e con -P tutti i processi) scriveranno qui tramite gLogFd */
+    gLogFd = open("filelog.txt", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (gLogFd < 0) {
+        //log non disponibile
+        const char *err = "FATAL: impossibile aprire filelog.txt\n";
+        write(STDERR_FILENO, err, strlen(err));
+        exit(1);
+    }
+
+    log_event("SERVER: avvio in corso");
+
+    if (gConfig.unixPath[0] != '\0') {
+        gUnixFd = listenUnix(gConfig.unixPath);
+        if (gUnixFd < 0) exit(1);
+    }
+    if (gConfig.procs > 1) gProcIndex = preforkServers();
+    gListenFd = listenTcp(gConfig.port, gConfig.procs > 1);
+    if (gListenFd < 0) exit(1);
+
+    /* un solo seme decide le mappe delle stanze e, tramite semi derivati, gli spawn */
+    rngSeed(&serverRng, seed + gProcIndex);
+    char seedmsg[128];
+    if (gConfig.procs > 1)
+        snprintf(seedmsg, sizeof(seedmsg), "SERVER: processo %d/%d (pid %d), seme %llu",
+                 gProcIndex + 1, gConfig.procs, (int)getpid(), (unsigned long long)(seed + gProcIndex));
+    else
+        snprintf(seedmsg, sizeof(seedmsg), "SERVER: seme della partita %llu", (unsigned long long)seed);
+    log_event(seedmsg);
+
+    /* la prima stanza subito: mappa pronta prima della prima connessione */
+    openRoom = newRoom();
+    if (!openRoom) {
+        log_event("FATAL: creazione della prima stanza fallita");
+        exit(1);
+    }
+    char genmsg[512];
+    /* con -P salva solo il primo processo: gli altri scriverebbero lo stesso file insieme */
+    if (gConfig.savePath && !gConfig.loadPath && gProcIndex == 0) {
+        if (saveMap(gConfig.savePath, openRoom->map, openRoom->seed) < 0)
+            log_error("saveMap");
+        else {
+            snprintf(genmsg, sizeof(genmsg), "SERVER: mappa salvata in %s", gConfig.savePath);
+            log_event(genmsg);
+        }
+    }
+
+    /* ----- REATTORE: epoll + un worker per core ----- */
+    gEpollFd = epoll_create1(0);
+    if (gEpollFd < 0) {
+        log_error("epoll_create1");
+        exit(1);
+    }
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = &gListenFd;
+    epoll_ctl(gEpollFd, EPOLL_CTL_ADD, gListenFd, &ev);
+    if (gUnixFd >= 0) {
+        ev.data.ptr = &gUnixFd;
+        epoll_ctl(gEpollFd, EPOLL_CTL_ADD, gUnixFd, &ev);
+    }
+
+    /* tempo: un tick della ruota per ogni scatto del timerfd */
+    wheelInit(&gWheel, WHEEL_TICK_MS);
+    gTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (gTimerFd < 0) {
+        log_error("timerfd_create");
+        exit(1);
+    }
+    struct itimerspec tick = {0};
+    tick.it_interval.tv_nsec = WHEEL_TICK_MS * 1000000L;
+    tick.it_value = tick.it_interval;
+    timerfd_settime(gTimerFd, 0, &tick, NULL);
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = &gTimerFd;
+    epoll_ctl(gEpollFd, EPOLL_CTL_ADD, gTimerFd, &ev);
+
+    /* SIGINT e SIGTERM li aspetta solo il main (sigwait): i thread nascono con i segnali bloccati */
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+
+    /* da qui il log passa dallo scrittore; exit() svuota la coda prima di uscire */
+    logStart();
+    atexit(logStop);
+
+    /* con -P i core si dividono fra i processi */
+    long nWorkers = sysconf(_SC_NPROCESSORS_ONLN) / gConfig.procs;
+    if (nWorkers < 1) nWorkers = 1;
+    gPool = poolCreate(nWorkers);
+    gWorkers  = nWorkers;
+    gQuiet    = calloc(nWorkers, sizeof(unsigned long));
+    graceSnap = calloc(nWorkers, sizeof(unsigned long));
+    poolSnap  = calloc(nWorkers, sizeof(unsigned long));
+    if (!gPool || !gQuiet || !graceSnap || !poolSnap) {
+        log_event("FATAL: avvio del pool dei comandi fallito");
+        exit(1);
+    }
+    for (long i = 0; i < nWorkers; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, worker, (void *)i);
+        pthread_detach(tid);
+    }
+    snprintf(genmsg, sizeof(genmsg), "SERVER: in ascolto sulla porta %d%s%s (%ld worker, %ld nel pool comandi)",
+             gConfig.port, gUnixFd >= 0 ? " e su " : "", gUnixFd >= 0 ? gConfig.unixPath : "",
+             nWorkers, nWorkers);
+    log_event(genmsg);
+
+    /* il main dorme finche' non gli chiedono di fermarsi */
+    int sig;
+    sigwait(&stopSignals, &sig);
+
     log_event("SERVER: socket chiuso, processo terminato");
-    sleep(5);
-    close(sockfd);
+    close(gListenFd);
+    if (gUnixFd >= 0) {
+        close(gUnixFd);
+        if (gConfig.procs == 1) unlink(gConfig.unixPath);  /* con -P lo toglie il padre */
+    }
+    logStop();
     close(gLogFd);
     return 0;
 }
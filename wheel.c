@@ -0,0 +1,130 @@
+#include "wheel.h"
+#include <time.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+uint64_t wheelClockMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void wheelInit(struct timerWheel *w, unsigned tickMs) {
+    pthread_mutex_init(&w->lock, NULL);
+    w->origin = wheelClockMs();
+    w->now    = 0;
+    w->tickMs = tickMs ? tickMs : 1;
+    for (int l = 0; l < WHEEL_LEVELS; l++)
+        for (int i = 0; i < WHEEL_SLOTS; i++) w->slot[l][i] = NULL;
+    w->firing = NULL;
+}
+
+void wheelTimerInit(struct wheelTimer *t, void (*fn)(void *), void *arg) {
+    t->next    = NULL;
+    t->pprev   = NULL;
+    t->expires = 0;
+    t->fn      = fn;
+    t->arg     = arg;
+}
+
+static void linkTimer(struct wheelTimer **head, struct wheelTimer *t) {
+    t->next = *head;
+    if (*head) (*head)->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+static void unlinkTimer(struct wheelTimer *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next  = NULL;
+    t->pprev = NULL;
+}
+
+/*
+ * Sceglie il livello piu' basso in cui scadenza e tick corrente stanno
+ * nello stesso giro della ruota superiore: lo slot e' allora sicuramente
+ * davanti al cursore e verra' raggiunto (o fatto scendere) in tempo.
+ * La ruota alta non ha una ruota sopra: basta che la scadenza cada entro
+ * un suo giro.
+ */
+static void placeTimer(struct timerWheel *w, struct wheelTimer *t) {
+    uint64_t e = t->expires;
+    int l = 0;
+    while (l < WHEEL_LEVELS - 1 && (e >> (WHEEL_BITS * (l + 1))) != (w->now >> (WHEEL_BITS * (l + 1))))
+        l++;
+
+    uint64_t slotE = e >> (WHEEL_BITS * l), slotNow = w->now >> (WHEEL_BITS * l);
+    unsigned idx;
+    if (slotE - slotNow >= WHEEL_SLOTS)
+        // oltre l'orizzonte: l'ultimo slot del giro, poi si riposiziona
+        idx = (slotNow - 1) & WHEEL_MASK;
+    else
+        idx = slotE & WHEEL_MASK;
+    linkTimer(&w->slot[l][idx], t);
+}
+
+void wheelAdd(struct timerWheel *w, struct wheelTimer *t, uint64_t delayMs) {
+    pthread_mutex_lock(&w->lock);
+    if (t->pprev) unlinkTimer(t);
+    // il tick si calcola dall'orologio: la ruota puo' essere indietro di qualche tick
+    uint64_t ticks = (delayMs + w->tickMs - 1) / w->tickMs;
+    uint64_t cur = (wheelClockMs() - w->origin) / w->tickMs;
+    if (cur < w->now) cur = w->now;
+    t->expires = cur + (ticks ? ticks : 1);
+    placeTimer(w, t);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void wheelCancel(struct timerWheel *w, struct wheelTimer *t) {
+    pthread_mutex_lock(&w->lock);
+    if (t->pprev) unlinkTimer(t);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* svuota uno slot e reinserisce i suoi timer ai livelli inferiori */
+static void cascade(struct timerWheel *w, int l) {
+    struct wheelTimer *t = w->slot[l][(w->now >> (WHEEL_BITS * l)) & WHEEL_MASK];
+    while (t) {
+        struct wheelTimer *next = t->next;
+        t->pprev = NULL;
+        placeTimer(w, t);
+        t = next;
+    }
+    w->slot[l][(w->now >> (WHEEL_BITS * l)) & WHEEL_MASK] = NULL;
+}
+
+int wheelAdvance(struct timerWheel *w) {
+    int fired = 0;
+    pthread_mutex_lock(&w->lock);
+    uint64_t target = (wheelClockMs() - w->origin) / w->tickMs;
+    while (w->now < target) {
+        w->now++;
+        // prima le ruote alte, dall'ultima il cui giro e' appena finito
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 && (w->now & ((1ull << (WHEEL_BITS * (top + 1))) - 1)) == 0)
+            top++;
+        for (int l = top; l > 0; l--) cascade(w, l);
+
+        struct wheelTimer **slot = &w->slot[0][w->now & WHEEL_MASK];
+        while (*slot) {
+            struct wheelTimer *t = *slot;
+            unlinkTimer(t);
+            linkTimer(&w->firing, t);
+        }
+    }
+
+    // callback fuori dal lock: un timer cancellato nel frattempo lascia firing
+    while (w->firing) {
+        struct wheelTimer *t = w->firing;
+        unlinkTimer(t);
+        void (*fn)(void *) = t->fn;
+        void *arg = t->arg;
+        pthread_mutex_unlock(&w->lock);
+        fn(arg);
+        fired++;
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return fired;
+}
@@ -0,0 +1,63 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Timer wheel gerarchico: WHEEL_LEVELS ruote da WHEEL_SLOTS slot, la
+ * ruota 0 ha la risoluzione di un tick, ognuna delle successive copre
+ * un giro intero della precedente per slot. Armare e cancellare un timer
+ * costa O(1); i timer delle ruote alte scendono di livello ("cascata")
+ * quando il tempo raggiunge il loro slot. Con 4 livelli da 64 slot e
+ * tick da 50 ms l'orizzonte supera le 9 ore; i timer oltre l'orizzonte
+ * vengono riposizionati a ogni giro della ruota piu' alta.
+ *
+ * I timer sono intrusivi (struct wheelTimer dentro la struttura che li
+ * usa): la ruota non alloca nulla. Il tempo avanza solo con wheelAdvance,
+ * di solito pilotata da un timerfd periodico.
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct wheelTimer {
+    struct wheelTimer  *next;
+    struct wheelTimer **pprev;  /* NULL se il timer non e' armato         */
+    uint64_t expires;           /* tick di scadenza                       */
+    void (*fn)(void *arg);      /* callback, chiamata senza il lock ruota */
+    void *arg;
+};
+
+struct timerWheel {
+    pthread_mutex_t lock;
+    uint64_t origin;            /* ms monotoni corrispondenti al tick 0   */
+    uint64_t now;               /* ultimo tick elaborato                  */
+    unsigned tickMs;
+    struct wheelTimer *slot[WHEEL_LEVELS][WHEEL_SLOTS];
+    struct wheelTimer *firing;  /* scaduti, in attesa della callback      */
+};
+
+// Millisecondi da CLOCK_MONOTONIC, la stessa base usata dalla ruota
+uint64_t wheelClockMs(void);
+// Ruota vuota con tick da tickMs millisecondi, che parte da adesso
+void wheelInit(struct timerWheel *w, unsigned tickMs);
+void wheelTimerInit(struct wheelTimer *t, void (*fn)(void *), void *arg);
+// Arma t tra delayMs millisecondi (almeno un tick); se era armato lo sposta
+void wheelAdd(struct timerWheel *w, struct wheelTimer *t, uint64_t delayMs);
+// Disarma t; nessun effetto se non era armato
+void wheelCancel(struct timerWheel *w, struct wheelTimer *t);
+static inline int wheelPending(const struct wheelTimer *t) {
+    return t->pprev != NULL;
+}
+/*
+ * Porta la ruota all'ora corrente e chiama le callback dei timer scaduti,
+ * una alla volta e senza tenere il lock della ruota: una callback puo'
+ * riarmare il proprio timer o armarne/cancellarne altri. Un timer
+ * cancellato mentre la sua callback e' gia' partita non la ferma, quindi
+ * la callback deve ricontrollare lo stato dell'oggetto a cui appartiene.
+ * Ritorna il numero di callback eseguite.
+ */
+int wheelAdvance(struct timerWheel *w);
+
+#endif